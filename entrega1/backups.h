@@ -0,0 +1,47 @@
+#ifndef KVS_BACKUPS_H
+#define KVS_BACKUPS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/// Bounds the backup children writing at once without making job threads wait.
+///
+/// A child writing a backup holds one of max_backups slots. A BACKUP run while
+/// every slot is in use is queued, and queued backups are started in order, by
+/// forking their child, as slots free up. A manager thread watches the children
+/// with pidfds, reaps each one as it exits and gives its slot to the next queued
+/// backup.
+
+/// Starts a queued backup, which now holds a slot.
+/// @param arg Argument given to backups_enqueue.
+typedef void (*backup_start_t)(void* arg);
+
+/// Starts the manager thread.
+/// @param max_backups Number of slots, children writing at once.
+/// @return 0 if successful, 1 otherwise.
+int backups_init(size_t max_backups);
+
+/// Takes a slot if one is free, never waiting.
+/// @return 1 if a slot was taken, 0 if every slot is in use or backups are queued already.
+int backups_try_acquire();
+
+/// Gives a slot back, for a child that was never forked. The slot goes to the oldest
+/// queued backup if there is one, which is started by the calling thread.
+void backups_release();
+
+/// Queues a backup until a slot frees up.
+/// @param start Called with arg once the backup has a slot.
+/// @param arg Passed to start.
+/// @return 0 if successful, 1 otherwise.
+int backups_enqueue(backup_start_t start, void* arg);
+
+/// Hands a backup child holding a slot to the manager thread, which reaps it and
+/// releases its slot when it exits.
+/// @param pid The child.
+/// @return 0 if successful, 1 otherwise.
+int backups_track_child(pid_t pid);
+
+/// Waits until every queued and running backup is written.
+void backups_drain();
+
+#endif // KVS_BACKUPS_H
@@ -4,3 +4,4 @@
 #define JOB_FILE ".job"
 #define OUT_FILE ".out"
 #define BACKUP_FILE ".bck"
+#define JOB_QUEUE_SIZE 64
@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "io.h"
+
+#define OUTBUF_IOV_MAX 64  // Chunks written by each writev call
+
+const PairFormat PAIR_RESULT = {",", 1, ")", 1};
+const PairFormat PAIR_LINE = {", ", 2, ")\n", 2};
+
+/// Write every byte of a set of buffers, retrying on partial writes.
+/// @param fd File descriptor to write to.
+/// @param iov Buffers to write, consumed by the call.
+/// @param count Number of buffers.
+/// @return 0 if all bytes were written, 1 otherwise.
+static int writev_all(int fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return 1;
+    }
+
+    size_t done = (size_t)written;
+    while (count > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return 0;
+}
+
+/// Empty a buffer, keeping its first chunk for the next writes.
+/// @param buf Buffer to empty.
+static void outbuf_clear(OutBuffer* buf) {
+  if (buf->head == NULL) return;
+
+  OutChunk* chunk = buf->head->next;
+  while (chunk != NULL) {
+    OutChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  buf->head->next = NULL;
+  buf->head->len = 0;
+  buf->tail = NULL;
+  buf->len = 0;
+}
+
+/// Move the tail of a buffer to an empty chunk, allocating it if needed.
+/// @param buf Buffer to grow.
+/// @return The new tail, NULL if it could not be allocated.
+static OutChunk* outbuf_grow(OutBuffer* buf) {
+  // A cleared buffer starts filling its kept first chunk again
+  OutChunk* chunk = buf->tail != NULL ? buf->tail->next : buf->head;
+  if (chunk == NULL) {
+    chunk = (OutChunk*) malloc(sizeof(OutChunk));
+    if (chunk == NULL) return NULL;
+    chunk->next = NULL;
+    if (buf->tail == NULL) {
+      buf->head = chunk;
+    } else {
+      buf->tail->next = chunk;
+    }
+  }
+  chunk->len = 0;
+  buf->tail = chunk;
+  return chunk;
+}
+
+size_t pair_length(const PairFormat* fmt, size_t key_len, size_t value_len) {
+  return 1 + key_len + fmt->sep_len + value_len + fmt->end_len;
+}
+
+size_t pair_format(char* dest, const PairFormat* fmt, const char* key, size_t key_len, const char* value, size_t value_len) {
+  char* p = dest;
+  *p++ = '(';
+  memcpy(p, key, key_len);
+  p += key_len;
+  memcpy(p, fmt->sep, fmt->sep_len);
+  p += fmt->sep_len;
+  memcpy(p, value, value_len);
+  p += value_len;
+  memcpy(p, fmt->end, fmt->end_len);
+  p += fmt->end_len;
+  return (size_t)(p - dest);
+}
+
+void outbuf_init(OutBuffer* buf) {
+  buf->head = NULL;
+  buf->tail = NULL;
+  buf->len = 0;
+}
+
+int outbuf_append(OutBuffer* buf, const char* data, size_t len) {
+  while (len > 0) {
+    OutChunk* chunk = buf->tail;
+    if (chunk == NULL || chunk->len == OUTBUF_CHUNK_SIZE) {
+      chunk = outbuf_grow(buf);
+      if (chunk == NULL) return 1;
+    }
+
+    size_t n = OUTBUF_CHUNK_SIZE - chunk->len;
+    if (n > len) n = len;
+    memcpy(chunk->data + chunk->len, data, n);
+    chunk->len += n;
+    buf->len += n;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int outbuf_pair(OutBuffer* buf, const PairFormat* fmt, const char* key, size_t key_len, const char* value, size_t value_len) {
+  size_t len = pair_length(fmt, key_len, value_len);
+  if (len > OUTBUF_CHUNK_SIZE) {
+    return outbuf_append(buf, "(", 1) | outbuf_append(buf, key, key_len) |
+           outbuf_append(buf, fmt->sep, fmt->sep_len) | outbuf_append(buf, value, value_len) |
+           outbuf_append(buf, fmt->end, fmt->end_len);
+  }
+
+  // Pairs are kept whole inside a chunk, the rest of a full one is left unused
+  OutChunk* chunk = buf->tail;
+  if (chunk == NULL || OUTBUF_CHUNK_SIZE - chunk->len < len) {
+    chunk = outbuf_grow(buf);
+    if (chunk == NULL) return 1;
+  }
+  chunk->len += pair_format(chunk->data + chunk->len, fmt, key, key_len, value, value_len);
+  buf->len += len;
+  return 0;
+}
+
+int outbuf_flush(OutBuffer* buf, int fd) {
+  if (buf->len == 0) return 0;
+
+  struct iovec iov[OUTBUF_IOV_MAX];
+  OutChunk* chunk = buf->head;
+  int result = 0;
+  while (chunk != NULL && result == 0) {
+    int count = 0;
+    while (chunk != NULL && count < OUTBUF_IOV_MAX) {
+      iov[count].iov_base = chunk->data;
+      iov[count].iov_len = chunk->len;
+      count++;
+      chunk = chunk == buf->tail ? NULL : chunk->next;
+    }
+    result = writev_all(fd, iov, count);
+  }
+
+  outbuf_clear(buf);
+  return result;
+}
+
+int outbuf_flush_full(OutBuffer* buf, int fd) {
+  if (buf->len < OUTBUF_FLUSH_SIZE) return 0;
+  return outbuf_flush(buf, fd);
+}
+
+void outbuf_free(OutBuffer* buf) {
+  OutChunk* chunk = buf->head;
+  while (chunk != NULL) {
+    OutChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  outbuf_init(buf);
+}
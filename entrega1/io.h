@@ -0,0 +1,89 @@
+#ifndef KVS_IO_H
+#define KVS_IO_H
+
+#include <stddef.h>
+
+#define OUTBUF_CHUNK_SIZE 4096   // Bytes per chunk of an output buffer
+#define OUTBUF_FLUSH_SIZE 65536  // Buffered bytes that trigger a flush
+
+/// Fixed-size piece of an output buffer.
+typedef struct OutChunk {
+  struct OutChunk* next;         // Next chunk, NULL for the last one
+  size_t len;                    // Number of bytes in use
+  char data[OUTBUF_CHUNK_SIZE];  // Buffered bytes
+} OutChunk;
+
+/// Collects the output of a job before it is written to the output file.
+/// Grows by chunks and writes all of them with a single writev.
+typedef struct OutBuffer {
+  OutChunk* head;  // First chunk, NULL while nothing was ever buffered
+  OutChunk* tail;  // Chunk being filled
+  size_t len;      // Number of bytes buffered
+} OutBuffer;
+
+/// Separators of a formatted key value pair, "(key<sep>value<end>".
+typedef struct PairFormat {
+  const char* sep;  // Between the key and the value
+  size_t sep_len;
+  const char* end;  // After the value
+  size_t end_len;
+} PairFormat;
+
+extern const PairFormat PAIR_RESULT;  // "(key,value)", for READ and DELETE
+extern const PairFormat PAIR_LINE;    // "(key, value)\n", for SHOW and backups
+
+/// Computes the length of a formatted pair.
+/// @param fmt Separators of the pair.
+/// @param key_len Length of the key.
+/// @param value_len Length of the value.
+/// @return Number of bytes pair_format writes for this pair.
+size_t pair_length(const PairFormat* fmt, size_t key_len, size_t value_len);
+
+/// Formats a pair into dest, which must hold pair_length bytes. Nothing is allocated and no '\0' is written.
+/// @param dest Where to write the pair.
+/// @param fmt Separators of the pair.
+/// @param key Key of the pair.
+/// @param key_len Length of the key.
+/// @param value Value of the pair.
+/// @param value_len Length of the value.
+/// @return Number of bytes written.
+size_t pair_format(char* dest, const PairFormat* fmt, const char* key, size_t key_len, const char* value, size_t value_len);
+
+/// Initializes an empty output buffer.
+/// @param buf Buffer to initialize.
+void outbuf_init(OutBuffer* buf);
+
+/// Appends bytes to an output buffer, growing it if needed.
+/// @param buf Buffer to append to.
+/// @param data Bytes to append.
+/// @param len Number of bytes to append.
+/// @return 0 if the bytes were appended, 1 otherwise.
+int outbuf_append(OutBuffer* buf, const char* data, size_t len);
+
+/// Appends a formatted pair to an output buffer.
+/// @param buf Buffer to append to.
+/// @param fmt Separators of the pair.
+/// @param key Key of the pair.
+/// @param key_len Length of the key.
+/// @param value Value of the pair.
+/// @param value_len Length of the value.
+/// @return 0 if the pair was appended, 1 otherwise.
+int outbuf_pair(OutBuffer* buf, const PairFormat* fmt, const char* key, size_t key_len, const char* value, size_t value_len);
+
+/// Writes the buffered bytes to a file descriptor and empties the buffer.
+/// @param buf Buffer to flush.
+/// @param fd File descriptor to write to.
+/// @return 0 if all bytes were written, 1 otherwise.
+int outbuf_flush(OutBuffer* buf, int fd);
+
+/// Flushes a buffer once it holds OUTBUF_FLUSH_SIZE bytes or more.
+/// @param buf Buffer to flush.
+/// @param fd File descriptor to write to.
+/// @return 0 if all bytes were written, 1 otherwise.
+int outbuf_flush_full(OutBuffer* buf, int fd);
+
+/// Frees the memory held by an output buffer.
+/// @param buf Buffer to free.
+void outbuf_free(OutBuffer* buf);
+
+#endif  // KVS_IO_H
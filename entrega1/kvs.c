@@ -48,6 +48,7 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
         if (strcmp(keyNode->key, key) == 0) {
             free(keyNode->value);
             keyNode->value = strdup(value);
+            keyNode->value_len = strlen(value);
             pthread_mutex_unlock(&ht->blockedLocks[index]);
             return 0;
         }
@@ -58,6 +59,8 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
     keyNode = malloc(sizeof(KeyNode));
     keyNode->key = strdup(key); // Allocate memory for the key
     keyNode->value = strdup(value); // Allocate memory for the value
+    keyNode->key_len = strlen(key);
+    keyNode->value_len = strlen(value);
     keyNode->next = ht->table[index]; // Link to existing nodes
     ht->table[index] = keyNode; // Place new key node at the start of the list~
 
@@ -81,6 +84,32 @@ char* read_pair(HashTable *ht, const char *key) {
     return NULL; // Key not found
 }
 
+KeyNode* find_pair(HashTable *ht, const char *key) {
+    int index = hash(key);
+
+    KeyNode *keyNode = ht->table[index];
+    while (keyNode != NULL && strcmp(keyNode->key, key) != 0) {
+        keyNode = keyNode->next; // Move to the next node
+    }
+    return keyNode;
+}
+
+int copy_value(HashTable *ht, const char *key, char *value, size_t size) {
+    int index = hash(key);
+
+    pthread_mutex_lock(&ht->blockedLocks[index]);
+    KeyNode *keyNode = ht->table[index];
+    while (keyNode != NULL && strcmp(keyNode->key, key) != 0) {
+        keyNode = keyNode->next; // Move to the next node
+    }
+    if (keyNode != NULL) {
+        strncpy(value, keyNode->value, size - 1);
+        value[size - 1] = '\0';
+    }
+    pthread_mutex_unlock(&ht->blockedLocks[index]);
+    return keyNode == NULL;
+}
+
 int delete_pair(HashTable *ht, const char *key) {
     int index = hash(key);
 
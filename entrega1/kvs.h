@@ -9,6 +9,8 @@
 typedef struct KeyNode {
     char *key;
     char *value;
+    size_t key_len;    // strlen of key, kept for the output formatter
+    size_t value_len;  // strlen of value
     struct KeyNode *next;
 } KeyNode;
 
@@ -34,6 +36,21 @@ int write_pair(HashTable *ht, const char *key, const char *value);
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 char* read_pair(HashTable *ht, const char *key);
 
+/// Finds the node of a given key, without copying its value.
+/// The caller must keep writers out while the node is used.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to find.
+/// @return The node if found, NULL otherwise.
+KeyNode* find_pair(HashTable *ht, const char *key);
+
+/// Copies the value of a given key, locking its bucket, so writers may run meanwhile.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param value Buffer that receives the value, truncated to size - 1 characters.
+/// @param size Size of value.
+/// @return 0 if the key was found, 1 otherwise.
+int copy_value(HashTable *ht, const char *key, char *value, size_t size);
+
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
 /// @param key Key of the pair to read.
@@ -1,6 +1,5 @@
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -10,15 +9,21 @@
 #include <errno.h>
 #include <pthread.h>
 
+#include "backups.h"
 #include "constants.h"
 #include "parser.h"
 #include "operations.h"
+#include "io.h"
 #include "kvs.h"
 
-/// Mutex to protect the number of active threads
-pthread_mutex_t count_mutex;
-pthread_cond_t count_cond;
-int active_threads = 0;
+/// Bounded queue of job file paths, filled by readJobFiles and emptied by the workers
+pthread_mutex_t queue_mutex;
+pthread_cond_t queue_not_empty;
+pthread_cond_t queue_not_full;
+char* job_queue[JOB_QUEUE_SIZE];
+size_t queue_head = 0;
+size_t queue_count = 0;
+int queue_closed = 0;
 int max_threads = 0;
 
 /// Mutexes and conditions to protect command execution
@@ -29,7 +34,6 @@ int write_delete_active = 0;
 
 /// Limit the number of backups
 int max_backups = 0;
-int pids_count = 0;
 
 /// Wait for a read/show/backup operation to finish
 void read_show_backup_wait() {
@@ -67,75 +71,144 @@ void read_show_finished() {
   pthread_mutex_unlock(&command_mutex);
 }
 
+/// Keys of a READ parsed in several chunks, looked up together so they are sorted as one list
+typedef struct KeyList {
+  char (*keys)[MAX_STRING_SIZE];
+  size_t count;
+  size_t cap;
+} KeyList;
+
+/// Append a chunk of keys to a key list, growing it if needed
+/// @param list The key list
+/// @param keys Keys of the chunk
+/// @param num_keys Number of keys of the chunk
+/// @return 0 if successful, 1 otherwise
+int keylist_append(KeyList* list, char keys[][MAX_STRING_SIZE], size_t num_keys) {
+  if (list->cap - list->count < num_keys) {
+    size_t cap = list->cap > 0 ? list->cap : MAX_WRITE_SIZE;
+    while (cap - list->count < num_keys) {
+      cap *= 2;
+    }
+    char (*grown)[MAX_STRING_SIZE] = realloc(list->keys, cap * MAX_STRING_SIZE);
+    if (grown == NULL) return 1;
+    list->keys = grown;
+    list->cap = cap;
+  }
+  memcpy(list->keys + list->count, keys, num_keys * MAX_STRING_SIZE);
+  list->count += num_keys;
+  return 0;
+}
+
 /// Process input from the user
 /// @param fd File descriptor to read from
 /// @param fd_out File descriptor to write to
 /// @param filepath Filepath (Job File) for backups to process
-void process_input(int fd, int fd_out, char* filepath) {
+/// @param keys Key storage of the worker, reused by every command
+/// @param values Value storage of the worker, reused by every command
+void process_input(int fd, int fd_out, char* filepath, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
   int num_backups = 1;
+  OutBuffer out;
+  outbuf_init(&out);
+  UndoLog undo = UNDO_LOG_INIT;
+  KeyList read_keys = {NULL, 0, 0};
 
   while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+    if (outbuf_flush_full(&out, fd_out)) {
+      fprintf(stderr, "Failed to write to output file\n");
+    }
+
     unsigned int delay;
     size_t num_pairs;
+    int more, listed, failed;
     
     switch (get_next(fd)) {
+      // Batches longer than MAX_WRITE_SIZE pairs are parsed and executed in chunks,
+      // all under the same wait so the batch stays atomic: a batch cut short by a
+      // malformed chunk is undone, like a malformed line that is never executed
       case CMD_WRITE:
         read_show_backup_wait();
-        num_pairs = parse_write(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          pthread_mutex_lock(&command_mutex);
-          write_delete_active--;
-          pthread_cond_broadcast(&command_cond);
-          pthread_mutex_unlock(&command_mutex);
-          continue;
-        }
+        more = 0;
+        failed = 0;
+        do {
+          num_pairs = parse_write(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE, &more);
+          if (num_pairs == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            failed = 1;
+            break;
+          }
 
-        if (kvs_write(num_pairs, keys, values)) {
-          fprintf(stderr, "Failed to write pair\n");
-        }
+          // The chunks left are still parsed, so the next command is found
+          if (!failed && kvs_write(num_pairs, keys, values, more ? &undo : NULL)) {
+            fprintf(stderr, "Failed to write pair\n");
+            failed = 1;
+          }
+        } while (more);
+        kvs_batch_done(&undo, failed);
         write_delete_finished();
         break;
 
       case CMD_READ:
         write_delete_wait();
-        num_pairs = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          read_show_finished();
-          continue;
-        }
+        more = 0;
+        failed = 0;
+        read_keys.count = 0;
+        do {
+          num_pairs = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE, &more);
+          if (num_pairs == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            failed = 1;
+            break;
+          }
 
-        if (kvs_read(num_pairs, keys, fd_out)) {
+          if (!more && read_keys.count == 0) {
+            // A batch of a single chunk needs no copy
+            if (kvs_read(num_pairs, keys, &out)) {
+              fprintf(stderr, "Failed to read pair\n");
+            }
+          } else if (!failed && keylist_append(&read_keys, keys, num_pairs)) {
+            fprintf(stderr, "Failed to read pair\n");
+            failed = 1;
+          }
+        } while (more);
+        if (!failed && read_keys.count > 0 && kvs_read(read_keys.count, read_keys.keys, &out)) {
           fprintf(stderr, "Failed to read pair\n");
-          read_show_finished();
         }
-
         read_show_finished();
         break;
 
       case CMD_DELETE:
         read_show_backup_wait();
+        more = 0;
+        listed = 0;
+        failed = 0;
+        do {
+          num_pairs = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE, &more);
+          if (num_pairs == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            failed = 1;
+            break;
+          }
 
-        num_pairs = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          write_delete_finished();
-          continue;
-        }
+          if (!failed && kvs_delete(num_pairs, keys, &out, &listed, more, more ? &undo : NULL)) {
+            fprintf(stderr, "Failed to delete pair\n");
+            failed = 1;
+          }
 
-        if (kvs_delete(num_pairs, keys, fd_out)) {
-          fprintf(stderr, "Failed to delete pair\n");
+          if (more && outbuf_flush_full(&out, fd_out)) {
+            fprintf(stderr, "Failed to write to output file\n");
+          }
+        } while (more);
+        if (failed && listed) {
+          // The KVSMISSING keys listed so far were not deleted by an undone batch either
+          outbuf_append(&out, "]\n", 2);
         }
+        kvs_batch_done(&undo, failed);
         write_delete_finished();
         break;
 
       case CMD_SHOW:
         write_delete_wait();
-        kvs_show(fd_out);
+        kvs_show(&out);
         read_show_finished();
         break;
 
@@ -147,7 +220,8 @@ void process_input(int fd, int fd_out, char* filepath) {
         }
 
         if (delay > 0) {
-          if (write_all(fd_out, "Waiting...\n", 11) < 0) {
+          // Output written so far must not be held back by the wait
+          if (outbuf_append(&out, "Waiting...\n", 11) || outbuf_flush(&out, fd_out)) {
             fprintf(stderr, "Failed to write to output file\n");
             continue;
           }
@@ -157,41 +231,10 @@ void process_input(int fd, int fd_out, char* filepath) {
 
       case CMD_BACKUP:
         write_delete_wait();
-        pthread_mutex_lock(&command_mutex);
-        while (pids_count >= max_backups) {
-          int status;
-          pid_t finished_pid = wait(&status);
-          if (finished_pid > 0) {
-            pids_count--;
-          }
-        }
-        pids_count++;
-        pthread_mutex_unlock(&command_mutex);
-        
-        pid_t pid = fork();
-        if (pid == 0) { // Child Process
-          if (kvs_backup(filepath, num_backups)) {
-            fprintf(stderr, "Failed to perform backup.\n");
-            _exit(1);
-          }
-          _exit(0);
-          
-        } else if (pid > 0) { // Main Process
-          pthread_mutex_lock(&command_mutex);
+        if (kvs_backup(filepath, num_backups) == 0) {
           num_backups++;
-          pthread_mutex_unlock(&command_mutex);
-
-          // Check if child processes are finished
-          while (waitpid(-1, NULL, WNOHANG) > 0) {
-              pthread_mutex_lock(&command_mutex);
-              pids_count--;
-              pthread_mutex_unlock(&command_mutex);
-          }
-          read_show_finished();
-        } else {
-          fprintf(stderr, "Fork failed\n");
-          read_show_finished();
         }
+        read_show_finished();
         break;
 
       case CMD_INVALID:
@@ -206,16 +249,23 @@ void process_input(int fd, int fd_out, char* filepath) {
         break;
 
       case EOC:
+        if (outbuf_flush(&out, fd_out)) {
+          fprintf(stderr, "Failed to write to output file\n");
+        }
+        outbuf_free(&out);
+        undo_free(&undo);
+        free(read_keys.keys);
         return;
     }
   }
 }
 
-/// Thread function to call process_input
-/// @param path Filepath to process
-void *process_input_thread_fn(void *path) {
+/// Process a job file and write its output file
+/// @param filepath Filepath of the job file
+/// @param keys Key storage of the worker
+/// @param values Value storage of the worker
+void process_job_file(char* filepath, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
   int fd, fd_out;
-  char* filepath = (char*)path;
   fd = open(filepath, O_RDONLY);
   if (fd >= 0) {
     char* output_filepath = changeFileExtension(filepath, OUT_FILE);
@@ -225,20 +275,69 @@ void *process_input_thread_fn(void *path) {
       fd_out = open(output_filepath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
       free(output_filepath);
       if (fd_out >= 0) {
-        process_input(fd, fd_out, filepath);
+        process_input(fd, fd_out, filepath, keys, values);
         close(fd_out);
       }
     }
+    parser_close(fd);
     close(fd);
   }
-  free(filepath);
+}
+
+/// Add a job file path to the queue, waiting while the queue is full
+/// @param filepath Filepath to process, freed by the worker
+void enqueue_job(char* filepath) {
+  pthread_mutex_lock(&queue_mutex);
+  while (queue_count == JOB_QUEUE_SIZE) {
+    pthread_cond_wait(&queue_not_full, &queue_mutex);
+  }
+  job_queue[(queue_head + queue_count) % JOB_QUEUE_SIZE] = filepath;
+  queue_count++;
+  pthread_cond_signal(&queue_not_empty);
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/// Take a job file path from the queue, waiting while the queue is empty
+/// @return Filepath to process, NULL once the queue is closed and empty
+char* dequeue_job() {
+  pthread_mutex_lock(&queue_mutex);
+  while (queue_count == 0 && !queue_closed) {
+    pthread_cond_wait(&queue_not_empty, &queue_mutex);
+  }
+  char* filepath = NULL;
+  if (queue_count > 0) {
+    filepath = job_queue[queue_head];
+    queue_head = (queue_head + 1) % JOB_QUEUE_SIZE;
+    queue_count--;
+    pthread_cond_signal(&queue_not_full);
+  }
+  pthread_mutex_unlock(&queue_mutex);
+  return filepath;
+}
 
-  // Signal that the thread is done
-  pthread_mutex_lock(&count_mutex);
-  active_threads--;
-  pthread_cond_signal(&count_cond);
-  pthread_mutex_unlock(&count_mutex);
+/// Worker thread function, processes job files until the queue is closed
+/// @param arg Not used
+void *worker_thread_fn(void *arg) {
+  (void)arg;
+  // Reused by every command of the worker, never zeroed: the parser
+  // terminates each string it stores and only the parsed pairs are used
+  char (*keys)[MAX_STRING_SIZE] = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  char (*values)[MAX_STRING_SIZE] = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  if (keys == NULL || values == NULL) {
+    fprintf(stderr, "Failed to allocate command buffers\n");
+    free(keys);
+    free(values);
+    return NULL;
+  }
 
+  char* filepath;
+  while ((filepath = dequeue_job()) != NULL) {
+    process_job_file(filepath, keys, values);
+    free(filepath);
+  }
+  free(keys);
+  free(values);
+  parser_release();
   return NULL;
 }
 
@@ -249,34 +348,45 @@ int readJobFiles(char* job_dir) {
   DIR *dir;
   dir = opendir(job_dir);
   if (dir == NULL) return 1;
+
+  pthread_t* workers = malloc(sizeof(pthread_t) * (size_t)max_threads);
+  if (workers == NULL) {
+    closedir(dir);
+    return 1;
+  }
+  int num_workers = 0;
+  while (num_workers < max_threads) {
+    if (pthread_create(&workers[num_workers], NULL, worker_thread_fn, NULL) != 0) {
+      fprintf(stderr, "Failed to create thread\n");
+      break;
+    }
+    num_workers++;
+  }
+  if (num_workers == 0) {
+    free(workers);
+    closedir(dir);
+    return 1;
+  }
+
   while ((entry = readdir(dir)) != NULL) {
     if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 && strlen(entry->d_name) <= MAX_JOB_FILE_NAME_SIZE && isExtensionFile(entry->d_name, JOB_FILE)) {
       size_t filepath_size = sizeof(char)*(strlen(job_dir) + 1 + MAX_JOB_FILE_NAME_SIZE + 1);
       char* filepath = (char*) malloc(filepath_size);
       snprintf(filepath, filepath_size, "%s/%s", job_dir, entry->d_name);
-      pthread_mutex_lock(&count_mutex);
-      while (active_threads >= max_threads) {
-        pthread_cond_wait(&count_cond, &count_mutex);
-      }
-      active_threads++;
-      pthread_mutex_unlock(&count_mutex);
-      pthread_t thread;
-      while (1) {
-        int create_ret = pthread_create(&thread, NULL, process_input_thread_fn, (void *)filepath);
-        if (create_ret == 0) {
-            break;
-        }
-        fprintf(stderr, "Failed to create thread\n");
-      }
-      pthread_detach(thread);
+      enqueue_job(filepath);
     }
   }
   closedir(dir);
-  pthread_mutex_lock(&count_mutex);
-  while (active_threads > 0) {
-    pthread_cond_wait(&count_cond, &count_mutex);
+
+  pthread_mutex_lock(&queue_mutex);
+  queue_closed = 1;
+  pthread_cond_broadcast(&queue_not_empty);
+  pthread_mutex_unlock(&queue_mutex);
+
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i], NULL);
   }
-  pthread_mutex_unlock(&count_mutex);
+  free(workers);
   return 0;
 }
 
@@ -299,17 +409,24 @@ int main(int argc, char *argv[]) {
     if (max_threads <= 0) {
       return 1;
     }
+    if (backups_init((size_t)max_backups)) {
+      return 1;
+    }
     // Initialize the threads
-    pthread_mutex_init(&count_mutex, NULL);
-    pthread_cond_init(&count_cond, NULL);
+    pthread_mutex_init(&queue_mutex, NULL);
+    pthread_cond_init(&queue_not_empty, NULL);
+    pthread_cond_init(&queue_not_full, NULL);
     pthread_mutex_init(&command_mutex, NULL);
     pthread_cond_init(&command_cond, NULL);
     
     int execution = readJobFiles(argv[1]);
+    // Queued backups are forked by the server once they get a slot
+    backups_drain();
 
     // Destroy kvs and threads
-    pthread_mutex_destroy(&count_mutex);
-    pthread_cond_destroy(&count_cond);
+    pthread_mutex_destroy(&queue_mutex);
+    pthread_cond_destroy(&queue_not_empty);
+    pthread_cond_destroy(&queue_not_full);
     pthread_mutex_destroy(&command_mutex);
     pthread_cond_destroy(&command_cond);
     kvs_terminate();
@@ -12,6 +12,9 @@
 
 #include "kvs.h"
 #include "constants.h"
+#include "io.h"
+#include "operations.h"
+#include "backups.h"
 
 static struct HashTable* kvs_table = NULL;
 
@@ -59,13 +62,64 @@ int kvs_terminate() {
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+/// Makes room in an undo log for the keys of a chunk.
+/// @param undo The undo log.
+/// @param num_pairs Number of keys about to be changed.
+/// @return 0 if successful, 1 otherwise.
+static int undo_reserve(UndoLog* undo, size_t num_pairs) {
+  if (undo->cap - undo->count >= num_pairs) return 0;
+
+  size_t cap = undo->cap > 0 ? undo->cap : MAX_WRITE_SIZE;
+  while (cap - undo->count < num_pairs) {
+    cap *= 2;
+  }
+  UndoEntry* entries = realloc(undo->entries, cap * sizeof(UndoEntry));
+  if (entries == NULL) return 1;
+  undo->entries = entries;
+  undo->cap = cap;
+  return 0;
+}
+
+/// Saves the value of a key about to be changed, in room made by undo_reserve.
+/// @param undo The undo log.
+/// @param key The key.
+static void undo_save(UndoLog* undo, const char* key) {
+  UndoEntry* entry = &undo->entries[undo->count++];
+  strncpy(entry->key, key, MAX_STRING_SIZE - 1);
+  entry->key[MAX_STRING_SIZE - 1] = '\0';
+  entry->found = copy_value(kvs_table, key, entry->value, MAX_STRING_SIZE) == 0;
+}
+
+void kvs_batch_done(UndoLog* undo, int failed) {
+  while (failed && undo->count > 0) {
+    UndoEntry* entry = &undo->entries[--undo->count];
+    if (!entry->found) {
+      delete_pair(kvs_table, entry->key);
+    } else if (write_pair(kvs_table, entry->key, entry->value) != 0) {
+      fprintf(stderr, "Failed to restore key %s\n", entry->key);
+    }
+  }
+  undo->count = 0;
+}
+
+void undo_free(UndoLog* undo) {
+  free(undo->entries);
+  undo->entries = NULL;
+  undo->count = 0;
+  undo->cap = 0;
+}
+
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], UndoLog* undo) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  if (undo != NULL && undo_reserve(undo, num_pairs)) {
+    return 1;
+  }
 
   for (size_t i = 0; i < num_pairs; i++) {
+    if (undo != NULL) undo_save(undo, keys[i]);
     if (write_pair(kvs_table, keys[i], values[i]) != 0) {
       fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
     }
@@ -74,101 +128,77 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
   return 0;
 }
 
-/// Sort a 2D array of strings in ascending order using a simple bubble sort algorithm.
+/// Compares two keys for qsort.
+/// @param a First key.
+/// @param b Second key.
+/// @return Same as strcmp.
+static int compare_keys(const void* a, const void* b) {
+  return strcmp((const char*)a, (const char*)b);
+}
+
+/// Sort a 2D array of strings in ascending order.
 /// @param keys A 2D array of strings to be sorted.
 /// @param rows The number of rows (strings) in the array.
 /// @param cols The maximum size of each string (column size).
 void sortArray(char keys[][MAX_STRING_SIZE], int rows, int cols) {
-  char temp[cols];
-  for (int i = 0; i < rows - 1; i++) {
-    for (int j = i + 1; j < rows; j++) {
-      if (strcmp(keys[i], keys[j]) > 0) {
-        strcpy(temp, keys[i]);
-        strcpy(keys[i], keys[j]);
-        strcpy(keys[j], temp);
-      }
-    }
-  }
+  // A READ gathered from many chunks can hold far more than MAX_WRITE_SIZE keys
+  qsort(keys, (size_t)rows, (size_t)cols, compare_keys);
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out) {
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer* out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
   sortArray(keys, (int)num_pairs, MAX_STRING_SIZE);
-  if (write_all(fd_out, "[", 1) < 0) return 1;
+  if (outbuf_append(out, "[", 1)) return 1;
   for (size_t i = 0; i < num_pairs; i++) {
-    char* result = read_pair(kvs_table, keys[i]);
-    if (result == NULL) {
-      size_t buffer_size = strlen(keys[i])+12;
-      char* buffer = (char*) malloc(sizeof(char)*buffer_size);
-      snprintf(buffer, buffer_size, "(%s,KVSERROR)", keys[i]);
-      if (write_all(fd_out, buffer, buffer_size-1) < 0) {
-        free(buffer);
-        return 1;
-      }
-      free(buffer);
+    KeyNode* keyNode = find_pair(kvs_table, keys[i]);
+    int result;
+    if (keyNode == NULL) {
+      result = outbuf_pair(out, &PAIR_RESULT, keys[i], strlen(keys[i]), "KVSERROR", 8);
     } else {
-      size_t buffer_size = strlen(keys[i])+strlen(result)+4;
-      char* buffer = (char*) malloc(sizeof(char)*buffer_size);
-      snprintf(buffer, buffer_size, "(%s,%s)", keys[i], result);
-      if (write_all(fd_out, buffer, buffer_size-1) < 0) {
-        free(buffer);
-        free(result);
-        return 1;
-      }
-      free(buffer);
+      result = outbuf_pair(out, &PAIR_RESULT, keyNode->key, keyNode->key_len, keyNode->value, keyNode->value_len);
     }
-    free(result);
+    if (result) return 1;
   }
-  if (write_all(fd_out, "]\n", 2) < 0) return 1;
-  return 0;
+  return outbuf_append(out, "]\n", 2);
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out) {
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer* out, int* listed, int more, UndoLog* undo) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  int aux = 0;
+  if (undo != NULL && undo_reserve(undo, num_pairs)) {
+    return 1;
+  }
   for (size_t i = 0; i < num_pairs; i++) {
+    if (undo != NULL) undo_save(undo, keys[i]);
     if (delete_pair(kvs_table, keys[i]) != 0) {
-      if (!aux) {
-        if (write_all(fd_out, "[", 1) < 0) return 1;
-        aux = 1;
-      }
-      size_t buffer_size = (strlen(keys[i]) + 14);
-      char* buffer = (char*) malloc(sizeof(char)*buffer_size);
-      snprintf(buffer, buffer_size, "(%s,KVSMISSING)", keys[i]);
-      if (write_all(fd_out, buffer, buffer_size-1) < 0) {
-        free(buffer);
-        return 1;
+      if (!*listed) {
+        if (outbuf_append(out, "[", 1)) return 1;
+        *listed = 1;
       }
-      free(buffer);
+      if (outbuf_pair(out, &PAIR_RESULT, keys[i], strlen(keys[i]), "KVSMISSING", 10)) return 1;
     }
   }
-  if (aux) {
-    if (write_all(fd_out, "]\n", 2) < 0) return 1;
+  if (*listed && !more) {
+    *listed = 0;
+    if (outbuf_append(out, "]\n", 2)) return 1;
   }
   return 0;
 }
 
-void kvs_show(int fd_out) {
+int kvs_show(OutBuffer* out) {
   for (int i = 0; i < TABLE_SIZE; i++) {
     KeyNode *keyNode = kvs_table->table[i];
     while (keyNode != NULL) {
-      size_t buffer_size = strlen(keyNode->key) + strlen(keyNode->value) + 6;
-      char *buffer = (char*) malloc(sizeof(char)*(buffer_size));
-      snprintf(buffer, buffer_size, "(%s, %s)\n", keyNode->key, keyNode->value); 
-      if (write_all(fd_out, buffer, buffer_size-1) < 0) {
-        free(buffer);
-        return;
-      }
-      free(buffer);
+      if (outbuf_pair(out, &PAIR_LINE, keyNode->key, keyNode->key_len, keyNode->value, keyNode->value_len)) return 1;
       keyNode = keyNode->next; // Move to the next node
     }
   }
+  return 0;
 }
 
 void kvs_wait(unsigned int delay_ms) {
@@ -234,15 +264,113 @@ char* getNameOfBackupFile(char* filepath, int number_of_backup) {
   return backup_filepath;
 }
 
-int kvs_backup(char* filepath, int backups_already_done) {
-  char* backup_filepath = getNameOfBackupFile(filepath, backups_already_done);
+/// A backup queued until a slot frees up, with the KVS state captured at its BACKUP.
+typedef struct QueuedBackup {
+  char* backup_filepath;
+  OutBuffer pairs;  // Formatted like the backup file
+} QueuedBackup;
+
+/// Writes a backup file. Runs in a forked child, so nothing is allocated.
+/// @param backup_filepath The backup file.
+/// @param pairs Captured state to write, NULL to write the KVS itself.
+/// @return 0 if the backup was successful, 1 otherwise.
+static int write_backup(const char* backup_filepath, const OutBuffer* pairs) {
   int fd_bk;
   fd_bk = open(backup_filepath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
-  free(backup_filepath);
-  if (fd_bk >= 0) {
-    kvs_show(fd_bk);
+  if (fd_bk < 0) {
+    return 1;
+  }
+  int result = 0;
+  if (pairs != NULL) {
+    for (OutChunk* chunk = pairs->head; pairs->len > 0 && chunk != NULL; chunk = chunk == pairs->tail ? NULL : chunk->next) {
+      result |= write_all(fd_bk, chunk->data, chunk->len) < 0;
+    }
     close(fd_bk);
-  } else {
+    return result;
+  }
+  // Pairs are formatted on the stack instead of the heap
+  char buffer[OUTBUF_CHUNK_SIZE];
+  size_t len = 0;
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    for (KeyNode* keyNode = kvs_table->table[i]; keyNode != NULL; keyNode = keyNode->next) {
+      if (len + pair_length(&PAIR_LINE, keyNode->key_len, keyNode->value_len) > sizeof(buffer)) {
+        result |= write_all(fd_bk, buffer, len) < 0;
+        len = 0;
+      }
+      len += pair_format(buffer + len, &PAIR_LINE, keyNode->key, keyNode->key_len, keyNode->value, keyNode->value_len);
+    }
+  }
+  result |= write_all(fd_bk, buffer, len) < 0;
+  close(fd_bk);
+  return result;
+}
+
+/// Forks the child that writes a backup, which holds a backup slot.
+/// @param backup_filepath The backup file.
+/// @param pairs Captured state to write, NULL to write the KVS itself.
+/// @return 0 if the child was forked, 1 otherwise.
+static int fork_backup(const char* backup_filepath, const OutBuffer* pairs) {
+  pid_t pid = fork();
+  if (pid == 0) { // Child Process
+    if (write_backup(backup_filepath, pairs)) {
+      fprintf(stderr, "Failed to perform backup.\n");
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  if (pid < 0) {
+    fprintf(stderr, "Fork failed\n");
+    backups_release();
+    return 1;
+  }
+  // The manager thread reaps the child
+  backups_track_child(pid);
+  return 0;
+}
+
+/// Forks the child of a queued backup, once it has a slot.
+/// @param arg The QueuedBackup, freed here.
+static void start_queued_backup(void* arg) {
+  QueuedBackup* backup = arg;
+  fork_backup(backup->backup_filepath, &backup->pairs);
+  free(backup->backup_filepath);
+  outbuf_free(&backup->pairs);
+  free(backup);
+}
+
+int kvs_backup(const char* filepath, int backups_already_done) {
+  // getNameOfBackupFile strips the extension of the path it is given
+  char* job_filepath = strdup(filepath);
+  if (job_filepath == NULL) {
+    return 1;
+  }
+  char* backup_filepath = getNameOfBackupFile(job_filepath, backups_already_done);
+  free(job_filepath);
+  if (backup_filepath == NULL) {
+    return 1;
+  }
+
+  if (backups_try_acquire()) {
+    int result = fork_backup(backup_filepath, NULL);
+    free(backup_filepath);
+    return result;
+  }
+
+  // Forking now would leave a child per BACKUP waiting for a slot, so the
+  // state is copied instead and the child forked once a slot frees up
+  QueuedBackup* backup = malloc(sizeof(QueuedBackup));
+  if (backup == NULL) {
+    free(backup_filepath);
+    return 1;
+  }
+  backup->backup_filepath = backup_filepath;
+  outbuf_init(&backup->pairs);
+  if (kvs_show(&backup->pairs) || backups_enqueue(start_queued_backup, backup)) {
+    fprintf(stderr, "Failed to queue backup\n");
+    free(backup_filepath);
+    outbuf_free(&backup->pairs);
+    free(backup);
     return 1;
   }
   return 0;
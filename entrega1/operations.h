@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include "kvs.h"
+#include "io.h"
 
 /// Writes all the bytes from a buffer to a file descriptor.
 /// @param fd File descriptor to write to.
@@ -11,6 +12,23 @@
 /// @return 0 if all bytes were written, -1 otherwise.
 int write_all(int fd, const char *buf, size_t len);
 
+/// Value a key had before a chunk of a batch changed it.
+typedef struct UndoEntry {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  int found;  // 0 if the key was missing
+} UndoEntry;
+
+/// Values changed by the chunks of a WRITE or DELETE batch executed so far,
+/// so a batch cut short by a malformed chunk can be undone.
+typedef struct UndoLog {
+  UndoEntry* entries;
+  size_t count;
+  size_t cap;
+} UndoLog;
+
+#define UNDO_LOG_INIT {NULL, 0, 0}
+
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
@@ -23,30 +41,49 @@ int kvs_terminate();
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
-/// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+/// @param undo Log that saves the values replaced, NULL not to save them.
+/// @return 0 if the pairs were written successfully, 1 otherwise (nothing is written).
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], UndoLog* undo);
 
-/// Reads values from the KVS.
+/// Reads values from the KVS, in the order of the keys.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param keys Array of keys' strings, sorted in place.
+/// @param out Buffer to append the (successful) output to.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer* out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out);
+/// @param out Buffer to append the output to.
+/// @param listed 1 once the output list of the batch was opened, kept between the chunks of a batch.
+/// @param more 1 if more chunks of the same batch follow, so the list is left open.
+/// @param undo Log that saves the values deleted, NULL not to save them.
+/// @return 0 if the pairs were deleted successfully, 1 otherwise (nothing is deleted).
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer* out, int* listed, int more, UndoLog* undo);
+
+/// Ends the WRITE or DELETE batch an undo log belongs to, emptying the log for the next one.
+/// Readers wait for writers, so none saw the changes of a batch that is undone.
+/// @param undo The undo log.
+/// @param failed 1 if the batch was cut short, so its changes are undone, newest first.
+void kvs_batch_done(UndoLog* undo, int failed);
+
+/// Frees the memory held by an undo log.
+/// @param undo The undo log.
+void undo_free(UndoLog* undo);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fd_out);
+/// @param out Buffer to append the output to.
+/// @return 0 if successful, 1 if output was lost.
+int kvs_show(OutBuffer* out);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(char* filepath, int backups_already_done);
+/// backup file, written by a child process. Without a free backup slot the
+/// state is captured now and the child is forked once a slot frees up.
+/// @param filepath Filepath of the job file.
+/// @param backups_already_done Number of the backup.
+/// @return 0 if the backup was started or queued, 1 otherwise.
+int kvs_backup(const char* filepath, int backups_already_done);
 
 /// Waits for the last backup to be called.
 void kvs_wait_backup();
@@ -28,16 +28,19 @@ enum Command get_next(int fd);
 /// @param values Array of values to be written.
 /// @param max_pairs number of pairs to be written.
 /// @param max_string_size maximum size for keys and values.
+/// @param more NULL to reject lists of max_pairs pairs or more. Otherwise set to 1 when the list goes on
+/// after max_pairs pairs, and passed back set to 1 to parse the rest of the list.
 /// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size, int* more);
 
 /// Parses a READ or DELETE command.
 /// @param fd File descriptor to read from.
 /// @param keys Array of keys to be written.
 /// @param max_keys number of keys to be iread or deleted.
 /// @param max_string_size maximum size for keys and values.
+/// @param more Same as for parse_write.
 /// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size, int* more);
 
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
@@ -46,4 +49,11 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
 
+/// Releases the buffered input of a job file. Must be called before the file descriptor is closed.
+/// @param fd File descriptor of the job file.
+void parser_close(int fd);
+
+/// Frees the input buffer kept by the calling thread for its next job file.
+void parser_release();
+
 #endif  // KVS_PARSER_H
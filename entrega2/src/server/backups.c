@@ -0,0 +1,339 @@
+// syscall is not part of strict POSIX
+#define _DEFAULT_SOURCE
+
+#include "backups.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BACKUPS_POLL_MS 100 // How often children without a pidfd are checked
+
+/// A backup waiting for a slot.
+typedef struct PendingBackup {
+  backup_start_t start;        // NULL for a child, started by start_child
+  void *arg;                   // Passed to start, or the BackupChild
+  struct PendingBackup *next;
+} PendingBackup;
+
+/// A child process writing a backup.
+typedef struct BackupChild {
+  pid_t pid;
+  int pidfd; // Readable once the child exits, -1 without pidfd_open
+  int go_fd; // Socket the child waits on while queued, -1 once it runs
+  struct BackupChild *next;
+} BackupChild;
+
+static pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_idle = PTHREAD_COND_INITIALIZER;
+static size_t max_slots = 1;
+static size_t used_slots = 0;
+static PendingBackup *queue_head = NULL; // Oldest queued backup
+static PendingBackup *queue_tail = NULL;
+static BackupChild *children = NULL;
+static int wake_fd = -1; // Wakes the manager to watch a new child
+
+/// Opens a descriptor that becomes readable when a process exits.
+/// @return The descriptor, -1 if the kernel has no pidfd_open.
+static int pidfd_open(pid_t pid) {
+#ifdef __NR_pidfd_open
+  return (int)syscall(__NR_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/// Lets a queued child write its backup. Called with backups_lock held.
+/// @param child The child, which holds a slot from now on.
+static void start_child(BackupChild *child) {
+  char go = 1;
+  if (send(child->go_fd, &go, 1, MSG_NOSIGNAL) != 1) {
+    // The child is gone, the manager reaps it and releases the slot
+    fprintf(stderr, "Failed to start backup child %d\n", (int)child->pid);
+  }
+  close(child->go_fd);
+  child->go_fd = -1;
+}
+
+/// Appends a backup to the queue. Called with backups_lock held.
+/// @return 0 if successful, 1 otherwise.
+static int queue_push(backup_start_t start, void *arg) {
+  PendingBackup *pending = malloc(sizeof(PendingBackup));
+  if (pending == NULL) {
+    return 1;
+  }
+  pending->start = start;
+  pending->arg = arg;
+  pending->next = NULL;
+  if (queue_tail != NULL) {
+    queue_tail->next = pending;
+  } else {
+    queue_head = pending;
+  }
+  queue_tail = pending;
+  return 0;
+}
+
+/// Removes a child from the queue, when it exits before it has a slot.
+/// Called with backups_lock held.
+static void queue_remove(BackupChild *child) {
+  PendingBackup *prev = NULL;
+  for (PendingBackup *pending = queue_head; pending != NULL;
+       prev = pending, pending = pending->next) {
+    if (pending->start == NULL && pending->arg == child) {
+      if (prev != NULL) {
+        prev->next = pending->next;
+      } else {
+        queue_head = pending->next;
+      }
+      if (queue_tail == pending) {
+        queue_tail = prev;
+      }
+      free(pending);
+      return;
+    }
+  }
+}
+
+/// Reaps the children that exited, releasing the slots they held.
+static void reap_children(void) {
+  size_t released = 0;
+
+  pthread_mutex_lock(&backups_lock);
+  BackupChild **link = &children;
+  while (*link != NULL) {
+    BackupChild *child = *link;
+    if (waitpid(child->pid, NULL, WNOHANG) == 0) {
+      link = &child->next;
+      continue;
+    }
+
+    *link = child->next;
+    if (child->go_fd != -1) {
+      // Exited while queued, without a slot
+      queue_remove(child);
+      close(child->go_fd);
+    } else {
+      released++;
+    }
+    if (child->pidfd != -1) {
+      close(child->pidfd);
+    }
+    free(child);
+  }
+  pthread_mutex_unlock(&backups_lock);
+
+  while (released-- > 0) {
+    backups_release();
+  }
+}
+
+/// Manager thread: waits for backup children to exit and reaps them.
+/// @param arg Unused.
+/// @return NULL
+static void *manager_thread(void *arg) {
+  (void)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  struct pollfd *fds = NULL;
+  size_t cap = 0;
+  while (1) {
+    struct pollfd wake = {wake_fd, POLLIN, 0};
+    struct pollfd *watched = &wake;
+    size_t count = 1;
+    // Children are checked periodically when they cannot all be watched
+    int timeout = BACKUPS_POLL_MS;
+
+    pthread_mutex_lock(&backups_lock);
+    for (BackupChild *child = children; child != NULL; child = child->next) {
+      count++;
+    }
+    struct pollfd *grown =
+        count > cap ? realloc(fds, count * sizeof(struct pollfd)) : fds;
+    if (grown != NULL) {
+      fds = grown;
+      cap = count > cap ? count : cap;
+      fds[0] = wake;
+      timeout = -1;
+      size_t i = 1;
+      for (BackupChild *child = children; child != NULL; child = child->next) {
+        fds[i++] = (struct pollfd){child->pidfd, POLLIN, 0};
+        if (child->pidfd == -1) {
+          timeout = BACKUPS_POLL_MS;
+        }
+      }
+      watched = fds;
+    } else {
+      count = 1;
+    }
+    pthread_mutex_unlock(&backups_lock);
+
+    if (poll(watched, count, timeout) == -1 && errno != EINTR) {
+      fprintf(stderr, "Failed to poll backup children\n");
+    }
+    uint64_t value;
+    if (watched[0].revents & POLLIN &&
+        read(wake_fd, &value, sizeof(value)) == -1) {
+      fprintf(stderr, "Failed to read backup events\n");
+    }
+    reap_children();
+  }
+
+  return NULL;
+}
+
+int backups_init(size_t max_backups) {
+  max_slots = max_backups > 0 ? max_backups : 1;
+  wake_fd = eventfd(0, 0);
+  if (wake_fd == -1) {
+    fprintf(stderr, "Failed to create the backup manager's eventfd\n");
+    return 1;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, manager_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to start the backup manager\n");
+    close(wake_fd);
+    wake_fd = -1;
+    return 1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+int backups_try_acquire(void) {
+  pthread_mutex_lock(&backups_lock);
+  // Queued backups get free slots first
+  int acquired = used_slots < max_slots && queue_head == NULL;
+  if (acquired) {
+    used_slots++;
+  }
+  pthread_mutex_unlock(&backups_lock);
+  return acquired;
+}
+
+void backups_release(void) {
+  pthread_mutex_lock(&backups_lock);
+  PendingBackup *next = queue_head;
+  if (next != NULL) {
+    // The slot goes to the oldest queued backup
+    queue_head = next->next;
+    if (queue_head == NULL) {
+      queue_tail = NULL;
+    }
+    if (next->start == NULL) {
+      start_child((BackupChild *)next->arg);
+    }
+  } else {
+    used_slots--;
+    pthread_cond_broadcast(&backups_idle);
+  }
+  pthread_mutex_unlock(&backups_lock);
+
+  if (next != NULL && next->start != NULL) {
+    next->start(next->arg);
+  }
+  free(next);
+}
+
+int backups_enqueue(backup_start_t start, void *arg) {
+  pthread_mutex_lock(&backups_lock);
+  int now = used_slots < max_slots && queue_head == NULL;
+  int failed = 0;
+  if (now) {
+    used_slots++;
+  } else {
+    failed = queue_push(start, arg);
+  }
+  pthread_mutex_unlock(&backups_lock);
+
+  if (now) {
+    start(arg);
+  }
+  return failed;
+}
+
+int backups_track_child(pid_t pid, int go_fd) {
+  BackupChild *child = malloc(sizeof(BackupChild));
+  if (child == NULL) {
+    fprintf(stderr, "Failed to track backup child %d\n", (int)pid);
+    // Reaped here instead, which waits for the child
+    if (go_fd != -1) {
+      pthread_mutex_lock(&backups_lock);
+      used_slots++;
+      pthread_mutex_unlock(&backups_lock);
+      send(go_fd, "", 1, MSG_NOSIGNAL);
+      close(go_fd);
+    }
+    waitpid(pid, NULL, 0);
+    backups_release();
+    return 1;
+  }
+  child->pid = pid;
+  child->pidfd = pidfd_open(pid);
+  child->go_fd = go_fd;
+
+  pthread_mutex_lock(&backups_lock);
+  child->next = children;
+  children = child;
+  if (go_fd != -1) {
+    if (used_slots < max_slots && queue_head == NULL) {
+      // A slot freed up since backups_try_acquire
+      used_slots++;
+      start_child(child);
+    } else if (queue_push(NULL, child)) {
+      // Started over the limit rather than left waiting
+      used_slots++;
+      start_child(child);
+    }
+  }
+  pthread_mutex_unlock(&backups_lock);
+
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) == -1) {
+    fprintf(stderr, "Failed to wake the backup manager\n");
+  }
+  return 0;
+}
+
+int backups_wait_slot(int go_fd, pid_t server) {
+  struct pollfd go = {go_fd, POLLIN, 0};
+  while (1) {
+    int ready = poll(&go, 1, BACKUPS_POLL_MS);
+    if (ready == -1 && errno != EINTR) {
+      return 1;
+    } else if (ready > 0) {
+      char byte;
+      return read(go_fd, &byte, 1) != 1;
+    } else if (getppid() != server) {
+      // Other children hold the server's end too, it is never seen closed
+      return 1;
+    }
+  }
+}
+
+void backups_drain(void) {
+  pthread_mutex_lock(&backups_lock);
+  while (used_slots > 0 || queue_head != NULL) {
+    pthread_cond_wait(&backups_idle, &backups_lock);
+  }
+  pthread_mutex_unlock(&backups_lock);
+}
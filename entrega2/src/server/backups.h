@@ -0,0 +1,58 @@
+#ifndef KVS_BACKUPS_H
+#define KVS_BACKUPS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/// Bounds the backups written at once without making job threads wait.
+///
+/// Each backup being written holds one of max_backups slots. A backup taken
+/// while every slot is in use is captured right away and queued, and queued
+/// backups start in order as slots free up. Backups written by child
+/// processes are handed to a manager thread, which watches them with pidfds
+/// and reaps each one as it exits, giving its slot to the next queued backup.
+
+/// Starts a queued backup, which now holds a slot.
+/// @param arg Argument given to backups_enqueue.
+typedef void (*backup_start_t)(void *arg);
+
+/// Starts the manager thread.
+/// @param max_backups Number of slots, backups written at once.
+/// @return 0 if successful, 1 otherwise.
+int backups_init(size_t max_backups);
+
+/// Takes a slot if one is free, never waiting.
+/// @return 1 if a slot was taken, 0 if every slot is in use or backups are
+/// queued already.
+int backups_try_acquire(void);
+
+/// Gives a slot back, handing it to the oldest queued backup if there is
+/// one, which is started by the calling thread.
+void backups_release(void);
+
+/// Queues a backup until a slot frees up.
+/// @param start Called with arg once the backup has a slot.
+/// @param arg Passed to start.
+/// @return 0 if successful, 1 otherwise.
+int backups_enqueue(backup_start_t start, void *arg);
+
+/// Hands a child process writing a backup to the manager thread, which
+/// reaps it and releases its slot when it exits.
+/// @param pid The child.
+/// @param go_fd -1 if the child holds a slot. Otherwise the child waits to
+/// read a byte from the other end of this socket, sent once it has a slot;
+/// the manager owns go_fd from now on.
+/// @return 0 if successful, 1 otherwise.
+int backups_track_child(pid_t pid, int go_fd);
+
+/// Makes a child forked without a slot wait until the server sends it one,
+/// or exits. Async signal safe.
+/// @param go_fd The child's end of the socket given to backups_track_child.
+/// @param server Process id of the server.
+/// @return 0 once the child has a slot, 1 if it should exit without writing.
+int backups_wait_slot(int go_fd, pid_t server);
+
+/// Waits until every queued and running backup is written.
+void backups_drain(void);
+
+#endif // KVS_BACKUPS_H
@@ -0,0 +1,65 @@
+#include "crc.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // Reversed Castagnoli polynomial
+
+static uint32_t crc_table[256];
+static int crc_hw = 0; // 1 if the CPU has the crc32 instruction
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+    }
+    crc_table[i] = crc;
+  }
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+/// Hardware CRC32C, eight bytes per instruction.
+__attribute__((target("sse4.2"))) static uint32_t
+crc_hw_update(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+
+  uint32_t crc32 = (uint32_t)crc64;
+  for (; len > 0; p++, len--) {
+    crc32 = _mm_crc32_u8(crc32, *p);
+  }
+  return crc32;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  pthread_once(&crc_once, crc_init);
+  const unsigned char *p = data;
+  crc = ~crc;
+
+#if defined(__x86_64__)
+  if (crc_hw) {
+    return ~crc_hw_update(crc, p, len);
+  }
+#endif
+
+  for (; len > 0; p++, len--) {
+    crc = (crc >> 8) ^ crc_table[(crc ^ *p) & 0xff];
+  }
+  return ~crc;
+}
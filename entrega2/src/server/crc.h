@@ -0,0 +1,15 @@
+#ifndef KVS_CRC_H
+#define KVS_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Computes the CRC32C (Castagnoli) of a block of bytes, continuing a
+/// previous one. Uses the SSE4.2 crc32 instruction when the CPU has it.
+/// @param crc CRC of the bytes before data, 0 for the first block.
+/// @param data The bytes.
+/// @param len Number of bytes.
+/// @return The CRC of the bytes so far.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif // KVS_CRC_H
@@ -0,0 +1,259 @@
+#include "dag.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "io.h"
+#include "job.h"
+#include "kvs.h"
+
+#define DAG_KEY_SLOTS 16384 // Slots of the key table, a power of two.
+
+/// A command of the window and its position in the dependency graph.
+typedef struct DagNode {
+  JobCmd cmd;        // Parsed command
+  OutBuffer out;     // Output of the command
+  uint64_t succ;     // Commands that depend on this one
+  int pending;       // Unfinished commands this one depends on
+  Task task;         // Pool task that executes the command
+  DagWindow *window; // Window the command belongs to
+} DagNode;
+
+/// Accesses to a key by the commands of the window.
+typedef struct DagKey {
+  const char *key;  // Key (points into a command of the window)
+  unsigned int gen; // Window generation the slot belongs to
+  int writer;       // Last command writing or deleting the key, -1 if none
+  uint64_t readers; // Commands reading the key since the last writer
+} DagKey;
+
+struct DagWindow {
+  DagNode nodes[DAG_WINDOW];
+  size_t count;     // Commands in the window
+  size_t num_keys;  // Keys referenced by the commands of the window
+  size_t remaining; // Commands not yet executed
+  unsigned int gen; // Current generation of the key table
+  DagKey *keys;     // Key table, stale slots are ignored by generation
+  ThreadPool *pool;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+};
+
+/// Hash function for the window key table (djb2).
+/// @param key Key to hash.
+/// @return Hashed value.
+static size_t dag_hash(const char *key) {
+  size_t hash = 5381;
+  int c;
+
+  while ((c = *key++)) {
+    hash = ((hash << 5) + hash) + (unsigned char)c;
+  }
+
+  return hash;
+}
+
+/// Finds the table slot of a key, claiming a free one if the key was not
+/// referenced yet in this window.
+/// @param window The window.
+/// @param key Key to look up.
+/// @return The key's slot.
+static DagKey *dag_lookup(DagWindow *window, const char *key) {
+  size_t i = dag_hash(key) & (DAG_KEY_SLOTS - 1);
+
+  while (window->keys[i].gen == window->gen) {
+    if (strcmp(window->keys[i].key, key) == 0) {
+      return &window->keys[i];
+    }
+    i = (i + 1) & (DAG_KEY_SLOTS - 1);
+  }
+
+  window->keys[i].key = key;
+  window->keys[i].gen = window->gen;
+  window->keys[i].writer = -1;
+  window->keys[i].readers = 0;
+  return &window->keys[i];
+}
+
+/// Links every command of the window to the earlier commands it conflicts
+/// with: two commands conflict if they share a key and one of them writes it.
+/// Writers of the same bucket also conflict, as the order in which keys are
+/// inserted in a bucket is visible to SHOW and BACKUP.
+/// @param window The window.
+static void dag_build(DagWindow *window) {
+  // The extra bucket holds the keys with no valid hash
+  int bucket_writer[TABLE_SIZE + 1];
+  for (size_t b = 0; b <= TABLE_SIZE; b++) {
+    bucket_writer[b] = -1;
+  }
+
+  window->gen++;
+  if (window->gen == 0) {
+    memset(window->keys, 0, DAG_KEY_SLOTS * sizeof(DagKey));
+    window->gen = 1;
+  }
+
+  for (size_t j = 0; j < window->count; j++) {
+    DagNode *node = &window->nodes[j];
+    uint64_t self = (uint64_t)1 << j;
+    uint64_t deps = 0;
+    int writes = node->cmd.cmd != CMD_READ;
+
+    for (size_t k = 0; k < node->cmd.num_pairs; k++) {
+      DagKey *slot = dag_lookup(window, node->cmd.keys[k]);
+      if (slot->writer >= 0) {
+        deps |= (uint64_t)1 << slot->writer;
+      }
+
+      if (writes) {
+        int index = hash(node->cmd.keys[k]);
+        int *writer = &bucket_writer[index < 0 ? TABLE_SIZE : index];
+        if (*writer >= 0) {
+          deps |= (uint64_t)1 << *writer;
+        }
+        *writer = (int)j;
+
+        deps |= slot->readers;
+        slot->writer = (int)j;
+        slot->readers = 0;
+      } else {
+        slot->readers |= self;
+      }
+    }
+
+    deps &= ~self;
+    node->pending = 0;
+    for (size_t i = 0; i < j; i++) {
+      if (deps & ((uint64_t)1 << i)) {
+        window->nodes[i].succ |= self;
+        node->pending++;
+      }
+    }
+  }
+}
+
+/// Executes a command and releases the commands that depend on it.
+/// @param arg The command's node.
+static void dag_node_run(void *arg) {
+  DagNode *node = (DagNode *)arg;
+  DagWindow *window = node->window;
+
+  job_execute(&node->cmd, &node->out);
+
+  pthread_mutex_lock(&window->lock);
+  for (size_t i = 0; i < window->count; i++) {
+    if ((node->succ & ((uint64_t)1 << i)) && --window->nodes[i].pending == 0) {
+      pool_submit(window->pool, &window->nodes[i].task);
+    }
+  }
+
+  if (--window->remaining == 0) {
+    pthread_cond_signal(&window->done);
+  }
+  pthread_mutex_unlock(&window->lock);
+}
+
+DagWindow *dag_create(ThreadPool *pool) {
+  DagWindow *window = malloc(sizeof(DagWindow));
+  if (window == NULL) {
+    return NULL;
+  }
+
+  window->keys = calloc(DAG_KEY_SLOTS, sizeof(DagKey));
+  char(*strings)[MAX_STRING_SIZE] =
+      malloc(2 * DAG_WINDOW * MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  if (window->keys == NULL || strings == NULL) {
+    free(window->keys);
+    free(strings);
+    free(window);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < DAG_WINDOW; i++) {
+    DagNode *node = &window->nodes[i];
+    node->cmd.keys = strings + 2 * i * MAX_WRITE_SIZE;
+    node->cmd.values = strings + (2 * i + 1) * MAX_WRITE_SIZE;
+    node->task.fn = dag_node_run;
+    node->task.arg = node;
+    node->window = window;
+    outbuf_init(&node->out);
+  }
+
+  window->count = 0;
+  window->num_keys = 0;
+  window->gen = 0;
+  window->pool = pool;
+  pthread_mutex_init(&window->lock, NULL);
+  pthread_cond_init(&window->done, NULL);
+  return window;
+}
+
+void dag_destroy(DagWindow *window) {
+  for (size_t i = 0; i < DAG_WINDOW; i++) {
+    outbuf_free(&window->nodes[i].out);
+  }
+
+  // The strings of every node live in the allocation of the first one
+  free(window->nodes[0].cmd.keys);
+  free(window->keys);
+  pthread_mutex_destroy(&window->lock);
+  pthread_cond_destroy(&window->done);
+  free(window);
+}
+
+JobCmd *dag_slot(DagWindow *window) {
+  return &window->nodes[window->count].cmd;
+}
+
+int dag_add(DagWindow *window) {
+  window->num_keys += window->nodes[window->count].cmd.num_pairs;
+  window->count++;
+
+  return window->count == DAG_WINDOW ||
+         window->num_keys + MAX_WRITE_SIZE > DAG_MAX_KEYS;
+}
+
+int dag_run(DagWindow *window, OutBuffer *out) {
+  if (window->count == 0) {
+    return 0;
+  }
+
+  if (window->count == 1) {
+    // Nothing to run concurrently
+    job_execute(&window->nodes[0].cmd, &window->nodes[0].out);
+  } else {
+    for (size_t i = 0; i < window->count; i++) {
+      window->nodes[i].succ = 0;
+    }
+    dag_build(window);
+
+    // Hold the lock so that no finished command releases a root twice
+    pthread_mutex_lock(&window->lock);
+    window->remaining = window->count;
+    for (size_t i = 0; i < window->count; i++) {
+      if (window->nodes[i].pending == 0) {
+        pool_submit(window->pool, &window->nodes[i].task);
+      }
+    }
+
+    while (window->remaining > 0) {
+      pthread_cond_wait(&window->done, &window->lock);
+    }
+    pthread_mutex_unlock(&window->lock);
+  }
+
+  int result = 0;
+  for (size_t i = 0; i < window->count; i++) {
+    // Bytes a command could not buffer are missing from the job's output
+    int lost = window->nodes[i].out.failed;
+    if (outbuf_take(out, &window->nodes[i].out) || lost) {
+      result = 1;
+    }
+  }
+
+  window->count = 0;
+  window->num_keys = 0;
+  return result;
+}
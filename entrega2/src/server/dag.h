@@ -0,0 +1,43 @@
+#ifndef KVS_DAG_H
+#define KVS_DAG_H
+
+#include "io.h"
+#include "parser.h"
+#include "pool.h"
+
+#define DAG_WINDOW 64     // Maximum number of commands in a window.
+#define DAG_MAX_KEYS 4096 // Number of keys after which a window is closed.
+
+/// Window of parsed WRITE, READ and DELETE commands of a single job. The
+/// commands of a window are linked by their key dependencies and the
+/// independent ones are executed concurrently by a thread pool.
+typedef struct DagWindow DagWindow;
+
+/// Creates an empty dependency window.
+/// @param pool Thread pool used to execute the commands.
+/// @return Newly created window, NULL on failure.
+DagWindow *dag_create(ThreadPool *pool);
+
+/// Frees a dependency window.
+/// @param window The window to free.
+void dag_destroy(DagWindow *window);
+
+/// Returns the storage for the next command of the window, to be filled by
+/// parse_command.
+/// @param window The window.
+/// @return The command slot.
+JobCmd *dag_slot(DagWindow *window);
+
+/// Adds the command parsed into the current slot to the window.
+/// @param window The window.
+/// @return 1 if the window is full and must be run, 0 otherwise.
+int dag_add(DagWindow *window);
+
+/// Executes the commands of the window and appends their output to the job's
+/// output buffer, in the order the commands were added. Empties the window.
+/// @param window The window to run.
+/// @param out Buffer that receives the output.
+/// @return 0 if successful, 1 if output was lost.
+int dag_run(DagWindow *window, OutBuffer *out);
+
+#endif // KVS_DAG_H
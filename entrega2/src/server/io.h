@@ -1,8 +1,41 @@
 #ifndef KVS_IO_H
 #define KVS_IO_H
 
+#include <stddef.h>
 #include <unistd.h>
 
+#define OUTBUF_CHUNK_SIZE 4096  // Bytes per chunk of an output buffer.
+#define OUTBUF_FLUSH_SIZE 65536 // Buffered bytes that trigger a flush.
+#define OUTBUF_IOV_MAX 64       // Chunks written by each writev call.
+
+/// Fixed-size piece of an output buffer.
+typedef struct OutChunk {
+  struct OutChunk *next;        // Next chunk, NULL for the last one
+  size_t len;                   // Number of bytes in use
+  char data[OUTBUF_CHUNK_SIZE]; // Buffered bytes
+} OutChunk;
+
+/// In-memory buffer that collects the output of a job before it is written
+/// to the job's output file. It grows by chunks, so appending never moves
+/// the bytes already buffered, and the chunks are written with one writev.
+typedef struct OutBuffer {
+  OutChunk *head; // First chunk, NULL while nothing was ever buffered
+  OutChunk *tail; // Chunk being filled
+  size_t len;     // Number of bytes buffered
+  int failed;     // 1 if bytes were lost since it was last emptied
+} OutBuffer;
+
+/// Separators of a formatted key value pair, "(key<sep>value<end>".
+typedef struct PairFormat {
+  const char *sep; // Between the key and the value
+  size_t sep_len;
+  const char *end; // After the value
+  size_t end_len;
+} PairFormat;
+
+extern const PairFormat PAIR_RESULT; // "(key,value)", for READ and DELETE
+extern const PairFormat PAIR_LINE;   // "(key, value)\n", for SHOW and backups
+
 /// Writes a string to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param str The string to write.
@@ -20,4 +53,78 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied
 size_t strn_memcpy(char *dest, const char *src, size_t n);
 
+/// Computes the length of a formatted pair.
+/// @param fmt Separators of the pair.
+/// @param key_len Length of the key.
+/// @param value_len Length of the value.
+/// @return Number of bytes pair_format writes for this pair.
+size_t pair_length(const PairFormat *fmt, size_t key_len, size_t value_len);
+
+/// Formats a pair into dest, which must hold pair_length bytes. Nothing is
+/// allocated and no '\0' is written, so it is async signal safe.
+/// @param dest Where to write the pair.
+/// @param fmt Separators of the pair.
+/// @param key The key.
+/// @param key_len Length of the key.
+/// @param value The value.
+/// @param value_len Length of the value.
+/// @return Number of bytes written.
+size_t pair_format(char *dest, const PairFormat *fmt, const char *key,
+                   size_t key_len, const char *value, size_t value_len);
+
+/// Initializes an empty output buffer.
+/// @param buf The buffer to initialize.
+void outbuf_init(OutBuffer *buf);
+
+/// Appends bytes to an output buffer, growing it if needed.
+/// @param buf The buffer to append to.
+/// @param data The bytes to append.
+/// @param len Number of bytes to append.
+/// @return 0 if successful, 1 otherwise.
+int outbuf_append(OutBuffer *buf, const char *data, size_t len);
+
+/// Appends a string to an output buffer.
+/// @param buf The buffer to append to.
+/// @param str The string to append.
+/// @return 0 if successful, 1 otherwise.
+int outbuf_puts(OutBuffer *buf, const char *str);
+
+/// Appends a formatted pair to an output buffer.
+/// @param buf The buffer to append to.
+/// @param fmt Separators of the pair.
+/// @param key The key.
+/// @param key_len Length of the key.
+/// @param value The value.
+/// @param value_len Length of the value.
+/// @return 0 if successful, 1 otherwise.
+int outbuf_pair(OutBuffer *buf, const PairFormat *fmt, const char *key,
+                size_t key_len, const char *value, size_t value_len);
+
+/// Moves the bytes of a buffer to the end of another one.
+/// @param buf The buffer to append to.
+/// @param src The buffer to empty.
+/// @return 0 if successful, 1 otherwise.
+int outbuf_take(OutBuffer *buf, OutBuffer *src);
+
+/// Empties a buffer, keeping its first chunk for reuse.
+/// @param buf The buffer to empty.
+void outbuf_clear(OutBuffer *buf);
+
+/// Writes the buffered bytes to a file descriptor and empties the buffer.
+/// Once uring_start was called the bytes are only queued, see uring_flush.
+/// @param buf The buffer to flush.
+/// @param fd The file descriptor to write to.
+/// @return 0 if successful, 1 otherwise.
+int outbuf_flush(OutBuffer *buf, int fd);
+
+/// Flushes a buffer once it holds OUTBUF_FLUSH_SIZE bytes or more.
+/// @param buf The buffer to flush.
+/// @param fd The file descriptor to write to.
+/// @return 0 if successful, 1 otherwise.
+int outbuf_flush_full(OutBuffer *buf, int fd);
+
+/// Frees the memory held by an output buffer.
+/// @param buf The buffer to free.
+void outbuf_free(OutBuffer *buf);
+
 #endif // KVS_IO_H
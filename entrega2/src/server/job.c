@@ -0,0 +1,88 @@
+#include "job.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "operations.h"
+
+int job_cmd_init(JobCmd *cmd) {
+  char(*strings)[MAX_STRING_SIZE] =
+      malloc(2 * MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  if (strings == NULL) {
+    return 1;
+  }
+
+  cmd->keys = strings;
+  cmd->values = strings + MAX_WRITE_SIZE;
+  return 0;
+}
+
+void job_cmd_free(JobCmd *cmd) {
+  free(cmd->keys);
+  cmd->keys = NULL;
+  cmd->values = NULL;
+}
+
+/// Reports a WRITE, READ or DELETE that could not be executed.
+/// @param cmd The command.
+static void report_failure(enum Command cmd) {
+  if (cmd == CMD_WRITE) {
+    write_str(STDERR_FILENO, "Failed to write pair\n");
+  } else if (cmd == CMD_READ) {
+    write_str(STDERR_FILENO, "Failed to read pair\n");
+  } else {
+    write_str(STDERR_FILENO, "Failed to delete pair\n");
+  }
+}
+
+/// Ends a batch, reporting it if its WAL records could not be written.
+/// @param batch Batch to end.
+/// @param out Buffer that receives the command's output.
+/// @return 0 if successful, 1 otherwise.
+static int end_batch(KvsBatch *batch, OutBuffer *out) {
+  enum Command cmd = batch->cmd;
+  if (kvs_batch_end(batch, out)) {
+    report_failure(cmd);
+    return 1;
+  }
+  return 0;
+}
+
+int job_execute_chunk(const JobCmd *cmd, KvsBatch *batch, OutBuffer *out) {
+  if (cmd->num_pairs == 0) {
+    // A malformed chunk rejects the whole batch, like a malformed line
+    write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+    kvs_batch_cancel(batch, out);
+    return 1;
+  }
+
+  if (batch->cmd != cmd->cmd) {
+    // A batch still in progress never got its last chunk
+    kvs_batch_cancel(batch, out);
+    if (kvs_batch_begin(batch, cmd->cmd, out)) {
+      report_failure(cmd->cmd);
+      return 1;
+    }
+  }
+
+  if (kvs_batch_run(batch, cmd->num_pairs, cmd->keys, cmd->values, cmd->more,
+                    out)) {
+    report_failure(cmd->cmd);
+    kvs_batch_cancel(batch, out);
+    return 1;
+  }
+
+  return cmd->more ? 0 : end_batch(batch, out);
+}
+
+void job_finish(KvsBatch *batch, OutBuffer *out) {
+  kvs_batch_cancel(batch, out);
+}
+
+int job_execute(const JobCmd *cmd, OutBuffer *out) {
+  KvsBatch batch = KVS_BATCH_INIT;
+  int result = job_execute_chunk(cmd, &batch, out);
+  job_finish(&batch, out);
+  return result;
+}
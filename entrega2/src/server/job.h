@@ -0,0 +1,42 @@
+#ifndef KVS_JOB_H
+#define KVS_JOB_H
+
+#include "io.h"
+#include "operations.h"
+#include "parser.h"
+
+/// Allocates the keys and values of a command. A worker sets up one command
+/// and reuses it for every command it parses: the storage is not zeroed, the
+/// decoders terminate each string they store and only num_pairs are used.
+/// @param cmd The command to set up.
+/// @return 0 if successful, 1 otherwise.
+int job_cmd_init(JobCmd *cmd);
+
+/// Frees the keys and values of a command set up by job_cmd_init.
+/// @param cmd The command to free.
+void job_cmd_free(JobCmd *cmd);
+
+/// Executes a WRITE, READ or DELETE command against the KVS.
+/// @param cmd The command to execute, a whole one (more is not set).
+/// @param out Buffer that receives the command's output.
+/// @return 0 if the command was executed successfully, 1 otherwise.
+int job_execute(const JobCmd *cmd, OutBuffer *out);
+
+/// Executes a WRITE, READ or DELETE command, or a chunk of a longer one (see
+/// parse_command). The KVS stays locked from the first chunk of a batch to
+/// its last, so the batch is atomic and writes a single output list. A
+/// chunk that fails or is malformed cancels the whole batch (see
+/// kvs_batch_cancel).
+/// @param cmd The command, or chunk, to execute.
+/// @param batch Batch in progress, KVS_BATCH_INIT before the first chunk.
+/// @param out Buffer that receives the command's output.
+/// @return 0 if the chunk was executed successfully, 1 otherwise.
+int job_execute_chunk(const JobCmd *cmd, KvsBatch *batch, OutBuffer *out);
+
+/// Cancels a batch whose last chunk never came, when the job file ends in
+/// the middle of it. Does nothing if no batch is in progress.
+/// @param batch Batch to end.
+/// @param out Buffer that receives the command's output.
+void job_finish(KvsBatch *batch, OutBuffer *out);
+
+#endif // KVS_JOB_H
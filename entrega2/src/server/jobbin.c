@@ -0,0 +1,309 @@
+#include "jobbin.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kvs.h"
+
+/// A mapped binary job file.
+typedef struct JobBin {
+  const uint8_t *data; // Contents of the file
+  size_t len;          // Size of the file
+  size_t pos;          // Offset of the next command
+  enum Command batch;  // Command continued by the next record, EOC if none
+} JobBin;
+
+/// Mapped files indexed by file descriptor, like the readers of parser.c.
+static JobBin **bins = NULL;
+static long max_bins = 0;
+static pthread_once_t bins_once = PTHREAD_ONCE_INIT;
+
+static void bins_init() {
+  long open_max = sysconf(_SC_OPEN_MAX);
+  if (open_max <= 0) {
+    open_max = 1024;
+  }
+
+  bins = calloc((size_t)open_max, sizeof(JobBin *));
+  if (bins != NULL) {
+    max_bins = open_max;
+  }
+}
+
+static JobBin *get_bin(int fd) {
+  pthread_once(&bins_once, bins_init);
+  if (fd < 0 || fd >= max_bins) {
+    return NULL;
+  }
+  return bins[fd];
+}
+
+static int put_u8(OutBuffer *out, uint8_t value) {
+  return outbuf_append(out, (const char *)&value, 1);
+}
+
+static int put_u16(OutBuffer *out, uint16_t value) {
+  char bytes[2] = {(char)(value & 0xff), (char)(value >> 8)};
+  return outbuf_append(out, bytes, sizeof(bytes));
+}
+
+static int put_u32(OutBuffer *out, uint32_t value) {
+  char bytes[4] = {(char)(value & 0xff), (char)((value >> 8) & 0xff),
+                   (char)((value >> 16) & 0xff), (char)(value >> 24)};
+  return outbuf_append(out, bytes, sizeof(bytes));
+}
+
+int jobbin_write_header(OutBuffer *out) {
+  if (outbuf_append(out, JOBBIN_MAGIC, 4) || put_u16(out, JOBBIN_VERSION) ||
+      put_u16(out, 0)) {
+    return 1;
+  }
+  return 0;
+}
+
+/// Encodes the keys (and values, for a WRITE) of a command.
+/// @param cmd Command to encode.
+/// @param out Buffer to append to.
+/// @return 0 if successful, 1 otherwise.
+static int encode_pairs(const JobCmd *cmd, OutBuffer *out) {
+  if (put_u16(out, (uint16_t)cmd->num_pairs)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < cmd->num_pairs; i++) {
+    size_t key_len = strlen(cmd->keys[i]);
+    if (put_u8(out, (uint8_t)hash(cmd->keys[i])) ||
+        put_u8(out, (uint8_t)key_len)) {
+      return 1;
+    }
+
+    if (cmd->cmd == CMD_WRITE) {
+      size_t value_len = strlen(cmd->values[i]);
+      if (put_u8(out, (uint8_t)value_len) ||
+          outbuf_append(out, cmd->keys[i], key_len) ||
+          outbuf_append(out, cmd->values[i], value_len)) {
+        return 1;
+      }
+    } else if (outbuf_append(out, cmd->keys[i], key_len)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int jobbin_encode(const JobCmd *cmd, OutBuffer *out) {
+  uint8_t more = cmd->more ? JOBBIN_OP_MORE : 0;
+
+  switch (cmd->cmd) {
+  case CMD_WRITE:
+    return put_u8(out, JOBBIN_OP_WRITE | more) || encode_pairs(cmd, out);
+  case CMD_READ:
+    return put_u8(out, JOBBIN_OP_READ | more) || encode_pairs(cmd, out);
+  case CMD_DELETE:
+    return put_u8(out, JOBBIN_OP_DELETE | more) || encode_pairs(cmd, out);
+  case CMD_SHOW:
+    return put_u8(out, JOBBIN_OP_SHOW);
+  case CMD_WAIT:
+    return put_u8(out, JOBBIN_OP_WAIT) || put_u32(out, cmd->delay);
+  case CMD_BACKUP:
+    return put_u8(out, JOBBIN_OP_BACKUP);
+  case CMD_HELP:
+    return put_u8(out, JOBBIN_OP_HELP);
+  case CMD_INVALID:
+    // Kept so the server reports it when the job runs, like for a .job
+    return put_u8(out, JOBBIN_OP_INVALID);
+  case CMD_EMPTY:
+  case EOC:
+    break;
+  }
+
+  return 0;
+}
+
+int jobbin_open(int fd) {
+  pthread_once(&bins_once, bins_init);
+  if (fd < 0 || fd >= max_bins) {
+    // Past the table, sized from the descriptor limit at first use
+    fprintf(stderr, "No job binary slot for file descriptor %d (limit %ld)\n",
+            fd, max_bins);
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < JOBBIN_HEADER_SIZE) {
+    return 1;
+  }
+
+  size_t len = (size_t)st.st_size;
+  void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+
+  const uint8_t *bytes = data;
+  if (memcmp(bytes, JOBBIN_MAGIC, 4) != 0 ||
+      (bytes[4] | bytes[5] << 8) != JOBBIN_VERSION) {
+    munmap(data, len);
+    return 1;
+  }
+
+  JobBin *bin = malloc(sizeof(JobBin));
+  if (bin == NULL) {
+    munmap(data, len);
+    return 1;
+  }
+
+  // The whole file is read front to back, exactly once
+  posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+
+  bin->data = bytes;
+  bin->len = len;
+  bin->pos = JOBBIN_HEADER_SIZE;
+  bin->batch = EOC;
+  bins[fd] = bin;
+  return 0;
+}
+
+/// Decodes the keys (and values, for a WRITE) of a command.
+/// @param bin The mapped file.
+/// @param cmd Command to fill.
+/// @return 0 if successful, 1 if the file is corrupted.
+static int decode_pairs(JobBin *bin, JobCmd *cmd) {
+  const uint8_t *data = bin->data;
+  size_t pos = bin->pos;
+  int with_values = cmd->cmd == CMD_WRITE;
+  size_t fixed = with_values ? 3 : 2;
+
+  if (bin->len - pos < 2) {
+    return 1;
+  }
+  cmd->num_pairs = (size_t)(data[pos] | data[pos + 1] << 8);
+  pos += 2;
+  // Only a malformed chunk of a continued batch has no pairs
+  if ((cmd->num_pairs == 0 && bin->batch == EOC) ||
+      cmd->num_pairs > MAX_WRITE_SIZE ||
+      (cmd->more && cmd->num_pairs != MAX_WRITE_SIZE)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < cmd->num_pairs; i++) {
+    if (bin->len - pos < fixed) {
+      return 1;
+    }
+
+    uint8_t key_hash = data[pos];
+    size_t key_len = data[pos + 1];
+    size_t value_len = with_values ? data[pos + 2] : 0;
+    pos += fixed;
+
+    if (key_len >= MAX_STRING_SIZE || value_len >= MAX_STRING_SIZE ||
+        bin->len - pos < key_len + value_len) {
+      return 1;
+    }
+
+    memcpy(cmd->keys[i], data + pos, key_len);
+    cmd->keys[i][key_len] = '\0';
+    pos += key_len;
+
+    if (with_values) {
+      memcpy(cmd->values[i], data + pos, value_len);
+      cmd->values[i][value_len] = '\0';
+      pos += value_len;
+    }
+
+    if ((uint8_t)hash(cmd->keys[i]) != key_hash) {
+      return 1;
+    }
+  }
+
+  bin->pos = pos;
+  return 0;
+}
+
+enum Command jobbin_next(int fd, JobCmd *cmd) {
+  JobBin *bin = get_bin(fd);
+  cmd->num_pairs = 0;
+  if (bin == NULL || bin->pos >= bin->len) {
+    return cmd->cmd = EOC;
+  }
+
+  const uint8_t *data = bin->data;
+  int corrupted = 0;
+  uint8_t op = data[bin->pos++];
+  cmd->more = (op & JOBBIN_OP_MORE) != 0;
+
+  switch (op & ~JOBBIN_OP_MORE) {
+  case JOBBIN_OP_WRITE:
+    cmd->cmd = CMD_WRITE;
+    corrupted = decode_pairs(bin, cmd);
+    break;
+  case JOBBIN_OP_READ:
+    cmd->cmd = CMD_READ;
+    corrupted = decode_pairs(bin, cmd);
+    break;
+  case JOBBIN_OP_DELETE:
+    cmd->cmd = CMD_DELETE;
+    corrupted = decode_pairs(bin, cmd);
+    break;
+  case JOBBIN_OP_SHOW:
+    cmd->cmd = CMD_SHOW;
+    break;
+  case JOBBIN_OP_WAIT:
+    cmd->cmd = CMD_WAIT;
+    if (bin->len - bin->pos < 4) {
+      corrupted = 1;
+      break;
+    }
+    cmd->delay = (unsigned int)data[bin->pos] |
+                 (unsigned int)data[bin->pos + 1] << 8 |
+                 (unsigned int)data[bin->pos + 2] << 16 |
+                 (unsigned int)data[bin->pos + 3] << 24;
+    bin->pos += 4;
+    break;
+  case JOBBIN_OP_BACKUP:
+    cmd->cmd = CMD_BACKUP;
+    break;
+  case JOBBIN_OP_HELP:
+    cmd->cmd = CMD_HELP;
+    break;
+  case JOBBIN_OP_INVALID:
+    cmd->cmd = CMD_INVALID;
+    break;
+  default:
+    corrupted = 1;
+    break;
+  }
+
+  // Only pair records are continued, by a record of the same command
+  if ((bin->batch != EOC && cmd->cmd != bin->batch) ||
+      (cmd->more && cmd->num_pairs == 0)) {
+    corrupted = 1;
+  }
+
+  if (corrupted) {
+    write_str(STDERR_FILENO, "Corrupted job binary\n");
+    bin->pos = bin->len;
+    bin->batch = EOC;
+    cmd->more = 0;
+    return cmd->cmd = EOC;
+  }
+
+  bin->batch = cmd->more ? cmd->cmd : EOC;
+  return cmd->cmd;
+}
+
+void jobbin_close(int fd) {
+  JobBin *bin = get_bin(fd);
+  if (bin == NULL) {
+    return;
+  }
+
+  munmap((void *)bin->data, bin->len);
+  free(bin);
+  bins[fd] = NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef KVS_JOBBIN_H
+#define KVS_JOBBIN_H
+
+#include <stdint.h>
+
+#include "io.h"
+#include "parser.h"
+
+/// Binary job files (.jobbin) hold the commands of a .job file already
+/// decoded, so the server executes them without any text parsing. They are
+/// produced by the kvsc tool.
+///
+/// Layout, multi-byte fields in little-endian:
+///   header:  "KVSJ" | u16 version | u16 reserved (0)
+///   WRITE:   u8 op | u16 count | count x (u8 hash | u8 klen | u8 vlen |
+///            key | value)
+///   READ,
+///   DELETE:  u8 op | u16 count | count x (u8 hash | u8 klen | key)
+///   WAIT:    u8 op | u32 delay_ms
+///   others:  u8 op
+/// The hash of each key is the one of hash() in kvs.c, checked on load so a
+/// file compiled for another table layout is rejected. A WRITE, READ or
+/// DELETE longer than MAX_WRITE_SIZE pairs is split into records of the same
+/// op, all but the last with JOBBIN_OP_MORE set in the op byte.
+#define JOBBIN_MAGIC "KVSJ"
+#define JOBBIN_VERSION 1
+#define JOBBIN_HEADER_SIZE 8
+#define JOBBIN_OP_MORE 0x80 // Flag of a record continued by the next one
+
+enum JobBinOp {
+  JOBBIN_OP_WRITE = 1,
+  JOBBIN_OP_READ,
+  JOBBIN_OP_DELETE,
+  JOBBIN_OP_SHOW,
+  JOBBIN_OP_WAIT,
+  JOBBIN_OP_BACKUP,
+  JOBBIN_OP_HELP,
+  JOBBIN_OP_INVALID,
+};
+
+/// Appends the header of a binary job file.
+/// @param out Buffer to append to.
+/// @return 0 if successful, 1 otherwise.
+int jobbin_write_header(OutBuffer *out);
+
+/// Appends the binary encoding of a command. Empty lines and the end of the
+/// commands are not encoded.
+/// @param cmd Command to encode.
+/// @param out Buffer to append to.
+/// @return 0 if successful, 1 otherwise.
+int jobbin_encode(const JobCmd *cmd, OutBuffer *out);
+
+/// Maps a binary job file and checks its header.
+/// @param fd File descriptor of the binary job file.
+/// @return 0 if successful, 1 otherwise.
+int jobbin_open(int fd);
+
+/// Decodes the next command of a binary job file opened with jobbin_open.
+/// The keys and values arrays of the command must hold MAX_WRITE_SIZE
+/// strings.
+/// @param fd File descriptor of the binary job file.
+/// @param cmd Command to fill.
+/// @return The command code, EOC at the end of the file or if the file is
+/// corrupted.
+enum Command jobbin_next(int fd, JobCmd *cmd);
+
+/// Unmaps a binary job file. Must be called before the file descriptor is
+/// closed.
+/// @param fd File descriptor of the binary job file.
+void jobbin_close(int fd);
+
+#endif // KVS_JOBBIN_H
@@ -26,13 +26,64 @@ struct HashTable *create_hash_table() {
     return NULL;
   for (int i = 0; i < TABLE_SIZE; i++) {
     ht->table[i] = NULL;
+    ht->dirty[i] = 0;
+    ht->frozen[i] = NULL;
   }
+  pthread_mutex_init(&ht->frozenlock, NULL);
   pthread_rwlock_init(&ht->tablelock, NULL);
   return ht;
 }
 
+static void free_chain(KeyNode *keyNode) {
+  while (keyNode != NULL) {
+    KeyNode *temp = keyNode;
+    keyNode = keyNode->next;
+    free(temp->key);
+    free(temp->value);
+    free(temp);
+  }
+}
+
+/// Gives the table its own copy of a bucket's chain captured by snapshots,
+/// which keep the original. Called with the table locked for writing.
+/// @param ht The hash table.
+/// @param index The bucket.
+/// @return 0 if successful, 1 otherwise.
+static int unshare_bucket(HashTable *ht, int index) {
+  KeyNode *head = NULL;
+  KeyNode **tail = &head;
+  for (KeyNode *node = ht->table[index]; node != NULL; node = node->next) {
+    KeyNode *copy = malloc(sizeof(KeyNode));
+    if (copy == NULL) {
+      free_chain(head);
+      return 1;
+    }
+    *copy = *node;
+    copy->key = strdup(node->key);
+    copy->value = strdup(node->value);
+    copy->next = NULL;
+    if (copy->key == NULL || copy->value == NULL) {
+      free_chain(copy);
+      free_chain(head);
+      return 1;
+    }
+    *tail = copy;
+    tail = &copy->next;
+  }
+
+  // Snapshots only change frozen with the table locked for reading
+  ht->frozen[index]->detached = 1;
+  ht->frozen[index] = NULL;
+  ht->table[index] = head;
+  return 0;
+}
+
 int write_pair(HashTable *ht, const char *key, const char *value) {
   int index = hash(key);
+  if (ht->frozen[index] != NULL && unshare_bucket(ht, index)) {
+    return 1;
+  }
+  ht->dirty[index] = 1;
 
   // Search for the key node
   KeyNode *keyNode = ht->table[index];
@@ -43,6 +94,7 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
       // overwrite value
       free(keyNode->value);
       keyNode->value = strdup(value);
+      keyNode->value_len = strlen(value);
       return 0;
     }
     previousNode = keyNode;
@@ -52,6 +104,8 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
   keyNode = malloc(sizeof(KeyNode));
   keyNode->key = strdup(key);       // Allocate memory for the key
   keyNode->value = strdup(value);   // Allocate memory for the value
+  keyNode->key_len = strlen(key);
+  keyNode->value_len = strlen(value);
   keyNode->next = ht->table[index]; // Link to existing nodes
   ht->table[index] = keyNode; // Place new key node at the start of the list
   return 0;
@@ -76,8 +130,22 @@ char *read_pair(HashTable *ht, const char *key) {
   return NULL; // Key not found
 }
 
+KeyNode *find_pair(HashTable *ht, const char *key) {
+  int index = hash(key);
+
+  KeyNode *keyNode = ht->table[index];
+  while (keyNode != NULL && strcmp(keyNode->key, key) != 0) {
+    keyNode = keyNode->next;
+  }
+  return keyNode;
+}
+
 int delete_pair(HashTable *ht, const char *key) {
   int index = hash(key);
+  if (ht->frozen[index] != NULL && find_pair(ht, key) != NULL &&
+      unshare_bucket(ht, index)) {
+    return 1;
+  }
 
   // Search for the key node
   KeyNode *keyNode = ht->table[index];
@@ -86,6 +154,7 @@ int delete_pair(HashTable *ht, const char *key) {
   while (keyNode != NULL) {
     if (strcmp(keyNode->key, key) == 0) {
       // Key found; delete this node
+      ht->dirty[index] = 1;
       if (prevNode == NULL) {
         // Node to delete is the first node in the list
         ht->table[index] =
@@ -108,17 +177,51 @@ int delete_pair(HashTable *ht, const char *key) {
   return 1;
 }
 
-void free_table(HashTable *ht) {
+int freeze_table(HashTable *ht, FrozenChain *chains[TABLE_SIZE]) {
+  pthread_mutex_lock(&ht->frozenlock);
   for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = ht->table[i];
-    while (keyNode != NULL) {
-      KeyNode *temp = keyNode;
-      keyNode = keyNode->next;
-      free(temp->key);
-      free(temp->value);
-      free(temp);
+    if (ht->frozen[i] == NULL) {
+      FrozenChain *chain = malloc(sizeof(FrozenChain));
+      if (chain == NULL) {
+        pthread_mutex_unlock(&ht->frozenlock);
+        chains[i] = NULL; // Releases what was captured so far
+        thaw_table(ht, chains);
+        return 1;
+      }
+      chain->head = ht->table[i];
+      chain->refs = 0;
+      chain->detached = 0;
+      ht->frozen[i] = chain;
+    }
+    ht->frozen[i]->refs++;
+    chains[i] = ht->frozen[i];
+  }
+  pthread_mutex_unlock(&ht->frozenlock);
+  return 0;
+}
+
+void thaw_table(HashTable *ht, FrozenChain *chains[TABLE_SIZE]) {
+  pthread_mutex_lock(&ht->frozenlock);
+  for (int i = 0; i < TABLE_SIZE && chains[i] != NULL; i++) {
+    FrozenChain *chain = chains[i];
+    if (--chain->refs > 0) {
+      continue;
     }
+    if (chain->detached) {
+      free_chain(chain->head);
+    } else {
+      ht->frozen[i] = NULL;
+    }
+    free(chain);
+  }
+  pthread_mutex_unlock(&ht->frozenlock);
+}
+
+void free_table(HashTable *ht) {
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    free_chain(ht->table[i]);
   }
+  pthread_mutex_destroy(&ht->frozenlock);
   pthread_rwlock_destroy(&ht->tablelock);
   free(ht);
 }
@@ -8,11 +8,26 @@
 typedef struct KeyNode {
   char *key;
   char *value;
+  size_t key_len;   // strlen of key, kept for the output formatter
+  size_t value_len; // strlen of value
   struct KeyNode *next;
 } KeyNode;
 
+/// A bucket's chain captured by snapshots. While captured the chain is not
+/// modified: the first change to the bucket gives the table a copy of it.
+typedef struct FrozenChain {
+  KeyNode *head;
+  size_t refs;  // Snapshots still reading the chain
+  int detached; // 1 once the table has its own copy of the chain
+} FrozenChain;
+
 typedef struct HashTable {
   KeyNode *table[TABLE_SIZE];
+  unsigned char dirty[TABLE_SIZE]; // 1 for buckets changed by write_pair or
+                                   // delete_pair since last cleared
+  FrozenChain *frozen[TABLE_SIZE]; // Chain of each bucket captured by
+                                   // snapshots, NULL if none
+  pthread_mutex_t frozenlock;      // Serializes freeze_table and thaw_table
   pthread_rwlock_t tablelock;
 } HashTable;
 
@@ -35,12 +50,33 @@ int write_pair(HashTable *ht, const char *key, const char *value);
 // return the value if found, NULL otherwise.
 char *read_pair(HashTable *ht, const char *key);
 
+/// Finds the node of a given key, without copying its value. The table lock
+/// must be held for as long as the node is used.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair.
+/// @return The node if found, NULL otherwise.
+KeyNode *find_pair(HashTable *ht, const char *key);
+
 /// Deletes a pair from the table.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Captures the chains of every bucket for a snapshot, which reads them
+/// without the table lock until thaw_table. The table must be locked for
+/// reading.
+/// @param ht Hash table to capture.
+/// @param chains Set to the captured chain of each bucket.
+/// @return 0 if successful, 1 otherwise.
+int freeze_table(HashTable *ht, FrozenChain *chains[TABLE_SIZE]);
+
+/// Releases the chains captured by freeze_table, freeing those the table no
+/// longer uses. The table must be locked for reading.
+/// @param ht Hash table the chains were captured from.
+/// @param chains The captured chains.
+void thaw_table(HashTable *ht, FrozenChain *chains[TABLE_SIZE]);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
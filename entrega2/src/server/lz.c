@@ -0,0 +1,182 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t read_u32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static unsigned int hash4(uint32_t value) {
+  return (unsigned int)((value * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/// Writes the bytes of a length beyond the nibble of its token.
+/// @return 0 if successful, 1 if the output is full.
+static int put_length(unsigned char *out, size_t *pos, size_t cap,
+                      size_t len) {
+  while (len >= 255) {
+    if (*pos >= cap) {
+      return 1;
+    }
+    out[(*pos)++] = 255;
+    len -= 255;
+  }
+  if (*pos >= cap) {
+    return 1;
+  }
+  out[(*pos)++] = (unsigned char)len;
+  return 0;
+}
+
+/// Reads the bytes of a length beyond the nibble of its token.
+/// @param in Position in the input, moved past the length.
+/// @param end End of the input.
+/// @param len Nibble of the token, increased by the bytes read.
+/// @param max Largest valid length.
+/// @return 0 if successful, 1 if the input is malformed.
+static int get_length(const unsigned char **in, const unsigned char *end,
+                      size_t *len, size_t max) {
+  unsigned char byte;
+  do {
+    if (*in >= end) {
+      return 1;
+    }
+    byte = *(*in)++;
+    *len += byte;
+    if (*len > max) {
+      return 1;
+    }
+  } while (byte == 255);
+  return 0;
+}
+
+/// Writes a sequence.
+/// @param match_len Length of its match, 0 for the last sequence.
+/// @return 0 if successful, 1 if the output is full.
+static int put_sequence(unsigned char *out, size_t *pos, size_t cap,
+                        const unsigned char *literals, size_t literal_len,
+                        size_t offset, size_t match_len) {
+  if (*pos >= cap) {
+    return 1;
+  }
+  size_t token = (*pos)++;
+  out[token] = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4);
+  if (literal_len >= 15 && put_length(out, pos, cap, literal_len - 15)) {
+    return 1;
+  }
+  if (cap - *pos < literal_len) {
+    return 1;
+  }
+  memcpy(out + *pos, literals, literal_len);
+  *pos += literal_len;
+
+  if (match_len == 0) {
+    return 0;
+  }
+  size_t extra = match_len - LZ_MIN_MATCH;
+  out[token] |= (unsigned char)(extra < 15 ? extra : 15);
+  if (cap - *pos < 2) {
+    return 1;
+  }
+  out[(*pos)++] = (unsigned char)(offset & 0xff);
+  out[(*pos)++] = (unsigned char)(offset >> 8);
+  return extra >= 15 && put_length(out, pos, cap, extra - 15);
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  size_t pos = 0;    // Next byte to match
+  size_t anchor = 0; // First byte not written yet
+  size_t written = 0;
+  while (len - pos >= LZ_MIN_MATCH && len <= UINT32_MAX) {
+    uint32_t value = read_u32(in + pos);
+    unsigned int h = hash4(value);
+    size_t candidate = table[h];
+    table[h] = (uint32_t)pos;
+
+    if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET ||
+        read_u32(in + candidate) != value) {
+      pos++;
+      continue;
+    }
+
+    size_t match_len = LZ_MIN_MATCH;
+    while (pos + match_len < len &&
+           in[candidate + match_len] == in[pos + match_len]) {
+      match_len++;
+    }
+    if (put_sequence(out, &written, cap, in + anchor, pos - anchor,
+                     pos - candidate, match_len)) {
+      return 0;
+    }
+    pos += match_len;
+    anchor = pos;
+  }
+
+  if (put_sequence(out, &written, cap, in + anchor, len - anchor, 0, 0)) {
+    return 0;
+  }
+  return written;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t raw_len) {
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *end = in + len;
+  unsigned char *out = (unsigned char *)dst;
+  size_t pos = 0;
+
+  while (in < end) {
+    unsigned char token = *in++;
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && get_length(&in, end, &literal_len, raw_len)) {
+      return 1;
+    }
+    if ((size_t)(end - in) < literal_len || raw_len - pos < literal_len) {
+      return 1;
+    }
+    memcpy(out + pos, in, literal_len);
+    in += literal_len;
+    pos += literal_len;
+    if (in == end) {
+      break; // The last sequence
+    }
+
+    if (end - in < 2) {
+      return 1;
+    }
+    size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+    in += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && get_length(&in, end, &match_len, raw_len)) {
+      return 1;
+    }
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > pos || raw_len - pos < match_len) {
+      return 1;
+    }
+
+    unsigned char *dest = out + pos;
+    const unsigned char *from = dest - offset;
+    pos += match_len;
+    if (offset >= 8) {
+      // Chunks of a far enough match do not overlap what they copy
+      for (; match_len >= 8; match_len -= 8) {
+        memcpy(dest, from, 8);
+        dest += 8;
+        from += 8;
+      }
+    }
+    while (match_len-- > 0) {
+      *dest++ = *from++;
+    }
+  }
+
+  return pos != raw_len;
+}
@@ -0,0 +1,36 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+
+/// A byte-oriented LZ77 block compressor, for backups and WAL groups.
+///
+/// A block is a list of sequences, each:
+///   token:    u8, literal count in the high nibble, match length - 4 in
+///             the low one, 15 meaning more bytes follow
+///   literals: [255...] remaining literal count, then the literals
+///   match:    u16 offset back into the output (little-endian), then
+///             [255...] remaining match length
+/// The last sequence has literals only: the block ends after them.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12  // Positions remembered by the compressor
+#define LZ_MAX_OFFSET 65535
+
+/// Compresses a block. Async signal safe, its state is on the stack.
+/// @param src Bytes to compress.
+/// @param len Number of bytes to compress.
+/// @param dst Where to write the compressed block.
+/// @param cap Size of dst.
+/// @return Size of the compressed block, 0 if it does not fit in cap.
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/// Decompresses a block, checking every length and offset.
+/// @param src The compressed block.
+/// @param len Size of the compressed block.
+/// @param dst Where to write the bytes.
+/// @param raw_len Number of bytes the block decompresses to.
+/// @return 0 if the block decompressed to exactly raw_len bytes, 1 if it is
+/// malformed.
+int lz_decompress(const void *src, size_t len, void *dst, size_t raw_len);
+
+#endif // KVS_LZ_H
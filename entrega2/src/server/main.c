@@ -4,8 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
@@ -19,6 +19,40 @@
 #include "parser.h"
 #include "pthread.h"
 #include "client.h"
+#include "dag.h"
+#include "job.h"
+#include "jobbin.h"
+#include "pool.h"
+#include "ring.h"
+#include "sched.h"
+#include "snapshot.h"
+#include "timers.h"
+#include "uring.h"
+#include "wal.h"
+#include "watch.h"
+
+/// How the commands of a job file are executed.
+enum ExecMode {
+  EXEC_SEQUENTIAL, // One command at a time, in file order
+  EXEC_DAG,        // Independent commands concurrently (see dag.h)
+  EXEC_PIPELINE,   // In file order, parsed ahead by another thread
+};
+
+/// Outcome of running a job, or one of its control commands.
+enum JobStatus {
+  JOB_FAILED = -1, // The job files could not be opened
+  JOB_OK,          // Done, or for a command, the job goes on
+  JOB_CHILD,       // The process is a backup child
+  JOB_PARKED,      // Stopped on a WAIT, to be resumed after its delay
+};
+
+/// State of a job kept between runs, so a parked job can be resumed.
+typedef struct JobState {
+  size_t file_backups;  // Backups done by the job so far
+  unsigned int wait_ms; // Delay of the WAIT the job is parked on
+  int can_park;         // 1 if a WAIT parks the job instead of sleeping
+  JobCmd *cmd;          // Command storage of the worker running the job
+} JobState;
 
 struct SharedData {
   DIR *dir;
@@ -26,15 +60,34 @@ struct SharedData {
   pthread_mutex_t directory_mutex;
 };
 
+/// Arguments of a worker thread of the job scheduler.
+struct SchedWorker {
+  Scheduler *sched; // Scheduler shared by every worker
+  size_t id;        // Index of the worker's deque
+};
+
 /// Mutex for protecting the KVS from concurrent access.
 pthread_mutex_t kvs_lock = PTHREAD_MUTEX_INITIALIZER;
-/// Mutex for protecting the current backup state.
-pthread_mutex_t n_current_backups_lock = PTHREAD_MUTEX_INITIALIZER;
-
-size_t active_backups = 0; // Number of active backups
 size_t max_backups;        // Maximum allowed simultaneous backups
+int fork_backups = 0;      // 1 to write backups in child processes
+size_t keep_last = 0;      // Backups kept per job, 0 to keep every one
+size_t keep_hours = 0;     // Hours for which the newest backup is kept
 size_t max_threads;        // Maximum allowed simultaneous threads
 char *jobs_directory = NULL;
+enum ExecMode exec_mode = EXEC_SEQUENTIAL; // Execution mode of the jobs
+int use_scheduler = 0; // 1 to run the jobs largest first with work stealing
+int watch_jobs = 0;    // 1 to keep running the job files added to jobs_directory
+int use_uring = 0;     // 1 to write job output and backups through io_uring
+char *wal_path = NULL;  // Write-ahead log of the KVS, NULL for none
+char *warm_path = NULL; // Binary backup the KVS starts on, NULL for none
+enum WalSync wal_sync = WAL_SYNC_ALWAYS; // When the WAL is made durable
+unsigned int wal_interval_ms = 0;       // Commit window of WAL_SYNC_INTERVAL
+Scheduler *job_sched = NULL; // Scheduler of the jobs when use_scheduler is set
+pthread_mutex_t early_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the below
+char **early_jobs = NULL; // Files watched before job_sched is set
+size_t num_early = 0;     // Number of early_jobs
+TimerQueue job_timers;       // Parked jobs of the scheduler, by deadline
+ThreadPool exec_pool; // Workers running the commands in EXEC_DAG mode
 
 char regist_fifo_name[MAX_PIPE_PATH_LENGTH]; // FIFO of registration
 
@@ -46,26 +99,44 @@ void handle_sigusr1() {
 
 /// Processes the entries in a given directory.
 /// @param dir The directory being processed.
-/// @param entry The current directory entry to be processed.
+/// @param name The name of the current entry to be processed.
 /// @param in_path The path to the input directory or file.
 /// @param out_path The path to the output directory or file.
-/// @return A status code indicating the success or failure of the operation.
-static int entry_files(const char *dir, struct dirent *entry, char *in_path,
-                       char *out_path) {
-  const char *dot = strrchr(entry->d_name, '.');
-  if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 ||
-      strcmp(dot, ".job")) {
+/// @param binary Set to 1 for a compiled (.jobbin) job, 0 for a .job one.
+/// @return A status code indicating the success or failure of the operation,
+/// 1 for a .job file compiled next to it, which runs as the .jobbin instead.
+static int entry_files(const char *dir, const char *name, char *in_path,
+                       char *out_path, int *binary) {
+  const char *dot = strrchr(name, '.');
+  if (dot == NULL || dot == name) {
+    return 1;
+  }
+
+  if (strcmp(dot, ".job") == 0) {
+    *binary = 0;
+  } else if (strcmp(dot, ".jobbin") == 0) {
+    *binary = 1;
+  } else {
     return 1;
   }
 
-  if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
-    fprintf(stderr, "%s/%s\n", dir, entry->d_name);
+  if (strlen(name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+    fprintf(stderr, "%s/%s\n", dir, name);
     return 1;
   }
 
   strcpy(in_path, dir);
   strcat(in_path, "/");
-  strcat(in_path, entry->d_name);
+  strcat(in_path, name);
+
+  // Both would write the same output and backups
+  if (!*binary && strlen(in_path) + 3 < MAX_JOB_FILE_NAME_SIZE) {
+    strcpy(out_path, in_path);
+    strcat(out_path, "bin");
+    if (access(out_path, F_OK) == 0) {
+      return 1;
+    }
+  }
 
   strcpy(out_path, in_path);
   strcpy(strrchr(out_path, '.'), ".out");
@@ -73,119 +144,406 @@ static int entry_files(const char *dir, struct dirent *entry, char *in_path,
   return 0;
 }
 
+/// Executes a command that is not a WRITE, READ or DELETE.
+/// @param cmd The command to execute.
+/// @param out Buffer that receives the command's output.
+/// @param out_fd The file descriptor of the job's output file.
+/// @param filename The name of the file associated with the job.
+/// @param state State of the job.
+/// @return JOB_OK if the job should go on, JOB_CHILD if the process is a
+/// backup child, JOB_PARKED if the job stopped on a WAIT.
+static int run_control(const JobCmd *cmd, OutBuffer *out, int out_fd,
+                       char *filename, JobState *state) {
+  switch (cmd->cmd) {
+  case CMD_SHOW:
+    kvs_show(out);
+    break;
+
+  case CMD_WAIT:
+    if (cmd->delay > 0) {
+      // The job idles, the output it has so far is written out now
+      outbuf_flush(out, out_fd);
+      printf("Waiting %d seconds\n", cmd->delay / 1000);
+      if (state->can_park) {
+        // The worker runs other jobs until the delay has passed
+        state->wait_ms = cmd->delay;
+        return JOB_PARKED;
+      }
+      kvs_wait(cmd->delay);
+    }
+    break;
+
+  case CMD_BACKUP: {
+    // Queued without waiting when max_backups are being written
+    int aux = kvs_backup(++state->file_backups, filename, jobs_directory);
+
+    if (aux < 0) {
+      write_str(STDERR_FILENO, "Failed to do backup\n");
+    } else if (aux == 1) {
+      return JOB_CHILD;
+    }
+    break;
+  }
+
+  case CMD_INVALID:
+    write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+    break;
+
+  case CMD_HELP:
+    write_str(STDOUT_FILENO,
+              "Available commands:\n"
+              "  WRITE [(key,value)(key2,value2),...]\n"
+              "  READ [key,key2,...]\n"
+              "  DELETE [key,key2,...]\n"
+              "  SHOW\n"
+              "  WAIT <delay_ms>\n"
+              "  BACKUP\n" // Not implemented
+              "  HELP\n");
+
+    break;
+
+  case CMD_WRITE:
+  case CMD_READ:
+  case CMD_DELETE:
+  case CMD_EMPTY:
+  case EOC:
+    break;
+  }
+
+  return JOB_OK;
+}
+
 /// Executes a job based on the provided input and output file descriptors, and a specified filename.
 /// @param in_fd The file descriptor for reading input data.
 /// @param out_fd The file descriptor for writing output data.
 /// @param filename The name of the file associated with the job.
+/// @param next Decoder of the input file.
+/// @param state State of the job.
 /// @return A status code indicating the success or failure of the job execution.
-static int run_job(int in_fd, int out_fd, char *filename) {
-  size_t file_backups = 0;
-  while (1) {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
+static int run_job(int in_fd, int out_fd, char *filename, cmd_reader_t next,
+                   JobState *state) {
+  OutBuffer out;
+  outbuf_init(&out);
+  JobCmd *cmd = state->cmd;
+  KvsBatch batch = KVS_BATCH_INIT;
 
-    switch (get_next(in_fd)) {
+  while (1) {
+    switch (next(in_fd, cmd)) {
     case CMD_WRITE:
-      num_pairs =
-          parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
-
-      if (kvs_write(num_pairs, keys, values)) {
-        write_str(STDERR_FILENO, "Failed to write pair\n");
-      }
+    case CMD_READ:
+    case CMD_DELETE:
+      job_execute_chunk(cmd, &batch, &out);
       break;
 
-    case CMD_READ:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    case EOC:
+      job_finish(&batch, &out);
+      printf("EOF\n");
+      outbuf_flush(&out, out_fd);
+      outbuf_free(&out);
+      return JOB_OK;
 
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
+    case CMD_SHOW:
+    case CMD_WAIT:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID: {
+      int status = run_control(cmd, &out, out_fd, filename, state);
+      if (status != JOB_OK) {
+        // A parked job was flushed by its WAIT, a backup child must not write
+        outbuf_free(&out);
+        return status;
       }
+      break;
+    }
+    }
 
-      if (kvs_read(num_pairs, keys, out_fd)) {
-        write_str(STDERR_FILENO, "Failed to read pair\n");
-      }
+    outbuf_flush_full(&out, out_fd);
+  }
+}
+
+/// Executes the chunks of a batch longer than MAX_WRITE_SIZE pairs in order,
+/// from the first one, already decoded, to the last.
+/// @param in_fd The file descriptor for reading input data.
+/// @param out_fd The file descriptor for writing output data.
+/// @param next Decoder of the input file.
+/// @param cmd The first chunk, then storage for the others.
+/// @param out Buffer that receives the output.
+static void run_batch(int in_fd, int out_fd, cmd_reader_t next, JobCmd *cmd,
+                      OutBuffer *out) {
+  KvsBatch batch = KVS_BATCH_INIT;
+  enum Command command = cmd->cmd;
+
+  job_execute_chunk(cmd, &batch, out);
+  while (cmd->more) {
+    outbuf_flush_full(out, out_fd);
+    if (next(in_fd, cmd) != command) {
+      // Only the end of a corrupted file interrupts a batch
       break;
+    }
+    job_execute_chunk(cmd, &batch, out);
+  }
+  job_finish(&batch, out);
+}
 
-    case CMD_DELETE:
-      num_pairs =
-          parse_read_delete(in_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+/// Runs the commands of a dependency window into the job's output buffer.
+/// @param window The window, emptied.
+/// @param out Buffer that receives the output.
+static void run_window(DagWindow *window, OutBuffer *out) {
+  if (dag_run(window, out)) {
+    write_str(STDERR_FILENO, "Failed to write to output file\n");
+  }
+}
+
+/// Executes a job by collecting windows of consecutive WRITE, READ and DELETE
+/// commands and running the independent ones of each window concurrently.
+/// Every other command acts as a barrier. The output is the same as the one
+/// of run_job.
+/// @param in_fd The file descriptor for reading input data.
+/// @param out_fd The file descriptor for writing output data.
+/// @param filename The name of the file associated with the job.
+/// @param next Decoder of the input file.
+/// @param state State of the job.
+/// @return A status code indicating the success or failure of the job execution.
+static int run_job_dag(int in_fd, int out_fd, char *filename,
+                       cmd_reader_t next, JobState *state) {
+  DagWindow *window = dag_create(&exec_pool);
+  if (window == NULL) {
+    write_str(STDERR_FILENO, "Failed to create dependency window\n");
+    return run_job(in_fd, out_fd, filename, next, state);
+  }
+
+  OutBuffer out;
+  outbuf_init(&out);
 
-      if (num_pairs == 0) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+  while (1) {
+    JobCmd *cmd = dag_slot(window);
+
+    switch (next(in_fd, cmd)) {
+    case CMD_WRITE:
+    case CMD_READ:
+    case CMD_DELETE:
+      if (cmd->more) {
+        // A batch longer than a command keeps the KVS locked, a barrier
+        run_window(window, &out);
+        run_batch(in_fd, out_fd, next, cmd, &out);
         continue;
       }
 
-      if (kvs_delete(num_pairs, keys, out_fd)) {
-        write_str(STDERR_FILENO, "Failed to delete pair\n");
+      if (dag_add(window)) {
+        run_window(window, &out);
+        outbuf_flush_full(&out, out_fd);
       }
-      break;
+      continue;
+
+    case CMD_EMPTY:
+    case CMD_INVALID:
+      // Not barriers, they do not touch the KVS nor the output
+      run_control(cmd, &out, out_fd, filename, state);
+      continue;
+
+    case EOC:
+      run_window(window, &out);
+      printf("EOF\n");
+      outbuf_flush(&out, out_fd);
+      dag_destroy(window);
+      outbuf_free(&out);
+      return JOB_OK;
 
     case CMD_SHOW:
-      kvs_show(out_fd);
+    case CMD_WAIT:
+    case CMD_BACKUP:
+    case CMD_HELP:
       break;
+    }
 
-    case CMD_WAIT:
-      if (parse_wait(in_fd, &delay, NULL) == -1) {
-        write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-        continue;
-      }
+    // The window is empty after a barrier, a parked job resumes with a new one
+    run_window(window, &out);
+    int status = run_control(cmd, &out, out_fd, filename, state);
+    if (status != JOB_OK) {
+      dag_destroy(window);
+      outbuf_free(&out);
+      return status;
+    }
+    outbuf_flush_full(&out, out_fd);
+  }
+}
 
-      if (delay > 0) {
-        printf("Waiting %d seconds\n", delay / 1000);
-        kvs_wait(delay);
-      }
+/// Executes a job in two stages: a parser thread decodes the job file into a
+/// bounded ring of commands while this thread executes them in order.
+/// @param in_fd The file descriptor for reading input data.
+/// @param out_fd The file descriptor for writing output data.
+/// @param filename The name of the file associated with the job.
+/// @param next Decoder of the input file.
+/// @param state State of the job.
+/// @return A status code indicating the success or failure of the job execution.
+static int run_job_pipeline(int in_fd, int out_fd, char *filename,
+                            cmd_reader_t next, JobState *state) {
+  // The parser thread reads ahead of the job, a WAIT cannot park it
+  state->can_park = 0;
+
+  CmdRing *ring = ring_create(in_fd, next);
+  if (ring == NULL) {
+    write_str(STDERR_FILENO, "Failed to create command ring\n");
+    return run_job(in_fd, out_fd, filename, next, state);
+  }
+
+  pthread_t parser;
+  if (pthread_create(&parser, NULL, ring_parser, ring) != 0) {
+    write_str(STDERR_FILENO, "Failed to create parser thread\n");
+    ring_destroy(ring);
+    return run_job(in_fd, out_fd, filename, next, state);
+  }
+
+  OutBuffer out;
+  outbuf_init(&out);
+  KvsBatch batch = KVS_BATCH_INIT;
+
+  while (1) {
+    JobCmd *cmd = ring_peek(ring);
+
+    switch (cmd->cmd) {
+    case CMD_WRITE:
+    case CMD_READ:
+    case CMD_DELETE:
+      job_execute_chunk(cmd, &batch, &out);
       break;
 
-    case CMD_BACKUP:
-      pthread_mutex_lock(&n_current_backups_lock);
-      if (active_backups >= max_backups) {
-        wait(NULL);
-      } else {
-        active_backups++;
+    case EOC:
+      job_finish(&batch, &out);
+      printf("EOF\n");
+      if (pthread_join(parser, NULL) != 0) {
+        fprintf(stderr, "Failed to join parser thread\n");
       }
-      pthread_mutex_unlock(&n_current_backups_lock);
-      int aux = kvs_backup(++file_backups, filename, jobs_directory);
+      ring_destroy(ring);
+      outbuf_flush(&out, out_fd);
+      outbuf_free(&out);
+      return JOB_OK;
 
-      if (aux < 0) {
-        write_str(STDERR_FILENO, "Failed to do backup\n");
-      } else if (aux == 1) {
-        return 1;
+    case CMD_SHOW:
+    case CMD_WAIT:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+      if (run_control(cmd, &out, out_fd, filename, state) == JOB_CHILD) {
+        // Backup child: the parser thread only exists in the parent
+        return JOB_CHILD;
       }
       break;
+    }
 
-    case CMD_INVALID:
-      write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
-      break;
+    ring_pop(ring);
+    outbuf_flush_full(&out, out_fd);
+  }
+}
 
-    case CMD_HELP:
-      write_str(STDOUT_FILENO,
-                "Available commands:\n"
-                "  WRITE [(key,value)(key2,value2),...]\n"
-                "  READ [key,key2,...]\n"
-                "  DELETE [key,key2,...]\n"
-                "  SHOW\n"
-                "  WAIT <delay_ms>\n"
-                "  BACKUP\n" // Not implemented
-                "  HELP\n");
+/// Opens the files of a job.
+/// @param in_path Path of the job file.
+/// @param out_path Path of the output file.
+/// @param binary 1 for a compiled (.jobbin) job, 0 for a .job one.
+/// @param in_fd Set to the file descriptor of the job file.
+/// @param out_fd Set to the file descriptor of the output file.
+/// @return 0 if the job can run, 1 if the job binary is invalid (the output
+/// file is left empty), -1 if the files could not be opened or read.
+static int open_job(const char *in_path, const char *out_path, int binary,
+                    int *in_fd, int *out_fd) {
+  *in_fd = open(in_path, O_RDONLY);
+  if (*in_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open input file: ");
+    write_str(STDERR_FILENO, in_path);
+    write_str(STDERR_FILENO, "\n");
+    return -1;
+  }
 
-      break;
+  *out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (*out_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open output file: ");
+    write_str(STDERR_FILENO, out_path);
+    write_str(STDERR_FILENO, "\n");
+    close(*in_fd);
+    return -1;
+  }
 
-    case CMD_EMPTY:
-      break;
+  if (!binary && parser_open(*in_fd)) {
+    write_str(STDERR_FILENO, "Failed to read job file: ");
+    write_str(STDERR_FILENO, in_path);
+    write_str(STDERR_FILENO, "\n");
+    close(*in_fd);
+    close(*out_fd);
+    return -1;
+  }
 
-    case EOC:
-      printf("EOF\n");
-      return 0;
-    }
+  if (binary && jobbin_open(*in_fd)) {
+    write_str(STDERR_FILENO, "Invalid job binary: ");
+    write_str(STDERR_FILENO, in_path);
+    write_str(STDERR_FILENO, "\n");
+    close(*in_fd);
+    close(*out_fd);
+    return 1;
+  }
+
+  return 0;
+}
+
+/// Closes the files of a job opened with open_job.
+/// @param in_fd The file descriptor of the job file.
+/// @param out_fd The file descriptor of the output file.
+/// @param binary 1 for a compiled (.jobbin) job, 0 for a .job one.
+static void close_job(int in_fd, int out_fd, int binary) {
+  if (binary) {
+    jobbin_close(in_fd);
+  } else {
+    parser_close(in_fd);
+  }
+  close(in_fd);
+  // The output may still be queued on the io_uring backend
+  uring_close(out_fd);
+}
+
+/// Runs the commands of a job, from where the job is, in the execution mode.
+/// @param in_fd The file descriptor of the job file.
+/// @param out_fd The file descriptor of the output file.
+/// @param name The name of the job file, used for its backups.
+/// @param binary 1 for a compiled (.jobbin) job, 0 for a .job one.
+/// @param state State of the job.
+/// @return A status code indicating the success or failure of the job execution.
+static int run_job_commands(int in_fd, int out_fd, char *name, int binary,
+                            JobState *state) {
+  cmd_reader_t next = binary ? jobbin_next : parse_command;
+
+  switch (exec_mode) {
+  case EXEC_DAG:
+    return run_job_dag(in_fd, out_fd, name, next, state);
+  case EXEC_PIPELINE:
+    return run_job_pipeline(in_fd, out_fd, name, next, state);
+  case EXEC_SEQUENTIAL:
+  default:
+    return run_job(in_fd, out_fd, name, next, state);
+  }
+}
+
+/// Runs one job file, writing its output file. A WAIT sleeps.
+/// @param in_path Path of the job file.
+/// @param out_path Path of the output file.
+/// @param name The name of the job file, used for its backups.
+/// @param binary 1 for a compiled (.jobbin) job, 0 for a .job one.
+/// @param cmd Command storage of the worker.
+/// @return JOB_OK if the job was run, JOB_CHILD if the process is a backup
+/// child, JOB_FAILED if the files could not be opened.
+static int run_job_file(const char *in_path, const char *out_path, char *name,
+                        int binary, JobCmd *cmd) {
+  int in_fd, out_fd;
+  int opened = open_job(in_path, out_path, binary, &in_fd, &out_fd);
+  if (opened != 0) {
+    return opened == -1 ? JOB_FAILED : JOB_OK;
   }
+
+  JobState state = {
+      .file_backups = 0, .wait_ms = 0, .can_park = 0, .cmd = cmd};
+  int status = run_job_commands(in_fd, out_fd, name, binary, &state);
+  close_job(in_fd, out_fd, binary);
+  return status;
 }
 
 /// Frees arguments and processes files in a given directory.
@@ -196,45 +554,39 @@ static void *get_file(void *arguments) {
   DIR *dir = thread_data->dir;
   char *dir_name = thread_data->dir_name;
 
+  JobCmd cmd;
+  if (job_cmd_init(&cmd)) {
+    fprintf(stderr, "Failed to allocate command buffers\n");
+    return NULL;
+  }
+
   if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
     fprintf(stderr, "Thread failed to lock directory_mutex\n");
+    job_cmd_free(&cmd);
     return NULL;
   }
 
   struct dirent *entry;
   char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
+  int binary;
   while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
+    if (entry_files(dir_name, entry->d_name, in_path, out_path, &binary)) {
       continue;
     }
 
     if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
       fprintf(stderr, "Thread failed to unlock directory_mutex\n");
+      job_cmd_free(&cmd);
       return NULL;
     }
 
-    int in_fd = open(in_path, O_RDONLY);
-    if (in_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
-      write_str(STDERR_FILENO, "\n");
+    int out = run_job_file(in_path, out_path, entry->d_name, binary, &cmd);
+    if (out == JOB_FAILED) {
+      job_cmd_free(&cmd);
       pthread_exit(NULL);
     }
 
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (out_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
-
-    int out = run_job(in_fd, out_fd, entry->d_name);
-
-    close(in_fd);
-    close(out_fd);
-
-    if (out) {
+    if (out == JOB_CHILD) {
       if (closedir(dir) == -1) {
         fprintf(stderr, "Failed to close directory\n");
         return 0;
@@ -245,10 +597,12 @@ static void *get_file(void *arguments) {
 
     if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
       fprintf(stderr, "Thread failed to lock directory_mutex\n");
+      job_cmd_free(&cmd);
       return NULL;
     }
   }
 
+  job_cmd_free(&cmd);
   if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
     fprintf(stderr, "Thread failed to unlock directory_mutex\n");
     return NULL;
@@ -257,6 +611,188 @@ static void *get_file(void *arguments) {
   pthread_exit(NULL);
 }
 
+/// Describes a job file of the jobs directory for the scheduler.
+/// @param name The name of the file.
+/// @param job The job to fill.
+/// @return 0 if the file is a job file, 1 otherwise.
+static int make_job(const char *name, SchedJob *job) {
+  if (entry_files(jobs_directory, name, job->in_path, job->out_path,
+                  &job->binary)) {
+    return 1;
+  }
+
+  struct stat st;
+  if (stat(job->in_path, &st) == -1) {
+    fprintf(stderr, "Failed to stat job file: %s\n", job->in_path);
+    return 1;
+  }
+
+  // The name is copied now, a dirent is reused by the next readdir
+  job->size = st.st_size;
+  strcpy(job->name, name);
+  job->in_fd = -1;
+  job->out_fd = -1;
+  job->backups = 0;
+  job->wait_ms = 0;
+  return 0;
+}
+
+/// Queues a job file that appeared in the jobs directory while the server
+/// runs. A file written again, while it runs or after, is not run twice.
+/// @param name The name of the file.
+static void watch_job_file(const char *name) {
+  // Kept until scan_jobs, which queues those it did not find
+  pthread_mutex_lock(&early_lock);
+  Scheduler *sched = job_sched;
+  if (sched == NULL) {
+    char **grown = realloc(early_jobs, (num_early + 1) * sizeof(char *));
+    if (grown != NULL) {
+      early_jobs = grown;
+      early_jobs[num_early] = strdup(name);
+      num_early += early_jobs[num_early] != NULL;
+    }
+  }
+  pthread_mutex_unlock(&early_lock);
+  if (sched == NULL) {
+    return;
+  }
+
+  SchedJob job;
+  if (make_job(name, &job)) {
+    return;
+  }
+
+  if (sched_push(sched, &job)) {
+    fprintf(stderr, "Failed to queue job file: %s\n", job.in_path);
+  }
+}
+
+/// Lists the job files of the jobs directory into a scheduler, along with
+/// those the watch reported meanwhile, and sets job_sched.
+/// @param dir The jobs directory.
+/// @return The scheduler with every job distributed, NULL on failure.
+static Scheduler *scan_jobs(DIR *dir) {
+  Scheduler *sched = sched_create(max_threads);
+  if (sched == NULL) {
+    return NULL;
+  }
+
+  struct dirent *entry;
+  SchedJob job;
+  int failed = 0;
+  while (!failed && (entry = readdir(dir)) != NULL) {
+    failed = make_job(entry->d_name, &job) == 0 && sched_add(sched, &job);
+  }
+
+  // sched_add skips the watched files the scan found
+  pthread_mutex_lock(&early_lock);
+  for (size_t i = 0; i < num_early; i++) {
+    if (!failed && make_job(early_jobs[i], &job) == 0) {
+      failed = sched_add(sched, &job);
+    }
+    free(early_jobs[i]);
+  }
+  free(early_jobs);
+  early_jobs = NULL;
+  num_early = 0;
+
+  if (failed || sched_distribute(sched)) {
+    pthread_mutex_unlock(&early_lock);
+    sched_destroy(sched);
+    return NULL;
+  }
+  job_sched = sched;
+  pthread_mutex_unlock(&early_lock);
+
+  return sched;
+}
+
+/// Runs a job of the scheduler until it ends or parks on a WAIT.
+/// @param job The job, opened on its first run.
+/// @param cmd Command storage of the worker.
+/// @return A status code indicating the success or failure of the job execution.
+static int run_sched_job(SchedJob *job, JobCmd *cmd) {
+  if (job->in_fd == -1) {
+    int opened =
+        open_job(job->in_path, job->out_path, job->binary, &job->in_fd,
+                 &job->out_fd);
+    if (opened != 0) {
+      return opened == -1 ? JOB_FAILED : JOB_OK;
+    }
+  }
+
+  // The parser keeps its position per file descriptor, any worker resumes it
+  JobState state = {.file_backups = job->backups,
+                    .wait_ms = 0,
+                    .can_park = 1,
+                    .cmd = cmd};
+  int status = run_job_commands(job->in_fd, job->out_fd, job->name,
+                                job->binary, &state);
+  job->backups = state.file_backups;
+
+  if (status == JOB_PARKED) {
+    job->wait_ms = state.wait_ms;
+  } else if (status != JOB_CHILD) {
+    close_job(job->in_fd, job->out_fd, job->binary);
+  }
+  return status;
+}
+
+/// Gives a parked job back to the scheduler once its WAIT is over. Runs on
+/// the timer thread. A job that cannot be queued again is ended.
+/// @param item The parked SchedJob.
+static void resume_job(void *item) {
+  SchedJob *job = (SchedJob *)item;
+  if (sched_resume(job_sched, job) != 0) {
+    fprintf(stderr, "Failed to resume job: %s\n", job->in_path);
+    sched_unpark(job_sched);
+    close_job(job->in_fd, job->out_fd, job->binary);
+    sched_done(job);
+  }
+}
+
+/// Runs the jobs of one worker of the scheduler, then steals jobs from the
+/// other workers until none is left.
+/// @param arguments A pointer to the worker's `SchedWorker`.
+/// @return NULL
+static void *sched_worker(void *arguments) {
+  struct SchedWorker *worker = (struct SchedWorker *)arguments;
+
+  // Jobs left by a worker that fails here are stolen by the others
+  JobCmd cmd;
+  if (job_cmd_init(&cmd)) {
+    fprintf(stderr, "Failed to allocate command buffers\n");
+    return NULL;
+  }
+
+  SchedJob *job;
+  while ((job = sched_next(worker->sched, worker->id)) != NULL) {
+    switch (run_sched_job(job, &cmd)) {
+    case JOB_CHILD:
+      _exit(0);
+
+    case JOB_PARKED:
+      // Counted before the timer can give the job back
+      sched_park(worker->sched);
+      if (timers_add(&job_timers, job->wait_ms, job) != 0) {
+        fprintf(stderr, "Failed to park job: %s\n", job->in_path);
+        kvs_wait(job->wait_ms);
+        resume_job(job);
+      }
+      break;
+
+    case JOB_OK:
+    case JOB_FAILED:
+    default:
+      sched_done(job);
+      break;
+    }
+  }
+
+  job_cmd_free(&cmd);
+  return NULL;
+}
+
 /// Handles FIFO communication for client registration and connection.
 /// @return None
 void handle_fifo() {
@@ -400,28 +936,230 @@ static void dispatch_threads(DIR *dir) {
   free(threads);
 }
 
+/// Dispatches the workers of the job scheduler and handles FIFO
+/// communication. In watch mode, job files added to the jobs directory later
+/// are queued as they appear.
+/// @param dir A pointer to the directory stream of the jobs directory.
+/// @return None
+static void dispatch_scheduled(DIR *dir) {
+  if (timers_init(&job_timers, resume_job) != 0) {
+    fprintf(stderr, "Failed to start the timer thread\n");
+    return;
+  }
+
+  // Watched before the scan, so no file is missed in between
+  if (watch_jobs && watch_start(jobs_directory, watch_job_file) != 0) {
+    fprintf(stderr, "Failed to watch directory: %s\n", jobs_directory);
+    watch_jobs = 0;
+  }
+
+  Scheduler *sched = scan_jobs(dir);
+  if (sched == NULL) {
+    fprintf(stderr, "Failed to schedule the jobs\n");
+    return;
+  }
+
+  // Without a watch the workers stop once the jobs found above are done
+  if (!watch_jobs) {
+    sched_close(sched);
+  }
+
+  pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+  struct SchedWorker *workers = malloc(max_threads * sizeof(struct SchedWorker));
+  if (threads == NULL || workers == NULL) {
+    fprintf(stderr, "Failed to allocate memory for threads\n");
+    free(threads);
+    free(workers);
+    sched_destroy(sched);
+    return;
+  }
+
+  size_t started = 0;
+  for (; started < max_threads; started++) {
+    workers[started] = (struct SchedWorker){sched, started};
+    if (pthread_create(&threads[started], NULL, sched_worker,
+                       &workers[started]) != 0) {
+      fprintf(stderr, "Failed to create thread %zu\n", started);
+      break;
+    }
+  }
+
+  // Jobs assigned to a worker that did not start are stolen by the others
+  if (started > 0) {
+    handle_fifo();
+  }
+
+  for (size_t i = 0; i < started; i++) {
+    if (pthread_join(threads[i], NULL) != 0) {
+      fprintf(stderr, "Failed to join thread %zu\n", i);
+    }
+  }
+
+  sched_destroy(sched);
+  free(workers);
+  free(threads);
+}
+
+/// Prints the usage of the server.
+/// @param name Name of the server executable.
+static void print_usage(const char *name) {
+  write_str(STDERR_FILENO, "Usage: ");
+  write_str(STDERR_FILENO, name);
+  write_str(STDERR_FILENO, " [-x seq|dag|pipeline] [-S] [-w] [-u]");
+  write_str(STDERR_FILENO, " [-f] [-B] [-z] [-D <full_interval>]");
+  write_str(STDERR_FILENO, " [-P <writers>] [-r <MB/s>] [-m <backup>]");
+  write_str(STDERR_FILENO, " [-k <last>] [-H <hours>]");
+  write_str(STDERR_FILENO, " [-l <wal_file> [-y always|never|<ms>]]");
+  write_str(STDERR_FILENO, " <jobs_dir>");
+  write_str(STDERR_FILENO, " <max_threads>");
+  write_str(STDERR_FILENO, " <max_backups>");
+  write_str(STDERR_FILENO, " <fifo_name>\n");
+}
+
 int main(int argc, char **argv) {
-  if (argc < 5) {
-    write_str(STDERR_FILENO, "Usage: ");
-    write_str(STDERR_FILENO, argv[0]);
-    write_str(STDERR_FILENO, " <jobs_dir>");
-		write_str(STDERR_FILENO, " <max_threads>");
-		write_str(STDERR_FILENO, " <max_backups>");
-    write_str(STDERR_FILENO, " <fifo_name>\n");
+  int opt;
+  while ((opt = getopt(argc, argv, "x:SwufBzD:P:r:m:k:H:l:y:")) != -1) {
+    switch (opt) {
+    case 'x':
+      if (strcmp(optarg, "seq") == 0) {
+        exec_mode = EXEC_SEQUENTIAL;
+      } else if (strcmp(optarg, "dag") == 0) {
+        exec_mode = EXEC_DAG;
+      } else if (strcmp(optarg, "pipeline") == 0) {
+        exec_mode = EXEC_PIPELINE;
+      } else {
+        fprintf(stderr, "Invalid execution mode: %s\n", optarg);
+        return 1;
+      }
+      break;
+
+    case 'S':
+      use_scheduler = 1;
+      break;
+
+    case 'w':
+      // New job files are queued on the scheduler's workers
+      watch_jobs = 1;
+      use_scheduler = 1;
+      break;
+
+    case 'u':
+      use_uring = 1;
+      break;
+
+    case 'f':
+      fork_backups = 1;
+      break;
+
+    case 'B':
+      kvs_set_binary_backups(1);
+      break;
+
+    case 'z':
+      // Backups and the WAL are written compressed
+      kvs_set_compressed_backups(1);
+      wal_set_compression(1);
+      break;
+
+    case 'D': {
+      char *end;
+      unsigned long interval = strtoul(optarg, &end, 10);
+      // Longer chains could not be loaded back
+      if (*end != '\0' || interval == 0 || interval > SNAPSHOT_MAX_CHAIN) {
+        fprintf(stderr, "Invalid full backup interval: %s\n", optarg);
+        return 1;
+      }
+      kvs_set_delta_backups(interval);
+      break;
+    }
+
+    case 'P': {
+      char *end;
+      unsigned long num_threads = strtoul(optarg, &end, 10);
+      if (*end != '\0' || num_threads == 0) {
+        fprintf(stderr, "Invalid number of backup writers: %s\n", optarg);
+        return 1;
+      }
+      kvs_set_backup_threads(num_threads);
+      break;
+    }
+
+    case 'l':
+      wal_path = optarg;
+      break;
+
+    case 'r': {
+      char *end;
+      unsigned long rate = strtoul(optarg, &end, 10);
+      if (*end != '\0' || rate == 0 || rate > SIZE_MAX / 1048576) {
+        fprintf(stderr, "Invalid backup rate: %s\n", optarg);
+        return 1;
+      }
+      kvs_set_backup_rate(rate * 1048576);
+      break;
+    }
+
+    case 'm':
+      warm_path = optarg;
+      break;
+
+    case 'k':
+    case 'H': {
+      char *end;
+      unsigned long count = strtoul(optarg, &end, 10);
+      if (*end != '\0' || count == 0) {
+        fprintf(stderr, "Invalid number of backups to keep: %s\n", optarg);
+        return 1;
+      }
+      if (opt == 'k') {
+        keep_last = count;
+      } else {
+        keep_hours = count;
+      }
+      break;
+    }
+
+    case 'y':
+      if (strcmp(optarg, "always") == 0) {
+        wal_sync = WAL_SYNC_ALWAYS;
+      } else if (strcmp(optarg, "never") == 0) {
+        wal_sync = WAL_SYNC_NEVER;
+      } else {
+        // A commit window in milliseconds
+        char *end;
+        unsigned long ms = strtoul(optarg, &end, 10);
+        if (*end != '\0' || ms == 0 || ms > UINT_MAX) {
+          fprintf(stderr, "Invalid WAL sync policy: %s\n", optarg);
+          return 1;
+        }
+        wal_sync = WAL_SYNC_INTERVAL;
+        wal_interval_ms = (unsigned int)ms;
+      }
+      break;
+
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (argc - optind < 4) {
+    print_usage(argv[0]);
     return 1;
   }
+  char **args = argv + optind;
 
-  jobs_directory = argv[1];
+  jobs_directory = args[0];
 
   char *endptr;
-  max_backups = strtoul(argv[3], &endptr, 10);
+  max_backups = strtoul(args[2], &endptr, 10);
 
   if (*endptr != '\0') {
     fprintf(stderr, "Invalid max_proc value\n");
     return 1;
   }
 
-  max_threads = strtoul(argv[2], &endptr, 10);
+  max_threads = strtoul(args[1], &endptr, 10);
 
   if (*endptr != '\0') {
     fprintf(stderr, "Invalid max_threads value\n");
@@ -432,6 +1170,8 @@ int main(int argc, char **argv) {
     write_str(STDERR_FILENO, "Invalid number of backups\n");
     return 0;
   }
+  kvs_set_backup_mode(fork_backups, max_backups);
+  kvs_set_retention(keep_last, keep_hours);
 
   if (max_threads <= 0) {
     write_str(STDERR_FILENO, "Invalid number of threads\n");
@@ -443,14 +1183,35 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  DIR *dir = opendir(argv[1]);
+  if (warm_path != NULL && kvs_warm_start(warm_path)) {
+    write_str(STDERR_FILENO, "Failed to start from the backup\n");
+    return 1;
+  }
+
+  if (wal_path != NULL && (kvs_recover(wal_path, max_threads) ||
+                           wal_open(wal_path, wal_sync, wal_interval_ms))) {
+    write_str(STDERR_FILENO, "Failed to open the WAL\n");
+    return 1;
+  }
+
+  // Without io_uring the output is written with blocking writes
+  if (use_uring && uring_start()) {
+    write_str(STDERR_FILENO, "io_uring is not available, using write\n");
+  }
+
+  if (exec_mode == EXEC_DAG && pool_init(&exec_pool, max_threads)) {
+    write_str(STDERR_FILENO, "Failed to start execution pool\n");
+    return 1;
+  }
+
+  DIR *dir = opendir(args[0]);
   if (dir == NULL) {
-    fprintf(stderr, "Failed to open directory: %s\n", argv[1]);
+    fprintf(stderr, "Failed to open directory: %s\n", args[0]);
     return 0;
   }
 
   // Handle FIFO
-  snprintf(regist_fifo_name, MAX_PIPE_PATH_LENGTH, "%s%s", TEMP_FOLDER, argv[4]);
+  snprintf(regist_fifo_name, MAX_PIPE_PATH_LENGTH, "%s%s", TEMP_FOLDER, args[3]);
   if (fifo_init(regist_fifo_name)) {
     write_str(STDERR_FILENO, "Failed to initialize fifo\n");
     return 1;
@@ -460,19 +1221,21 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  dispatch_threads(dir);
+  if (use_scheduler) {
+    dispatch_scheduled(dir);
+  } else {
+    dispatch_threads(dir);
+  }
 
   if (closedir(dir) == -1) {
     fprintf(stderr, "Failed to close directory\n");
     return 0;
   }
 
-  while (active_backups > 0) {
-    wait(NULL);
-    active_backups--;
-  }
-
   // Terminate KVS (never reached)
+  if (exec_mode == EXEC_DAG) {
+    pool_destroy(&exec_pool);
+  }
   kvs_terminate();
   unlink(regist_fifo_name);
   return 0;
@@ -4,17 +4,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <ctype.h>
 
+#include "backups.h"
 #include "constants.h"
 #include "io.h"
 #include "kvs.h"
+#include "retention.h"
+#include "snapshot.h"
+#include "throttle.h"
+#include "uring.h"
+#include "wal.h"
 
 static struct HashTable *kvs_table = NULL;
+static int binary_backups = 0; // 1 to write backups with snapshot_write
+static int compressed_backups = 0; // 1 to compress their blocks
+
+// Delta backups (see snapshot.h), backups in progress are bounded by
+// backups.h
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fork_backups = 0;      // 1 to write backups in a child process
+static size_t max_backups = 1;    // Backups written at once
+static size_t backup_threads = 1; // Writer threads per snapshot
+static size_t backup_rate = 0;    // Bytes per second, 0 for no limit
+static size_t full_interval = 0;  // A full backup every this many, 0 for
+                                  // full backups only
+static char backup_chain[SNAPSHOT_MAX_CHAIN][50]; // Backups since the last
+                                                  // full one, oldest first
+static size_t chain_len = 0;      // 0 until a backup is taken
+static size_t keep_last = 0;      // Backups kept per job (see retention.h)
+static size_t keep_hours = 0;
+
+// Warm start (see kvs_warm_start), changed with the table locked for writing
+static SnapshotMap warm_base;            // Backup the table overlays
+static int warm_mapped = 0;              // 1 until warm_base is merged
+static char *warm_path = NULL;           // Path of warm_base
+static HashTable *warm_deleted = NULL;   // Keys of warm_base deleted since
+
+/// A backup written by a snapshot thread, from the table as captured by
+/// freeze_table.
+typedef struct BackupTask {
+  HashTable view;                  // Captured chains and dirty buckets
+  FrozenChain *chains[TABLE_SIZE];
+  char name[50];
+  char tmp_name[54];
+  char parent[50];                 // Parent of a delta, "" for a full backup
+  uint64_t lsn;
+  uint64_t checkpoint;             // CHECKPOINT of the WAL, 0 if none
+} BackupTask;
 
 // Define the callback functions
 static kvs_callback_t write_callback = NULL;
@@ -35,6 +76,20 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+/// Shows the retention thread the chain the next delta is based on, taking
+/// no backup meanwhile.
+/// @param scan Called with the chain.
+/// @param arg Passed to scan.
+static void pin_backup_chain(retention_scan_t scan, void *arg) {
+  const char *chain[SNAPSHOT_MAX_CHAIN];
+  pthread_mutex_lock(&backup_lock);
+  for (size_t i = 0; i < chain_len; i++) {
+    chain[i] = backup_chain[i];
+  }
+  scan(chain, chain_len, arg);
+  pthread_mutex_unlock(&backup_lock);
+}
+
 int kvs_init() {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
@@ -42,126 +97,772 @@ int kvs_init() {
   }
 
   kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  return kvs_table == NULL || backups_init(max_backups) ||
+         throttle_init(backup_rate) ||
+         retention_init(keep_last, keep_hours, pin_backup_chain);
 }
 
-int kvs_terminate() {
+int kvs_warm_start(const char *path) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  free_table(kvs_table);
-  kvs_table = NULL;
+  if (snapshot_map(path, &warm_base)) {
+    fprintf(stderr, "Failed to map %s, a full uncompressed binary backup\n",
+            path);
+    return 1;
+  }
+  warm_deleted = create_hash_table();
+  warm_path = strdup(path);
+  if (warm_deleted == NULL || warm_path == NULL) {
+    if (warm_deleted != NULL) {
+      free_table(warm_deleted);
+      warm_deleted = NULL;
+    }
+    free(warm_path);
+    warm_path = NULL;
+    snapshot_unmap(&warm_base);
+    return 1;
+  }
+  warm_mapped = 1;
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
-  if (kvs_table == NULL) {
-    fprintf(stderr, "KVS state must be initialized\n");
+/// Looks a key up in the warm start backup, unless it was deleted since.
+/// The table must be locked.
+/// @param key The key.
+/// @param value Set to the value, in the mapping and not '\0' terminated.
+/// @param value_len Set to the length of the value.
+/// @return 0 if the key was found, 1 otherwise.
+static int find_base(const char *key, const char **value, size_t *value_len) {
+  if (!warm_mapped || find_pair(warm_deleted, key) != NULL) {
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  int found = snapshot_find(&warm_base, key, strnlen(key, MAX_STRING_SIZE),
+                            value, value_len);
+  if (found == -1) {
+    fprintf(stderr, "Corrupted block in %s\n", warm_path);
+  }
+  return found != 0;
+}
 
-  for (size_t i = 0; i < num_pairs; i++) {
-    // Compare if old value is different from new value
-    char *old_value = read_pair(kvs_table, keys[i]);
-    if (old_value != NULL) {
-      if (strcmp(old_value, values[i]) == 0) {
-        free(old_value);
-        continue;
+/// Looks a key up in the table, then in the warm start backup. The table
+/// must be locked.
+/// @param key The key.
+/// @param value Set to the value, not '\0' terminated.
+/// @param value_len Set to the length of the value.
+/// @return 0 if the key was found, 1 otherwise.
+static int find_value(const char *key, const char **value,
+                      size_t *value_len) {
+  KeyNode *keyNode = find_pair(kvs_table, key);
+  if (keyNode != NULL) {
+    *value = keyNode->value;
+    *value_len = keyNode->value_len;
+    return 0;
+  }
+  return find_base(key, value, value_len);
+}
+
+/// Deletes a key from the table and hides it in the warm start backup. The
+/// table must be locked for writing.
+/// @param key The key.
+/// @return 0 if the key was found, 1 otherwise.
+static int remove_pair(const char *key) {
+  int missing = delete_pair(kvs_table, key) != 0;
+
+  const char *value;
+  size_t value_len;
+  if (find_base(key, &value, &value_len) == 0) {
+    if (write_pair(warm_deleted, key, "") != 0) {
+      fprintf(stderr, "Failed to delete key %s\n", key);
+    }
+    missing = 0;
+  }
+  return missing;
+}
+
+/// Value a key had before a chunk of a batch changed it.
+typedef struct KvsUndo {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  int found; // 0 if the key was missing
+} KvsUndo;
+
+/// Makes room in the undo list of a batch for the keys of a chunk.
+/// @param batch The batch.
+/// @param num_pairs Number of keys about to be changed.
+/// @return 0 if successful, 1 otherwise.
+static int undo_reserve(KvsBatch *batch, size_t num_pairs) {
+  if (batch->undo_cap - batch->num_undo >= num_pairs) {
+    return 0;
+  }
+
+  size_t cap = batch->undo_cap > 0 ? batch->undo_cap : MAX_WRITE_SIZE;
+  while (cap - batch->num_undo < num_pairs) {
+    cap *= 2;
+  }
+  KvsUndo *undo = realloc(batch->undo, cap * sizeof(KvsUndo));
+  if (undo == NULL) {
+    return 1;
+  }
+  batch->undo = undo;
+  batch->undo_cap = cap;
+  return 0;
+}
+
+/// Saves the value of a key about to be changed, in room made by
+/// undo_reserve. The table must be locked for writing.
+/// @param batch The batch changing it.
+/// @param key The key.
+static void undo_save(KvsBatch *batch, const char *key) {
+  KvsUndo *undo = &batch->undo[batch->num_undo++];
+  size_t key_len = strnlen(key, MAX_STRING_SIZE - 1);
+  memcpy(undo->key, key, key_len);
+  undo->key[key_len] = '\0';
+
+  const char *value;
+  size_t value_len;
+  undo->found = find_value(key, &value, &value_len) == 0;
+  if (undo->found) {
+    memcpy(undo->value, value, value_len);
+    undo->value[value_len] = '\0';
+  }
+}
+
+/// Restores the values saved by a batch, newest first, and empties its undo
+/// list. The table must be locked for writing.
+/// @param batch The batch.
+static void undo_batch(KvsBatch *batch) {
+  while (batch->num_undo > 0) {
+    KvsUndo *undo = &batch->undo[--batch->num_undo];
+    if (undo->found) {
+      if (write_pair(kvs_table, undo->key, undo->value) != 0) {
+        fprintf(stderr, "Failed to restore key %s\n", undo->key);
+      }
+      if (write_callback != NULL) {
+        write_callback(undo->key, undo->value);
+      }
+    } else {
+      remove_pair(undo->key);
+      if (delete_callback != NULL) {
+        delete_callback(undo->key, NULL);
       }
-      free(old_value);
     }
+  }
+}
 
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+/// Frees the undo list of a batch.
+/// @param batch The batch.
+static void undo_free(KvsBatch *batch) {
+  free(batch->undo);
+  batch->undo = NULL;
+  batch->num_undo = 0;
+  batch->undo_cap = 0;
+}
+
+/// Callback for each pair of the table merged with the warm start backup.
+/// The strings are not '\0' terminated.
+/// @param arg Argument given to warm_visit.
+/// @param bucket Bucket of the pair.
+/// @return 0 if successful, 1 otherwise.
+typedef int (*warm_pair_t)(void *arg, int bucket, const char *key,
+                           size_t key_len, const char *value,
+                           size_t value_len);
+
+/// Run of the warm start backup's sorted pairs whose keys start with one
+/// character, streamed into a visit.
+typedef struct BaseRun {
+  warm_pair_t visit;
+  void *arg;
+  int bucket;          // Bucket of the keys of the run
+  unsigned char first; // First character of the keys of the run
+  int done;            // 1 once a key past the run was read
+} BaseRun;
+
+static int visit_base_pair(void *arg, const char *key, size_t key_len,
+                           const char *value, size_t value_len) {
+  BaseRun *run = (BaseRun *)arg;
+  if (key_len == 0 || key_len >= MAX_STRING_SIZE) {
+    return 1;
+  }
+  if ((unsigned char)key[0] < run->first) {
+    return 0;
+  } else if ((unsigned char)key[0] > run->first) {
+    run->done = 1;
+    return 1;
+  }
+
+  char name[MAX_STRING_SIZE];
+  memcpy(name, key, key_len);
+  name[key_len] = '\0';
+  if (find_pair(warm_deleted, name) != NULL) {
+    return 0;
+  }
+  KeyNode *keyNode = find_pair(kvs_table, name);
+  return keyNode != NULL
+             ? run->visit(run->arg, run->bucket, keyNode->key,
+                          keyNode->key_len, keyNode->value, keyNode->value_len)
+             : run->visit(run->arg, run->bucket, key, key_len, value,
+                          value_len);
+}
+
+/// Lists the pairs of the table merged with the warm start backup, bucket by
+/// bucket in the order a table loaded from the backup would list them: the
+/// keys written since the start first, then the pairs of the backup in key
+/// order, with their values updated. The table must be locked.
+/// @param visit Called for each pair.
+/// @param arg Passed to visit.
+/// @return 0 if successful, 1 if a block of the backup is corrupted or
+/// visit failed.
+static int warm_visit(warm_pair_t visit, void *arg) {
+  const SnapshotFile *snap = &warm_base.snap;
+  int failed = 0;
+
+  for (int i = 0; i < TABLE_SIZE && !failed; i++) {
+    // Keys missing from the backup, or deleted and written again, come first
+    for (KeyNode *keyNode = kvs_table->table[i]; keyNode != NULL && !failed;
+         keyNode = keyNode->next) {
+      const char *value;
+      size_t value_len;
+      if (find_base(keyNode->key, &value, &value_len) != 0) {
+        failed = visit(arg, i, keyNode->key, keyNode->key_len, keyNode->value,
+                       keyNode->value_len);
+      }
     }
 
-    if (write_callback != NULL) {
-      write_callback(keys[i], values[i]);
+    // hash only looks at the first character, so the backup's keys of a
+    // bucket are a few runs of its sorted pairs, read straight from the
+    // mapping in key order
+    char firsts[3];
+    size_t num_firsts = 0;
+    if (i < 10) {
+      firsts[num_firsts++] = (char)('0' + i);
+    }
+    firsts[num_firsts++] = (char)('A' + i);
+    firsts[num_firsts++] = (char)('a' + i);
+
+    for (size_t j = 0; j < num_firsts && !failed; j++) {
+      BaseRun run = {visit, arg, i, (unsigned char)firsts[j], 0};
+      for (size_t block = snapshot_seek(snap, &firsts[j], 1);
+           block < snap->num_blocks && !run.done && !failed; block++) {
+        failed = snapshot_read_block(snap, block, visit_base_pair, &run) &&
+                 !run.done;
+      }
     }
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return failed;
+}
+
+static int show_pair(void *arg, int bucket, const char *key, size_t key_len,
+                     const char *value, size_t value_len) {
+  (void)bucket;
+  outbuf_pair((OutBuffer *)arg, &PAIR_LINE, key, key_len, value, value_len);
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  if (kvs_table == NULL) {
-    fprintf(stderr, "KVS state must be initialized\n");
+/// Chains of the merged table being built, and their ends.
+typedef struct MergedTable {
+  HashTable *ht;
+  KeyNode **tails[TABLE_SIZE];
+} MergedTable;
+
+static int merge_pair(void *arg, int bucket, const char *key, size_t key_len,
+                      const char *value, size_t value_len) {
+  MergedTable *merged = (MergedTable *)arg;
+  KeyNode *keyNode = malloc(sizeof(KeyNode));
+  if (keyNode == NULL) {
     return 1;
   }
+  keyNode->key = malloc(key_len + 1);
+  keyNode->value = malloc(value_len + 1);
+  keyNode->next = NULL;
+  // Linked first, so free_table releases it whatever happens
+  *merged->tails[bucket] = keyNode;
+  merged->tails[bucket] = &keyNode->next;
+  if (keyNode->key == NULL || keyNode->value == NULL) {
+    return 1;
+  }
+  memcpy(keyNode->key, key, key_len);
+  keyNode->key[key_len] = '\0';
+  keyNode->key_len = key_len;
+  memcpy(keyNode->value, value, value_len);
+  keyNode->value[value_len] = '\0';
+  keyNode->value_len = value_len;
+  return 0;
+}
 
+/// Merges the warm start backup into the table, so backups are written from
+/// the table alone, and unmaps it.
+/// @return 0 if successful, 1 otherwise.
+static int warm_merge(void) {
   pthread_rwlock_rdlock(&kvs_table->tablelock);
+  int mapped = warm_mapped;
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  if (!mapped) {
+    return 0;
+  }
 
-  write_str(fd, "[");
-  for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  int failed = 0;
+  if (warm_mapped) {
+    MergedTable merged = {create_hash_table(), {NULL}};
+    failed = merged.ht == NULL;
+    for (int i = 0; i < TABLE_SIZE && !failed; i++) {
+      merged.tails[i] = &merged.ht->table[i];
+    }
+    failed = failed || warm_visit(merge_pair, &merged);
+
+    if (!failed) {
+      // Nothing is frozen before the first backup
+      for (int i = 0; i < TABLE_SIZE; i++) {
+        KeyNode *overlay = kvs_table->table[i];
+        kvs_table->table[i] = merged.ht->table[i];
+        kvs_table->dirty[i] = 1;
+        merged.ht->table[i] = overlay;
+      }
+      snapshot_unmap(&warm_base);
+      free_table(warm_deleted);
+      warm_deleted = NULL;
+      free(warm_path);
+      warm_path = NULL;
+      warm_mapped = 0;
     } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+      fprintf(stderr, "Failed to merge %s into the table\n", warm_path);
+    }
+    if (merged.ht != NULL) {
+      free_table(merged.ht);
     }
-    write_str(fd, aux);
-    free(result);
   }
-  write_str(fd, "]\n");
-
   pthread_rwlock_unlock(&kvs_table->tablelock);
+  return failed;
+}
+
+/// State of a replay of the WAL.
+typedef struct Replay {
+  uint64_t snapshot_lsn; // Last record included in the loaded backup
+  KvsBatch batch;        // Undoes the records of a batch not yet ended
+} Replay;
+
+/// Replays the records of the WAL written after a checkpoint. The records
+/// of a batch are applied as they come, and undone if it is aborted.
+/// @param arg The Replay.
+/// @param record The record.
+/// @return 0 if successful, 1 otherwise.
+static int replay_record(void *arg, const WalRecord *record) {
+  Replay *replay = (Replay *)arg;
+  if (record->lsn <= replay->snapshot_lsn) {
+    return 0;
+  }
+
+  if (record->op == WAL_OP_ABORT) {
+    undo_batch(&replay->batch);
+    return 0;
+  }
+  if (record->more && undo_reserve(&replay->batch, record->num_pairs)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < record->num_pairs; i++) {
+    if (hash(record->keys[i]) < 0) {
+      continue;
+    }
+    if (record->more) {
+      undo_save(&replay->batch, record->keys[i]);
+    }
+    if (record->op == WAL_OP_WRITE) {
+      write_pair(kvs_table, record->keys[i], record->values[i]);
+    } else if (record->op == WAL_OP_DELETE) {
+      remove_pair(record->keys[i]);
+    }
+  }
+
+  if (!record->more) {
+    replay->batch.num_undo = 0;
+  }
+  return 0;
+}
+
+/// Checkpoints found in the WAL, oldest first.
+typedef struct Checkpoints {
+  char **paths;
+  uint64_t *lsns;
+  size_t count;
+  size_t cap;
+} Checkpoints;
+
+static int collect_checkpoint(void *arg, const WalRecord *record) {
+  Checkpoints *found = (Checkpoints *)arg;
+  if (record->op != WAL_OP_CHECKPOINT) {
+    return 0;
+  }
+
+  if (found->count == found->cap) {
+    size_t cap = found->cap > 0 ? found->cap * 2 : 8;
+    char **paths = realloc(found->paths, cap * sizeof(char *));
+    if (paths == NULL) {
+      return 1;
+    }
+    found->paths = paths;
+    uint64_t *lsns = realloc(found->lsns, cap * sizeof(uint64_t));
+    if (lsns == NULL) {
+      return 1;
+    }
+    found->lsns = lsns;
+    found->cap = cap;
+  }
+
+  found->paths[found->count] = strdup(record->path);
+  if (found->paths[found->count] == NULL) {
+    return 1;
+  }
+  found->lsns[found->count++] = record->snapshot_lsn;
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_recover(const char *wal_path, size_t num_threads) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  int fd = open(wal_path, O_RDONLY);
+  if (fd == -1) {
+    // Nothing was ever logged
+    return 0;
+  }
+
+  off_t end;
+  uint64_t last_lsn;
+  Checkpoints found = {NULL, NULL, 0, 0};
+  if (wal_scan(fd, collect_checkpoint, &found, &end, &last_lsn)) {
+    fprintf(stderr, "Failed to read WAL: %s\n", wal_path);
+    for (size_t i = 0; i < found.count; i++) {
+      free(found.paths[i]);
+    }
+    free(found.paths);
+    free(found.lsns);
+    close(fd);
+    return 1;
+  }
+
+  // The newest backup that is still there and whole is the starting point,
+  // unless the table was started on one
+  uint64_t snapshot_lsn = 0;
+  const char *snapshot = NULL;
+  if (warm_mapped) {
+    snapshot_lsn = warm_base.snap.lsn;
+    snapshot = warm_path;
+  }
+  for (size_t i = found.count; snapshot == NULL && i-- > 0;) {
+    if (snapshot_load(kvs_table, found.paths[i], num_threads) == 0) {
+      snapshot_lsn = found.lsns[i];
+      snapshot = found.paths[i];
+      break;
+    }
+  }
+
+  Replay replay = {snapshot_lsn, KVS_BATCH_INIT};
+  int result = wal_scan(fd, replay_record, &replay, &end, &last_lsn);
+  close(fd);
+  // A batch cut short by a crash never happened
+  undo_batch(&replay.batch);
+  undo_free(&replay.batch);
+  if (result) {
+    fprintf(stderr, "Failed to replay WAL: %s\n", wal_path);
+  } else if (snapshot != NULL) {
+    printf("Recovered from %s and WAL records %lu to %lu\n", snapshot,
+           (unsigned long)snapshot_lsn + 1, (unsigned long)last_lsn);
+  } else if (last_lsn > 0) {
+    printf("Recovered from WAL records 1 to %lu\n", (unsigned long)last_lsn);
+  }
+
+  for (size_t i = 0; i < found.count; i++) {
+    free(found.paths[i]);
+  }
+  free(found.paths);
+  free(found.lsns);
+  return result;
+}
+
+void kvs_set_binary_backups(int binary) { binary_backups = binary; }
+
+void kvs_set_compressed_backups(int compress) {
+  binary_backups |= compress;
+  compressed_backups = compress;
+}
+
+void kvs_set_delta_backups(size_t interval) {
+  binary_backups = 1;
+  full_interval = interval;
+}
+
+void kvs_set_backup_mode(int use_fork, size_t max_concurrent) {
+  fork_backups = use_fork;
+  max_backups = max_concurrent > 0 ? max_concurrent : 1;
+}
+
+void kvs_set_backup_threads(size_t num_threads) {
+  backup_threads = num_threads > 0 ? num_threads : 1;
+}
+
+void kvs_set_backup_rate(size_t rate) { backup_rate = rate; }
 
-  int aux = 0;
+void kvs_set_retention(size_t last, size_t hours) {
+  keep_last = last;
+  keep_hours = hours;
+}
+
+int kvs_terminate() {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // Snapshot threads read the table until they are done
+  backups_drain();
+  if (wal_close()) {
+    fprintf(stderr, "Failed to close WAL\n");
+  }
+  retention_stop();
+
+  if (warm_mapped) {
+    snapshot_unmap(&warm_base);
+    free_table(warm_deleted);
+    warm_deleted = NULL;
+    free(warm_path);
+    warm_path = NULL;
+    warm_mapped = 0;
+  }
+  free_table(kvs_table);
+  kvs_table = NULL;
+  return 0;
+}
+
+/// Writes pairs to the KVS. The table must be locked for writing.
+/// @param undo Batch saving the values replaced, NULL not to save them.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+static void write_pairs(KvsBatch *undo, size_t num_pairs,
+                        char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE]) {
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
-      if (!aux) {
-        write_str(fd, "[");
-        aux = 1;
+    // Compare if old value is different from new value
+    const char *value;
+    size_t value_len;
+    if (find_value(keys[i], &value, &value_len) == 0 &&
+        value_len == strnlen(values[i], MAX_STRING_SIZE) &&
+        memcmp(value, values[i], value_len) == 0) {
+      continue;
+    }
+
+    if (undo != NULL) {
+      undo_save(undo, keys[i]);
+    }
+    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
+      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    }
+
+    if (write_callback != NULL) {
+      write_callback(keys[i], values[i]);
+    }
+  }
+}
+
+/// Appends the values of keys to an output list. The table must be locked.
+/// @param num_pairs Number of keys to read.
+/// @param keys Array of keys' strings.
+/// @param out Buffer to write the output.
+static void read_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                      OutBuffer *out) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    const char *value;
+    size_t value_len;
+    if (find_value(keys[i], &value, &value_len) != 0) {
+      outbuf_pair(out, &PAIR_RESULT, keys[i], strnlen(keys[i], MAX_STRING_SIZE),
+                  "KVSERROR", 8);
+    } else {
+      outbuf_pair(out, &PAIR_RESULT, keys[i], strnlen(keys[i], MAX_STRING_SIZE),
+                  value, value_len);
+    }
+  }
+}
+
+/// Deletes keys from the KVS, listing the missing ones. The table must be
+/// locked for writing.
+/// @param batch Batch the keys belong to, it tracks the output list.
+/// @param save 1 to save the values deleted in the batch's undo list.
+/// @param num_pairs Number of keys to delete.
+/// @param keys Array of keys' strings.
+/// @param out Buffer to write the output.
+static void delete_keys(KvsBatch *batch, int save, size_t num_pairs,
+                        char keys[][MAX_STRING_SIZE], OutBuffer *out) {
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (save) {
+      undo_save(batch, keys[i]);
+    }
+    if (remove_pair(keys[i]) != 0) {
+      if (!batch->listed) {
+        outbuf_puts(out, "[");
+        batch->listed = 1;
       }
-      char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      outbuf_pair(out, &PAIR_RESULT, keys[i], strnlen(keys[i], MAX_STRING_SIZE),
+                  "KVSMISSING", 10);
     }
 
     if (delete_callback != NULL) {
       delete_callback(keys[i], NULL);
     }
   }
-  if (aux) {
-    write_str(fd, "]\n");
+}
+
+int kvs_batch_begin(KvsBatch *batch, enum Command cmd, OutBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  if (cmd == CMD_READ) {
+    pthread_rwlock_rdlock(&kvs_table->tablelock);
+    outbuf_puts(out, "[");
+    batch->listed = 1;
+  } else if (cmd == CMD_WRITE || cmd == CMD_DELETE) {
+    pthread_rwlock_wrlock(&kvs_table->tablelock);
+    batch->listed = 0;
+  } else {
+    return 1;
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  batch->cmd = cmd;
+  batch->lsn = 0;
+  return 0;
+}
+
+int kvs_batch_run(KvsBatch *batch, size_t num_pairs,
+                  char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                  int more, OutBuffer *out) {
+  if (batch->cmd == CMD_READ) {
+    read_keys(num_pairs, keys, out);
+    return 0;
+  } else if (batch->cmd != CMD_WRITE && batch->cmd != CMD_DELETE) {
+    return 1;
+  }
+
+  // Only a later chunk can fail the batch, the last one saves nothing
+  if (more && undo_reserve(batch, num_pairs)) {
+    return 1;
+  }
+
+  // Logged before it is applied, in the order of the table's write lock
+  if (wal_enabled() && num_pairs > 0) {
+    uint64_t lsn = wal_append(
+        batch->cmd == CMD_WRITE ? WAL_OP_WRITE : WAL_OP_DELETE, more,
+        num_pairs, keys, values);
+    if (lsn == 0) {
+      // Applied without a record, it would be lost on recovery
+      return 1;
+    }
+    batch->lsn = lsn;
+  }
+
+  if (batch->cmd == CMD_WRITE) {
+    write_pairs(more ? batch : NULL, num_pairs, keys, values);
+  } else {
+    delete_keys(batch, more, num_pairs, keys, out);
+  }
   return 0;
 }
 
-void kvs_show(int fd) {
+int kvs_batch_end(KvsBatch *batch, OutBuffer *out) {
+  if (batch->cmd == EOC) {
+    return 0;
+  }
+
+  if (batch->listed) {
+    outbuf_puts(out, "]\n");
+  }
+
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  batch->cmd = EOC;
+  batch->listed = 0;
+  undo_free(batch);
+
+  // Waiting for the disk without the lock lets other batches join the commit
+  int result = wal_commit(batch->lsn);
+  batch->lsn = 0;
+  return result;
+}
+
+void kvs_batch_cancel(KvsBatch *batch, OutBuffer *out) {
+  if (batch->cmd == EOC) {
+    return;
+  }
+
+  // Recovery drops the records of the batch when it finds the ABORT
+  undo_batch(batch);
+  if (batch->lsn != 0) {
+    wal_append_abort();
+    batch->lsn = 0;
+  }
+  kvs_batch_end(batch, out);
+}
+
+/// Executes a whole WRITE, READ or DELETE as a batch of a single chunk.
+/// @param cmd The command.
+/// @param num_pairs Number of pairs.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings, NULL for a READ or DELETE.
+/// @param out Buffer to write the output, NULL for a WRITE.
+/// @return 0 if successful, 1 otherwise.
+static int kvs_run(enum Command cmd, size_t num_pairs,
+                   char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], OutBuffer *out) {
+  KvsBatch batch = KVS_BATCH_INIT;
+  if (kvs_batch_begin(&batch, cmd, out)) {
+    return 1;
+  }
+
+  int result = kvs_batch_run(&batch, num_pairs, keys, values, 0, out);
+  return kvs_batch_end(&batch, out) || result;
+}
+
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+              char values[][MAX_STRING_SIZE]) {
+  return kvs_run(CMD_WRITE, num_pairs, keys, values, NULL);
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer *out) {
+  return kvs_run(CMD_READ, num_pairs, keys, NULL, out);
+}
+
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer *out) {
+  return kvs_run(CMD_DELETE, num_pairs, keys, NULL, out);
+}
+
+void kvs_show(OutBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
 
   pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
+
+  if (warm_mapped) {
+    if (warm_visit(show_pair, out)) {
+      fprintf(stderr, "Failed to read %s\n", warm_path);
+    }
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+    return;
+  }
 
   for (int i = 0; i < TABLE_SIZE; i++) {
     KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
     while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key,
-               keyNode->value);
-      write_str(fd, aux);
+      outbuf_pair(out, &PAIR_LINE, keyNode->key, keyNode->key_len,
+                  keyNode->value, keyNode->value_len);
       keyNode = keyNode->next; // Move to the next node of the list
     }
   }
@@ -169,43 +870,274 @@ void kvs_show(int fd) {
   pthread_rwlock_unlock(&kvs_table->tablelock);
 }
 
-int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
-  pid_t pid;
-  char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
-           strtok(job_filename, "."), num_backup);
+/// Writes a backup file. With a single thread it is async signal safe, so it
+/// also runs in backup children.
+/// @param ht The table, or a view of its captured chains, not modified
+/// meanwhile.
+/// @param path Path of the file.
+/// @param lsn Last WAL record included in the table.
+/// @param parent Parent of a delta backup, NULL for a full backup.
+/// @param durable 1 to sync the file before returning.
+/// @param num_threads Number of threads writing parts of the file.
+/// @return 0 if successful, 1 otherwise.
+static int write_backup(HashTable *ht, const char *path, uint64_t lsn,
+                        const char *parent, int durable, size_t num_threads) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    return 1;
+  }
+
+  if (num_threads > 1) {
+    int failed = binary_backups
+                     ? snapshot_write_parallel(fd, ht, lsn, parent,
+                                               compressed_backups, num_threads)
+                     : snapshot_write_text(fd, ht, num_threads);
+    if (!failed && durable) {
+      failed = fdatasync(fd) != 0;
+    }
+    close(fd);
+    return failed;
+  }
+
+  // The heap may be locked by another thread, so pairs are formatted in
+  // buffers on the stack, written through a private ring with -u
+  UringWriter writer;
+  uring_writer_init(&writer, fd, uring_active());
+  int failed = 0;
+  if (binary_backups) {
+    failed = snapshot_write(&writer, ht, lsn, parent, compressed_backups);
+  } else {
+    for (int i = 0; i < TABLE_SIZE; i++) {
+      KeyNode *keyNode = ht->table[i]; // Get the next list head
+      while (keyNode != NULL) {
+        size_t len =
+            pair_length(&PAIR_LINE, keyNode->key_len, keyNode->value_len);
+        char *dest = uring_writer_reserve(&writer, len);
+        if (dest != NULL) {
+          pair_format(dest, &PAIR_LINE, keyNode->key, keyNode->key_len,
+                      keyNode->value, keyNode->value_len);
+        }
+        keyNode = keyNode->next; // Move to the next node of the list
+      }
+    }
+  }
+
+  failed |= uring_writer_finish(&writer);
+  if (!failed && durable) {
+    failed = fdatasync(fd) != 0;
+  }
+  close(fd);
+  return failed;
+}
+
+/// Snapshot thread: writes a backup from the captured chains, then releases
+/// them.
+/// @param arg The BackupTask.
+/// @return NULL
+static void *snapshot_thread(void *arg) {
+  BackupTask *task = (BackupTask *)arg;
+  const char *path = task->checkpoint != 0 ? task->tmp_name : task->name;
+  const char *parent = task->parent[0] != '\0' ? task->parent : NULL;
+
+  if (write_backup(&task->view, path, task->lsn, parent,
+                   task->checkpoint != 0, backup_threads) == 0 &&
+      task->checkpoint != 0) {
+    rename(task->tmp_name, task->name);
+  }
+
+  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  thaw_table(kvs_table, task->chains);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  free(task);
+
+  backups_release();
+  return NULL;
+}
+
+/// Drops a captured backup that will not be written. The deltas after it
+/// miss their parent, so the next backup is a full one.
+/// @param task The BackupTask, freed.
+static void drop_backup(BackupTask *task) {
+  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  thaw_table(kvs_table, task->chains);
+  pthread_mutex_lock(&backup_lock);
+  chain_len = 0;
+  pthread_mutex_unlock(&backup_lock);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  free(task);
+}
+
+/// Starts the snapshot thread of a backup that has a slot.
+/// @param arg The BackupTask, freed by the thread.
+static void start_snapshot(void *arg) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, snapshot_thread, arg) != 0) {
+    fprintf(stderr, "Failed to start a snapshot thread\n");
+    drop_backup((BackupTask *)arg);
+    backups_release();
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/// Chooses the parent of the next backup. Called with backup_lock held.
+/// @param parent Set to the parent's name, "" for a full backup.
+/// @return parent, NULL for a full backup.
+static const char *choose_parent(char *parent) {
+  int delta = full_interval > 1 && chain_len > 0 && chain_len < full_interval;
+  strcpy(parent, delta ? backup_chain[chain_len - 1] : "");
+  return delta ? parent : NULL;
+}
+
+/// Records a backup as taken, once it has its copy of the dirty buckets, so
+/// the next delta holds the buckets changed from now on. Called with the
+/// table locked for reading and backup_lock held.
+/// @param bck_name Name of the backup.
+/// @param delta 1 if the backup is a delta.
+static void backup_taken(const char *bck_name, int delta) {
+  if (full_interval > 1) {
+    memset(kvs_table->dirty, 0, sizeof(kvs_table->dirty));
+    chain_len = delta ? chain_len : 0;
+    strcpy(backup_chain[chain_len++], bck_name);
+  }
+}
+
+/// Takes a backup in a child process, which writes its copy of the table.
+/// When every slot is in use the child is forked anyway, capturing the
+/// table, and waits for a slot before writing.
+/// @return 0 if successful, -1 otherwise.
+static int fork_backup(const char *bck_name, const char *tmp_name) {
+  uint64_t checkpoint = 0;
+  uint64_t lsn = 0;
+  char parent_name[sizeof(backup_chain[0])];
+
+  int go[2] = {-1, -1};
+  int slot = backups_try_acquire();
+  if (!slot && socketpair(AF_UNIX, SOCK_STREAM, 0, go) == -1) {
+    return -1;
+  }
+  pid_t server = getpid();
 
   pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
+  pthread_mutex_lock(&backup_lock);
+  const char *parent = choose_parent(parent_name);
+  if (wal_enabled()) {
+    unlink(bck_name);
+    lsn = wal_last_lsn();
+    checkpoint = wal_append_checkpoint(lsn, bck_name);
+  }
+  pid_t pid = fork();
+  if (pid > 0) {
+    backup_taken(bck_name, parent != NULL);
+  }
+  pthread_mutex_unlock(&backup_lock);
   pthread_rwlock_unlock(&kvs_table->tablelock);
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->key,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ", ",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, keyNode->value,
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied, ")\n",
-                                        MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
+    if (!slot) {
+      close(go[1]);
+      if (backups_wait_slot(go[0], server)) {
+        _exit(1);
       }
     }
+    // Starting threads is not async signal safe, a child writes alone
+    if (write_backup(kvs_table, checkpoint != 0 ? tmp_name : bck_name, lsn,
+                     parent, checkpoint != 0, 1) == 0 &&
+        checkpoint != 0) {
+      rename(tmp_name, bck_name);
+    }
     _exit(1);
-  } else if (pid < 0) {
+  }
+
+  if (!slot) {
+    close(go[0]);
+  }
+  if (pid < 0) {
+    if (slot) {
+      backups_release();
+    } else {
+      close(go[1]);
+    }
+    return -1;
+  }
+
+  backups_track_child(pid, go[1]);
+  if (wal_commit(checkpoint)) {
+    fprintf(stderr, "Failed to log backup\n");
+  }
+  return 0;
+}
+
+int kvs_backup(size_t num_backup, char *job_filename, char *directory) {
+  char bck_name[50];
+  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory,
+           strtok(job_filename, "."), num_backup);
+
+  // With a WAL the backup is written aside and renamed once complete, so a
+  // backup under its name always matches the checkpoint pointing to it
+  char tmp_name[sizeof(bck_name) + 4];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", bck_name);
+
+  // Backups are written from the table, which takes in the warm start backup
+  if (warm_merge()) {
+    return -1;
+  }
+
+  if (fork_backups) {
+    int result = fork_backup(bck_name, tmp_name);
+    if (result == 0) {
+      retention_request(directory);
+    }
+    return result;
+  }
+
+  BackupTask *task = malloc(sizeof(BackupTask));
+  if (task == NULL) {
+    return -1;
+  }
+  strcpy(task->name, bck_name);
+  strcpy(task->tmp_name, tmp_name);
+  task->lsn = 0;
+  task->checkpoint = 0;
+
+  // Writers copy a captured bucket before changing it, so the thread reads
+  // the table as it is now without holding its lock
+  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  pthread_mutex_lock(&backup_lock);
+  int failed = freeze_table(kvs_table, task->chains);
+  if (!failed) {
+    for (int i = 0; i < TABLE_SIZE; i++) {
+      task->view.table[i] = task->chains[i]->head;
+    }
+    memcpy(task->view.dirty, kvs_table->dirty, sizeof(task->view.dirty));
+    int delta = choose_parent(task->parent) != NULL;
+    if (wal_enabled()) {
+      unlink(bck_name);
+      task->lsn = wal_last_lsn();
+      task->checkpoint = wal_append_checkpoint(task->lsn, bck_name);
+    }
+    backup_taken(bck_name, delta);
+  }
+  pthread_mutex_unlock(&backup_lock);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+
+  if (failed) {
+    free(task);
     return -1;
   }
+
+  // The backup is written once it has a slot, the thread frees the task
+  uint64_t checkpoint = task->checkpoint;
+  if (backups_enqueue(start_snapshot, task)) {
+    drop_backup(task);
+    return -1;
+  }
+
+  if (wal_commit(checkpoint)) {
+    fprintf(stderr, "Failed to log backup\n");
+  }
+  retention_request(directory);
   return 0;
 }
 
@@ -237,9 +1169,9 @@ int kvs_key_exists(const char *key) {
 
   // Lock the table for reading and check if the key exists
   pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char *result = read_pair(kvs_table, key);
-  int exists = (result == NULL);
-  free(result);
+  const char *value;
+  size_t value_len;
+  int exists = find_value(key, &value, &value_len);
   pthread_rwlock_unlock(&kvs_table->tablelock);
   return exists;
 }
\ No newline at end of file
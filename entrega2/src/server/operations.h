@@ -2,18 +2,99 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "constants.h"
+#include "io.h"
+#include "parser.h"
 
 // Callback function type for key value pairs.
 // @param key Key of the pair.
 // @param value Value of the pair.
 typedef void (*kvs_callback_t)(const char* key, const char* value);
 
+/// A WRITE, READ or DELETE executed in chunks, for batches longer than
+/// MAX_WRITE_SIZE pairs. The table stays locked from kvs_batch_begin to
+/// kvs_batch_end, so the batch is atomic and its output is a single list.
+/// The values its chunks replace are kept until it ends, so a batch cut
+/// short by kvs_batch_cancel leaves the table as it found it.
+typedef struct KvsBatch {
+  enum Command cmd;     // Command of the batch, EOC when none is in progress
+  int listed;           // 1 once the output list was opened
+  uint64_t lsn;         // Last WAL record of the batch, 0 if none
+  struct KvsUndo *undo; // Previous values of the keys changed so far
+  size_t num_undo;
+  size_t undo_cap;
+} KvsBatch;
+
+#define KVS_BATCH_INIT {EOC, 0, 0, NULL, 0, 0}
+
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Starts the KVS on top of a full, uncompressed binary backup instead of
+/// loading it (see snapshot_map). Its pairs are read in place from the
+/// mapping, so starting takes the same time whatever its size and restarts
+/// share the page cache. The table overlays the backup with the pairs
+/// written since, deleted keys are hidden, and both are merged into the
+/// table when the next backup is taken. Called after kvs_init, before the
+/// KVS is shared.
+/// @param path Path of the backup.
+/// @return 0 if successful, 1 otherwise.
+int kvs_warm_start(const char *path);
+
+/// Rebuilds the KVS state after a restart: loads the newest backup named by
+/// a checkpoint of the WAL that is still whole, then replays the WAL
+/// records written after it. After kvs_warm_start, the records written
+/// after that backup are replayed instead. Called before the KVS is shared.
+/// @param wal_path Path of the WAL, which may not exist yet.
+/// @param num_threads Number of threads to load the backup with.
+/// @return 0 if successful, 1 otherwise.
+int kvs_recover(const char *wal_path, size_t num_threads);
+
+/// Chooses the format of the backups written from now on.
+/// @param binary 1 for binary, checksummed backups (see snapshot.h), 0 for
+/// text ones.
+void kvs_set_binary_backups(int binary);
+
+/// Makes the backups taken from now on binary, with their blocks compressed
+/// (see SNAPSHOT_FLAG_LZ).
+/// @param compress 1 to compress, 0 not to.
+void kvs_set_compressed_backups(int compress);
+
+/// Chooses how backups are written.
+/// @param use_fork 1 to write each backup in a child process, 0 for a
+/// snapshot thread that reads the captured table (see freeze_table).
+/// @param max_concurrent Backups written at once, further ones are queued
+/// (see backups.h). Called before kvs_init.
+void kvs_set_backup_mode(int use_fork, size_t max_concurrent);
+
+/// Chooses how many threads write each backup taken by a snapshot thread,
+/// each a part of the file. Backups of child processes are written by one.
+/// @param num_threads Number of writer threads.
+void kvs_set_backup_threads(size_t num_threads);
+
+/// Bounds the rate backups are written at, slowing them further while job
+/// output is slow to write (see throttle.h). Called before kvs_init.
+/// @param rate Most bytes written per second, 0 for no limit.
+void kvs_set_backup_rate(size_t rate);
+
+/// Removes the backups of each job left out by a retention policy after
+/// every backup, besides those the next delta is based on (see
+/// retention.h). Called before kvs_init.
+/// @param last Newest backups kept per job, 0 for no limit unless hours is
+/// set.
+/// @param hours Hours for which the newest backup of each is kept, 0 for
+/// none.
+void kvs_set_retention(size_t last, size_t hours);
+
+/// Makes the backups taken from now on binary and incremental: a full backup
+/// every interval backups, and in between deltas holding only the buckets
+/// changed since the previous backup.
+/// @param interval Number of backups per full one, 1 for full ones only.
+void kvs_set_delta_backups(size_t interval);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
@@ -29,23 +110,59 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Buffer to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
+/// @param out Buffer to write the output.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutBuffer *out);
+
+/// Starts a batch, locking the table.
+/// @param batch Batch to start, not in progress.
+/// @param cmd CMD_WRITE, CMD_READ or CMD_DELETE.
+/// @param out Buffer to write the output.
+/// @return 0 if the batch was started, 1 otherwise.
+int kvs_batch_begin(KvsBatch *batch, enum Command cmd, OutBuffer *out);
+
+/// Executes a chunk of a batch. A chunk that fails changes nothing.
+/// @param batch Batch in progress.
+/// @param num_pairs Number of pairs (or keys) of the chunk.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings, only used by a WRITE.
+/// @param more 1 if more chunks follow this one.
+/// @param out Buffer to write the output.
+/// @return 0 if the chunk was executed, 1 otherwise.
+int kvs_batch_run(KvsBatch *batch, size_t num_pairs,
+                  char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                  int more, OutBuffer *out);
+
+/// Ends a batch, closing its output list and unlocking the table, then
+/// commits its WAL records. Does nothing if no batch is in progress.
+/// @param batch Batch to end.
+/// @param out Buffer to write the output.
+/// @return 0 if successful, 1 if its WAL records could not be written.
+int kvs_batch_end(KvsBatch *batch, OutBuffer *out);
+
+/// Ends a batch whose last chunk failed or never came, undoing the chunks
+/// already executed and discarding their WAL records. Its output so far is
+/// kept, and the list closed. Does nothing if no batch is in progress.
+/// @param batch Batch to cancel.
+/// @param out Buffer to write the output.
+void kvs_batch_cancel(KvsBatch *batch, OutBuffer *out);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fd);
+/// @param out Buffer to write the output.
+void kvs_show(OutBuffer *out);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
+/// backup file. The file is written by a snapshot thread, or by a child
+/// process with kvs_set_backup_mode, once this returns; never waits for
+/// other backups, the state is captured and the backup queued if needed.
+/// @return 0 if the backup was taken, -1 otherwise.
 int kvs_backup(size_t num_backup, char *job_filename, char *directory);
 
 /// Waits for the last backup to be called.
@@ -1,6 +1,9 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,45 +11,225 @@
 #include "constants.h"
 #include "io.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define PARSER_BUFFER_SIZE 65536 // Bytes read from a job file at a time.
+
+/// Buffered input of a job file. Job files are read in large chunks and
+/// tokenized from memory instead of with one read() per character.
+typedef struct Reader {
+  char data[PARSER_BUFFER_SIZE];
+  size_t pos;         // Next byte to consume
+  size_t len;         // Bytes in data
+  enum Command batch; // Batch cut after MAX_WRITE_SIZE pairs, EOC if none
+} Reader;
+
+/// Readers indexed by file descriptor. Each entry is only used by the thread
+/// parsing that file descriptor.
+static Reader **readers = NULL;
+static long max_readers = 0;
+static pthread_once_t readers_once = PTHREAD_ONCE_INIT;
+
+/// Allocates the reader table, one entry per possible file descriptor.
+static void readers_init() {
+  long open_max = sysconf(_SC_OPEN_MAX);
+  if (open_max <= 0) {
+    open_max = 1024;
+  }
+
+  readers = calloc((size_t)open_max, sizeof(Reader *));
+  if (readers != NULL) {
+    max_readers = open_max;
+  }
+}
+
+// Gets the reader of a file descriptor, creating it on first use.
+// @param fd File descriptor.
+// @return The reader, NULL on failure.
+static Reader *get_reader(int fd) {
+  pthread_once(&readers_once, readers_init);
+  if (fd < 0 || fd >= max_readers) {
+    return NULL;
+  }
+
+  if (readers[fd] == NULL) {
+    readers[fd] = malloc(sizeof(Reader));
+    if (readers[fd] == NULL) {
+      return NULL;
+    }
+    readers[fd]->pos = 0;
+    readers[fd]->len = 0;
+    readers[fd]->batch = EOC;
+  }
+
+  return readers[fd];
+}
+
+// Makes sure the reader has bytes to consume, reading the next chunk of the
+// file if the buffered ones were all consumed.
+// @param fd File descriptor.
+// @param reader Reader of the file descriptor.
+// @return Number of bytes available, 0 on end of file, -1 on error.
+static ssize_t fill(int fd, Reader *reader) {
+  if (reader->pos < reader->len) {
+    return (ssize_t)(reader->len - reader->pos);
+  }
+
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(fd, reader->data, PARSER_BUFFER_SIZE);
+  } while (bytes_read == -1 && errno == EINTR);
+
+  reader->pos = 0;
+  reader->len = bytes_read > 0 ? (size_t)bytes_read : 0;
+  return bytes_read;
+}
+
+// Reads up to n bytes through the file descriptor's reader.
+// @param fd File descriptor.
+// @param buf Buffer to store the bytes in.
+// @param n Number of bytes to read.
+// @return Number of bytes read, fewer than n only at the end of the file, or
+// -1 on error.
+static ssize_t buffered_read(int fd, char *buf, size_t n) {
+  Reader *reader = get_reader(fd);
+  if (reader == NULL) {
+    return -1;
+  }
+
+  size_t done = 0;
+  while (done < n) {
+    ssize_t available = fill(fd, reader);
+    if (available <= 0) {
+      return done > 0 ? (ssize_t)done : available;
+    }
+
+    size_t chunk = n - done < (size_t)available ? n - done : (size_t)available;
+    memcpy(buf + done, reader->data + reader->pos, chunk);
+    reader->pos += chunk;
+    done += chunk;
+  }
+
+  return (ssize_t)done;
+}
+
+// Checks if a character ends a string of a command.
+// @param ch Character to check.
+// @return 1 if the character is a delimiter, 0 otherwise.
+static int is_delimiter(char ch) {
+  return ch == ' ' || ch == ',' || ch == ')' || ch == ']';
+}
+
+#if defined(__AVX2__)
+// Classifies 32 bytes at once.
+// @param data Bytes to classify.
+// @return Bit mask of the bytes that are delimiters.
+static unsigned int delimiter_mask(const char *data) {
+  __m256i v = _mm256_loadu_si256((const __m256i *)data);
+  __m256i m = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']'))));
+  return (unsigned int)_mm256_movemask_epi8(m);
+}
+#elif defined(__SSE2__)
+// Classifies 16 bytes at once.
+// @param data Bytes to classify.
+// @return Bit mask of the bytes that are delimiters.
+static unsigned int delimiter_mask16(const char *data) {
+  __m128i v = _mm_loadu_si128((const __m128i *)data);
+  __m128i m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8(','))),
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(')')),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))));
+  return (unsigned int)_mm_movemask_epi8(m);
+}
+
+// Classifies 32 bytes at once.
+// @param data Bytes to classify.
+// @return Bit mask of the bytes that are delimiters.
+static unsigned int delimiter_mask(const char *data) {
+  return delimiter_mask16(data) | (delimiter_mask16(data + 16) << 16);
+}
+#endif
+
+// Finds the first delimiter in a span of bytes, 32 bytes per step when SSE2
+// or AVX2 are available.
+// @param data Bytes to scan.
+// @param n Number of bytes to scan.
+// @return Offset of the first delimiter, n if there is none.
+static size_t scan_delimiter(const char *data, size_t n) {
+  size_t k = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+  for (; k + 32 <= n; k += 32) {
+    unsigned int mask = delimiter_mask(data + k);
+    if (mask != 0) {
+      return k + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+
+  while (k < n && !is_delimiter(data[k])) {
+    k++;
+  }
+
+  return k;
+}
+
 // Reads a string and indicates the position from where it was
 // extracted, based on the KVS specification.
 // @param fd File to read from.
 // @param buffer To write the string in.
 // @param max Maximum string size.
 static int read_string(int fd, char *buffer, size_t max) {
-  ssize_t bytes_read;
-  char ch;
-  size_t i = 0;
-  int value = -1;
+  Reader *reader = get_reader(fd);
+  if (reader == NULL) {
+    return -1;
+  }
 
+  size_t i = 0;
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
-
-    if (bytes_read <= 0) {
+    if (fill(fd, reader) <= 0) {
       return -1;
     }
 
-    if (ch == ' ') {
-      return -1;
+    // Scan the buffered bytes for the end of the string
+    const char *data = reader->data + reader->pos;
+    size_t n = reader->len - reader->pos;
+    if (n > max - i) {
+      n = max - i;
     }
 
-    if (ch == ',') {
-      value = 0;
-      break;
-    } else if (ch == ')') {
-      value = 1;
-      break;
-    } else if (ch == ']') {
-      value = 2;
-      break;
+    size_t k = scan_delimiter(data, n);
+    memcpy(buffer + i, data, k);
+    i += k;
+    reader->pos += k;
+
+    if (k < n) {
+      reader->pos++; // Consume the delimiter
+      buffer[i] = '\0';
+
+      switch (data[k]) {
+      case ',':
+        return 0;
+      case ')':
+        return 1;
+      case ']':
+        return 2;
+      default:
+        return -1;
+      }
     }
-
-    buffer[i++] = ch;
   }
 
-  buffer[i] = '\0';
-
-  return value;
+  return -1;
 }
 
 // Reads a number and stores it in an unsigned integer
@@ -59,7 +242,7 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (buffered_read(fd, buf + i, 1) == 0) {
       *next = '\0';
       break;
     }
@@ -88,21 +271,51 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 // Jumps file descriptor to next line.
 // @param fd File descriptor.
 static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+  Reader *reader = get_reader(fd);
+  if (reader == NULL) {
+    return;
+  }
+
+  while (fill(fd, reader) > 0) {
+    const char *data = reader->data + reader->pos;
+    const char *newline = memchr(data, '\n', reader->len - reader->pos);
+    if (newline != NULL) {
+      reader->pos += (size_t)(newline - data) + 1;
+      return;
+    }
+    reader->pos = reader->len;
+  }
+}
+
+int parser_open(int fd) {
+  if (get_reader(fd) == NULL) {
+    // Past the table, sized from the descriptor limit at first use
+    fprintf(stderr, "No reader for file descriptor %d (limit %ld)\n", fd,
+            max_readers);
+    return 1;
+  }
+  return 0;
+}
+
+void parser_close(int fd) {
+  pthread_once(&readers_once, readers_init);
+  if (fd >= 0 && fd < max_readers) {
+    free(readers[fd]);
+    readers[fd] = NULL;
+  }
 }
 
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (buffered_read(fd, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
   case 'W':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-      if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+    if (buffered_read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+      if (buffered_read(fd, buf + 5, 1) != 1 ||
+          strncmp(buf, "WRITE ", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -112,7 +325,7 @@ enum Command get_next(int fd) {
     return CMD_WAIT;
 
   case 'R':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+    if (buffered_read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -120,7 +333,7 @@ enum Command get_next(int fd) {
     return CMD_READ;
 
   case 'D':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+    if (buffered_read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -128,12 +341,12 @@ enum Command get_next(int fd) {
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+    if (buffered_read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+    if (buffered_read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -141,12 +354,12 @@ enum Command get_next(int fd) {
     return CMD_SHOW;
 
   case 'B':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+    if (buffered_read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
+    if (buffered_read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -154,12 +367,12 @@ enum Command get_next(int fd) {
     return CMD_BACKUP;
 
   case 'H':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+    if (buffered_read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+    if (buffered_read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -183,14 +396,15 @@ enum Command get_next(int fd) {
 // @param fd File decriptor to read from.
 // @param key Pointer where the key will be stored
 // @param value Pointer where the value will be stored
+// @param max Maximum string size.
 // @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
+int parse_pair(int fd, char *key, char *value, size_t max) {
+  if (read_string(fd, key, max) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
+  if (read_string(fd, value, max) != 1) {
     cleanup(fd);
     return 0;
   }
@@ -200,32 +414,38 @@ int parse_pair(int fd, char *key, char *value) {
 
 size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
                    char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size) {
+                   size_t max_string_size, int *more) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
-    return 0;
+  // A resumed list goes on right after the '(' of its next pair
+  if (more == NULL || !*more) {
+    if (buffered_read(fd, &ch, 1) != 1 || ch != '[') {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (buffered_read(fd, &ch, 1) != 1 || ch != '(') {
+      cleanup(fd);
+      return 0;
+    }
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
-    return 0;
+  if (more != NULL) {
+    *more = 0;
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
   while (num_pairs < max_pairs) {
-    if (parse_pair(fd, key, value) == 0) {
+    // The spans are copied straight into the batch arrays
+    char *key = keys[num_pairs];
+    char *value = values[num_pairs];
+    if (parse_pair(fd, key, value, max_string_size) == 0) {
       cleanup(fd);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+    if (buffered_read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -233,14 +453,19 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
     if (ch == ']') {
       break;
     }
+
+    if (num_pairs == max_pairs && more != NULL) {
+      *more = 1;
+      return num_pairs;
+    }
   }
 
-  if (num_pairs == max_pairs) {
+  if (num_pairs == max_pairs && more == NULL) {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (buffered_read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -249,36 +474,46 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
 }
 
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size) {
+                         size_t max_string_size, int *more) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
-    return 0;
+  // A resumed list goes on right after the ',' of its next key
+  if (more == NULL || !*more) {
+    if (buffered_read(fd, &ch, 1) != 1 || ch != '[') {
+      cleanup(fd);
+      return 0;
+    }
+  }
+
+  if (more != NULL) {
+    *more = 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(fd, keys[num_keys], max_string_size);
     if (output < 0 || output == 1) {
       cleanup(fd);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2) {
       break;
     }
+
+    if (num_keys == max_keys && more != NULL) {
+      *more = 1;
+      return num_keys;
+    }
   }
 
-  if (num_keys == max_keys) {
+  if (num_keys == max_keys && more == NULL) {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (buffered_read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -313,3 +548,54 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
     return -1;
   }
 }
+
+enum Command parse_command(int fd, JobCmd *cmd) {
+  cmd->num_pairs = 0;
+
+  // The rest of a batch cut after MAX_WRITE_SIZE pairs comes first
+  Reader *reader = get_reader(fd);
+  cmd->more = reader != NULL && reader->batch != EOC;
+  cmd->cmd = cmd->more ? reader->batch : get_next(fd);
+  int resumed = cmd->more;
+
+  switch (cmd->cmd) {
+  case CMD_WRITE:
+    cmd->num_pairs = parse_write(fd, cmd->keys, cmd->values, MAX_WRITE_SIZE,
+                                 MAX_STRING_SIZE, &cmd->more);
+    break;
+
+  case CMD_READ:
+  case CMD_DELETE:
+    cmd->num_pairs = parse_read_delete(fd, cmd->keys, MAX_WRITE_SIZE,
+                                       MAX_STRING_SIZE, &cmd->more);
+    break;
+
+  case CMD_WAIT:
+    if (parse_wait(fd, &cmd->delay, NULL) == -1) {
+      cmd->cmd = CMD_INVALID;
+    }
+    break;
+
+  case CMD_SHOW:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+
+  if (reader != NULL) {
+    reader->batch = cmd->more ? cmd->cmd : EOC;
+  }
+
+  // A malformed chunk of a started batch keeps its command, with no pairs,
+  // so the executor cancels the batch it holds the lock for
+  if ((cmd->cmd == CMD_WRITE || cmd->cmd == CMD_READ ||
+       cmd->cmd == CMD_DELETE) &&
+      cmd->num_pairs == 0 && !resumed) {
+    cmd->cmd = CMD_INVALID;
+  }
+
+  return cmd->cmd;
+}
@@ -18,6 +18,16 @@ enum Command {
   EOC // End of commands
 };
 
+/// A command decoded from a job file, ready to be executed.
+typedef struct JobCmd {
+  enum Command cmd;                // Command code
+  size_t num_pairs;                // Number of keys (and values) parsed
+  unsigned int delay;              // Delay of a WAIT command
+  char (*keys)[MAX_STRING_SIZE];   // Keys of a WRITE, READ or DELETE
+  char (*values)[MAX_STRING_SIZE]; // Values of a WRITE
+  int more; // 1 if the batch goes on in the next command decoded
+} JobCmd;
+
 // Parses input from the given file descriptor, according to
 // KVS specification.
 // @param fd File descriptor of input.
@@ -30,21 +40,25 @@ enum Command get_next(int fd);
 /// @param values Array to store the values
 /// @param max_pairs Maximum number of pairs it will write.
 /// @param max_string_size Maximum string size allowed.
+/// @param more NULL to reject a list of max_pairs pairs or more. Otherwise
+/// set to 1 when the list goes on after max_pairs pairs, and passed back set
+/// to 1 to parse the rest of that list.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
 size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
                    char values[][MAX_STRING_SIZE], size_t max_pairs,
-                   size_t max_string_size);
+                   size_t max_string_size, int *more);
 
 // Parses a READ or a DELETE command.
 // @param fd File descriptor to read from.
 // @param keys Array to store the keys
 // @param max_pairs Maximum number of pairs it will write.
 // @param max_string_size Maximum string size allowed.
+// @param more Same as for parse_write.
 // @return 0 if the command was not parsed successfully, otherwise return the
 //          of keys parsed
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
-                         size_t max_string_size);
+                         size_t max_string_size, int *more);
 
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
@@ -55,4 +69,30 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 /// error.
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
 
+/// Sets up the buffered input of a job file. Called before it is parsed, so
+/// a file that cannot be read fails instead of reading as empty.
+/// @param fd File descriptor of the job file.
+/// @return 0 if successful, 1 otherwise.
+int parser_open(int fd);
+
+/// Releases the buffered input of a job file. Must be called before the file
+/// descriptor is closed.
+/// @param fd File descriptor of the job file.
+void parser_close(int fd);
+
+/// Parses the next command and its arguments into a JobCmd. The keys and
+/// values arrays of the command must hold MAX_WRITE_SIZE strings. A longer
+/// WRITE, READ or DELETE is returned in chunks of MAX_WRITE_SIZE pairs with
+/// more set, each followed by the next chunk of the same command (or EOC).
+/// A malformed chunk after the first one comes with no pairs.
+/// @param fd File descriptor to read from.
+/// @param cmd Command to fill.
+/// @return The command code, CMD_INVALID if the command or its arguments are
+/// malformed.
+enum Command parse_command(int fd, JobCmd *cmd);
+
+/// Source of the commands of a job: parse_command for .job files, jobbin_next
+/// for .jobbin files.
+typedef enum Command (*cmd_reader_t)(int fd, JobCmd *cmd);
+
 #endif // KVS_PARSER_H
@@ -0,0 +1,102 @@
+#include "pool.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Worker loop: runs queued tasks until the pool is stopped.
+/// @param arg The pool the worker belongs to.
+/// @return NULL
+static void *pool_worker(void *arg) {
+  ThreadPool *pool = (ThreadPool *)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (pool->head == NULL && !pool->stop) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+
+    Task *task = pool->head;
+    if (task == NULL) {
+      break;
+    }
+    pool->head = task->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    task->fn(task->arg);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+int pool_init(ThreadPool *pool, size_t num_threads) {
+  pool->threads = malloc(num_threads * sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    fprintf(stderr, "Failed to allocate memory for pool threads\n");
+    return 1;
+  }
+
+  pool->num_threads = 0;
+  pool->head = NULL;
+  pool->tail = NULL;
+  pool->stop = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  for (size_t i = 0; i < num_threads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+      fprintf(stderr, "Failed to create pool thread %zu\n", i);
+      pool_destroy(pool);
+      return 1;
+    }
+    pool->num_threads++;
+  }
+
+  return 0;
+}
+
+void pool_submit(ThreadPool *pool, Task *task) {
+  task->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail == NULL) {
+    pool->head = task;
+  } else {
+    pool->tail->next = task;
+  }
+  pool->tail = task;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    if (pthread_join(pool->threads[i], NULL) != 0) {
+      fprintf(stderr, "Failed to join pool thread %zu\n", i);
+    }
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->num_threads = 0;
+}
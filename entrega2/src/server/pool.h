@@ -0,0 +1,41 @@
+#ifndef KVS_POOL_H
+#define KVS_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/// A unit of work submitted to a thread pool. Tasks are owned by the caller,
+/// which must keep them alive until they have run.
+typedef struct Task {
+  void (*fn)(void *arg); // Function to run
+  void *arg;             // Argument passed to fn
+  struct Task *next;     // Next task in the queue
+} Task;
+
+/// Fixed-size pool of worker threads fed by a FIFO task queue.
+typedef struct ThreadPool {
+  pthread_t *threads;  // Worker threads
+  size_t num_threads;  // Number of worker threads
+  Task *head;          // First queued task
+  Task *tail;          // Last queued task
+  int stop;            // 1 once the pool is shutting down
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ThreadPool;
+
+/// Starts a pool of worker threads.
+/// @param pool The pool to initialize.
+/// @param num_threads Number of worker threads to start.
+/// @return 0 if successful, 1 otherwise.
+int pool_init(ThreadPool *pool, size_t num_threads);
+
+/// Queues a task to be run by one of the pool's workers.
+/// @param pool The pool to submit to.
+/// @param task The task to run.
+void pool_submit(ThreadPool *pool, Task *task);
+
+/// Runs the remaining tasks, stops the workers and frees the pool resources.
+/// @param pool The pool to destroy.
+void pool_destroy(ThreadPool *pool);
+
+#endif // KVS_POOL_H
@@ -0,0 +1,366 @@
+#include "retention.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backups.h"
+#include "snapshot.h"
+
+/// A backup found in the directory.
+typedef struct RetainedBackup {
+  char *path;        // <directory>/<job>-<n>.bck
+  size_t job_len;    // Length of path up to the '-' before n
+  unsigned long num; // n
+  struct timespec mtime;
+  int pinned;        // 1 if in the chain of the next delta
+  int keep;          // 1 if the backup stays
+} RetainedBackup;
+
+/// The backups of a directory, listed by scan_backups.
+typedef struct RetentionScan {
+  const char *directory;
+  RetainedBackup *backups; // Sorted by backup_cmp
+  size_t count;
+} RetentionScan;
+
+static pthread_mutex_t retention_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retention_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t retention_thread;
+static int running = 0;         // 1 while the thread runs
+static int stopping = 0;        // 1 once retention_stop was called
+static char *pending = NULL;    // Directory to go over, NULL if none
+static size_t max_last = 1;
+static size_t max_hours = 0;
+static retention_pin_t pin_backup = NULL;
+
+/// Parses the name of a backup, <job>-<n>.bck.
+/// @param name Name of the file.
+/// @param job_len Set to the length of <job>.
+/// @param num Set to n.
+/// @return 1 if the name is a backup's, 0 otherwise.
+static int parse_backup_name(const char *name, size_t *job_len,
+                             unsigned long *num) {
+  size_t len = strlen(name);
+  if (len < 6 || strcmp(name + len - 4, ".bck") != 0) {
+    return 0;
+  }
+
+  size_t digits = len - 4;
+  while (digits > 0 && name[digits - 1] >= '0' && name[digits - 1] <= '9') {
+    digits--;
+  }
+  if (digits == len - 4 || digits < 2 || name[digits - 1] != '-') {
+    return 0;
+  }
+  *job_len = digits - 1;
+  *num = strtoul(name + digits, NULL, 10);
+  return 1;
+}
+
+/// Tells whether two backups are of the same job.
+static int same_job(const RetainedBackup *a, const RetainedBackup *b) {
+  return a->job_len == b->job_len && memcmp(a->path, b->path, a->job_len) == 0;
+}
+
+/// Orders backups by job, newest first within each.
+static int backup_cmp(const void *a, const void *b) {
+  const RetainedBackup *x = (const RetainedBackup *)a;
+  const RetainedBackup *y = (const RetainedBackup *)b;
+  size_t len = x->job_len < y->job_len ? x->job_len : y->job_len;
+  int cmp = memcmp(x->path, y->path, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  if (x->job_len != y->job_len) {
+    return x->job_len < y->job_len ? -1 : 1;
+  }
+  return (x->num < y->num) - (x->num > y->num);
+}
+
+/// Lists the backups of a directory.
+/// @param directory The directory.
+/// @param count Set to the number of backups.
+/// @return The backups, sorted by backup_cmp, NULL if there are none or on
+/// failure.
+static RetainedBackup *list_backups(const char *directory, size_t *count) {
+  *count = 0;
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  RetainedBackup *backups = NULL;
+  size_t cap = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t job_len;
+    unsigned long num;
+    if (!parse_backup_name(entry->d_name, &job_len, &num)) {
+      continue;
+    }
+
+    if (*count == cap) {
+      cap = cap > 0 ? cap * 2 : 16;
+      RetainedBackup *grown = realloc(backups, cap * sizeof(RetainedBackup));
+      if (grown == NULL) {
+        break;
+      }
+      backups = grown;
+    }
+    size_t len = strlen(directory) + 1 + strlen(entry->d_name) + 1;
+    RetainedBackup *backup = &backups[*count];
+    backup->path = malloc(len);
+    if (backup->path == NULL) {
+      break;
+    }
+    snprintf(backup->path, len, "%s/%s", directory, entry->d_name);
+    backup->job_len = strlen(directory) + 1 + job_len;
+    backup->num = num;
+    struct stat st;
+    backup->mtime = stat(backup->path, &st) == 0 ? st.st_mtim
+                                                 : (struct timespec){0, 0};
+    backup->pinned = 0;
+    backup->keep = 0;
+    (*count)++;
+  }
+  closedir(dir);
+
+  if (*count > 0) {
+    qsort(backups, *count, sizeof(RetainedBackup), backup_cmp);
+  }
+  return backups;
+}
+
+/// Finds a backup by path.
+/// @return The backup, NULL if it is not in the list.
+static RetainedBackup *find_backup(RetainedBackup *backups, size_t count,
+                                   const char *path, size_t len) {
+  for (size_t i = 0; i < count; i++) {
+    if (strlen(backups[i].path) == len &&
+        memcmp(backups[i].path, path, len) == 0) {
+      return &backups[i];
+    }
+  }
+  return NULL;
+}
+
+/// Lists the backups of a directory, marking the chain of the next delta.
+/// Called with no backup being taken, see retention_pin_t.
+/// @param arg The RetentionScan.
+static void scan_backups(const char *const *chain, size_t count, void *arg) {
+  RetentionScan *scan = (RetentionScan *)arg;
+  scan->backups = list_backups(scan->directory, &scan->count);
+  for (size_t i = 0; i < count; i++) {
+    // Not listed yet if still written aside
+    RetainedBackup *backup =
+        find_backup(scan->backups, scan->count, chain[i], strlen(chain[i]));
+    if (backup != NULL) {
+      backup->pinned = 1;
+    }
+  }
+}
+
+/// Tells whether a kept delta is based on a backup that goes. Compacting it
+/// is enough for the kept deltas based on it.
+/// @param backup The kept backup.
+/// @return 1 if it is, 0 otherwise.
+static int loses_parent(RetainedBackup *backups, size_t count,
+                        const RetainedBackup *backup) {
+  SnapshotFile snap;
+  if (snapshot_open(backup->path, &snap) != 0) {
+    return 0;
+  }
+  RetainedBackup *parent = NULL;
+  if (snap.flags & SNAPSHOT_FLAG_DELTA) {
+    parent = find_backup(backups, count, snap.parent, snap.parent_len);
+  }
+  snapshot_close(&snap);
+  return parent != NULL && !parent->keep;
+}
+
+/// Keeps the backups a kept delta is based on.
+/// @param backup The kept backup.
+static void keep_parents(RetainedBackup *backups, size_t count,
+                         const RetainedBackup *backup) {
+  SnapshotFile snap;
+  for (int depth = 0; depth < SNAPSHOT_MAX_CHAIN &&
+                      snapshot_open(backup->path, &snap) == 0;
+       depth++) {
+    RetainedBackup *parent = NULL;
+    if (snap.flags & SNAPSHOT_FLAG_DELTA) {
+      parent = find_backup(backups, count, snap.parent, snap.parent_len);
+    }
+    snapshot_close(&snap);
+    if (parent == NULL) {
+      return;
+    }
+    parent->keep = 1;
+    backup = parent;
+  }
+}
+
+/// Rewrites a delta backup as the full backup its chain adds up to.
+/// @return 0 if successful or the backup is not a delta, 1 otherwise.
+static int compact_backup(const RetainedBackup *backup) {
+  SnapshotFile snap;
+  if (snapshot_open(backup->path, &snap) != 0) {
+    // A text backup
+    return 0;
+  }
+  int delta = snap.flags & SNAPSHOT_FLAG_DELTA;
+  snapshot_close(&snap);
+  if (!delta) {
+    return 0;
+  }
+
+  size_t len = strlen(backup->path) + 5;
+  char *tmp = malloc(len);
+  if (tmp == NULL) {
+    return 1;
+  }
+  snprintf(tmp, len, "%s.cmp", backup->path);
+  // Still dated when it was taken, for the hourly policy
+  struct timespec times[2] = {backup->mtime, backup->mtime};
+  int failed = snapshot_compact(backup->path, tmp) != 0 ||
+               utimensat(AT_FDCWD, tmp, times, 0) != 0 ||
+               rename(tmp, backup->path) != 0;
+  if (failed) {
+    unlink(tmp);
+    fprintf(stderr, "Failed to compact backup %s\n", backup->path);
+  }
+  free(tmp);
+  return failed;
+}
+
+/// Applies the retention policy to a directory.
+/// @param directory The directory.
+static void retention_pass(const char *directory) {
+  // The backups being written when the list is made are in the chain, the
+  // others are done or not taken yet
+  backups_drain();
+  RetentionScan scan = {directory, NULL, 0};
+  pin_backup(scan_backups, &scan);
+
+  RetainedBackup *backups = scan.backups;
+  size_t count = scan.count;
+  time_t now = time(NULL);
+  size_t rank = 0;   // Position of the backup among its job's, newest first
+  time_t hour = -1;  // Hour of the newest backup kept for it
+  for (size_t i = 0; i < count; i++) {
+    RetainedBackup *backup = &backups[i];
+    if (i == 0 || !same_job(&backups[i - 1], backup)) {
+      rank = 0;
+      hour = -1;
+    }
+    backup->keep = rank++ < max_last || backup->pinned;
+
+    time_t mtime = backup->mtime.tv_sec;
+    if (max_hours > 0 && now - mtime < (time_t)max_hours * RETENTION_HOUR &&
+        mtime / RETENTION_HOUR != hour) {
+      hour = mtime / RETENTION_HOUR;
+      backup->keep = 1;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (backups[i].keep && loses_parent(backups, count, &backups[i]) &&
+        compact_backup(&backups[i])) {
+      keep_parents(backups, count, &backups[i]);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (!backups[i].keep && unlink(backups[i].path) != 0) {
+      fprintf(stderr, "Failed to remove backup %s\n", backups[i].path);
+    }
+    free(backups[i].path);
+  }
+  free(backups);
+}
+
+/// Retention thread: applies the policy to the directories requested.
+/// @param arg Unused.
+/// @return NULL
+static void *retention_main(void *arg) {
+  (void)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  pthread_mutex_lock(&retention_lock);
+  while (1) {
+    while (pending == NULL && !stopping) {
+      pthread_cond_wait(&retention_wake, &retention_lock);
+    }
+    if (stopping) {
+      break;
+    }
+    char *directory = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&retention_lock);
+
+    retention_pass(directory);
+    free(directory);
+    pthread_mutex_lock(&retention_lock);
+  }
+  pthread_mutex_unlock(&retention_lock);
+  return NULL;
+}
+
+int retention_init(size_t keep_last, size_t keep_hours, retention_pin_t pin) {
+  if (keep_last == 0 && keep_hours == 0) {
+    return 0;
+  }
+
+  // The newest backup is the parent of the next delta
+  max_last = keep_last > 0 ? keep_last : 1;
+  max_hours = keep_hours;
+  pin_backup = pin;
+  if (pthread_create(&retention_thread, NULL, retention_main, NULL) != 0) {
+    fprintf(stderr, "Failed to start the retention thread\n");
+    return 1;
+  }
+  running = 1;
+  return 0;
+}
+
+void retention_request(const char *directory) {
+  if (!running) {
+    return;
+  }
+
+  pthread_mutex_lock(&retention_lock);
+  if (pending == NULL) {
+    pending = strdup(directory);
+    pthread_cond_signal(&retention_wake);
+  }
+  pthread_mutex_unlock(&retention_lock);
+}
+
+void retention_stop(void) {
+  if (!running) {
+    return;
+  }
+
+  pthread_mutex_lock(&retention_lock);
+  stopping = 1;
+  pthread_cond_signal(&retention_wake);
+  pthread_mutex_unlock(&retention_lock);
+  pthread_join(retention_thread, NULL);
+  running = 0;
+  free(pending);
+  pending = NULL;
+}
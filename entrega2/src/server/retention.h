@@ -0,0 +1,45 @@
+#ifndef KVS_RETENTION_H
+#define KVS_RETENTION_H
+
+#include <stddef.h>
+
+#define RETENTION_HOUR 3600 // Seconds per slot of the hourly policy
+
+/// Keeps the backups of the jobs directory, <job>-<n>.bck, within a
+/// retention policy. After each backup a background thread waits for the
+/// backups being written, then for each job keeps its newest keep_last
+/// backups and, for each of the last keep_hours hours, the newest one
+/// written in that hour. The chain the next delta is based on stays whatever
+/// the policy, some of it may still be written. A kept delta whose parents
+/// would go is compacted into a full backup (see snapshot_compact) first,
+/// or its parents stay if that fails.
+
+/// Receives the chain the next delta backup is based on.
+/// @param chain Names of its backups, the full one first.
+/// @param count Number of backups in chain, 0 for none.
+/// @param arg Argument given to the retention_pin_t.
+typedef void (*retention_scan_t)(const char *const *chain, size_t count,
+                                 void *arg);
+
+/// Calls scan with the chain the next delta backup is based on, taking no
+/// backup until it returns.
+/// @param scan Function listing the backups.
+/// @param arg Passed to scan.
+typedef void (*retention_pin_t)(retention_scan_t scan, void *arg);
+
+/// Starts the retention thread, unless both limits are 0.
+/// @param keep_last Newest backups kept per job, at least 1.
+/// @param keep_hours Hours for which the newest backup of each is kept.
+/// @param pin Shows the chain the next delta is based on.
+/// @return 0 if successful, 1 otherwise.
+int retention_init(size_t keep_last, size_t keep_hours, retention_pin_t pin);
+
+/// Wakes the retention thread to go over a directory once the backups being
+/// written are done. Requests made while it runs are merged into one.
+/// @param directory Directory the backups are written to.
+void retention_request(const char *directory);
+
+/// Stops the retention thread, waiting for the pass it is making.
+void retention_stop(void);
+
+#endif // KVS_RETENTION_H
@@ -0,0 +1,122 @@
+#include "ring.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "constants.h"
+
+/// Sleeps until the ring is not in the given state. The sleeper announces
+/// itself in the waiting flag before checking the indexes again, and the other
+/// side checks the flag after moving its index, so no wake up is lost.
+/// @param ring The ring.
+/// @param waiting Flag of the sleeping side.
+/// @param full 1 to wait while the ring is full, 0 to wait while it is empty.
+static void ring_wait(CmdRing *ring, atomic_int *waiting, int full) {
+  pthread_mutex_lock(&ring->lock);
+  atomic_store(waiting, 1);
+  while (1) {
+    size_t used = atomic_load(&ring->tail) - atomic_load(&ring->head);
+    if (full ? used < RING_SIZE : used > 0) {
+      break;
+    }
+    pthread_cond_wait(&ring->cond, &ring->lock);
+  }
+  atomic_store(waiting, 0);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+/// Wakes the other side of the ring if it is sleeping.
+/// @param ring The ring.
+/// @param waiting Flag of the other side.
+static void ring_wake(CmdRing *ring, atomic_int *waiting) {
+  if (atomic_load(waiting)) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+CmdRing *ring_create(int fd, cmd_reader_t next) {
+  CmdRing *ring = malloc(sizeof(CmdRing));
+  if (ring == NULL) {
+    return NULL;
+  }
+
+  char(*strings)[MAX_STRING_SIZE] =
+      malloc(2 * RING_SIZE * MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  if (strings == NULL) {
+    free(ring);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < RING_SIZE; i++) {
+    ring->slots[i].keys = strings + 2 * i * MAX_WRITE_SIZE;
+    ring->slots[i].values = strings + (2 * i + 1) * MAX_WRITE_SIZE;
+  }
+
+  ring->fd = fd;
+  ring->next = next;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->producer_waiting, 0);
+  atomic_init(&ring->consumer_waiting, 0);
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+  return ring;
+}
+
+void ring_destroy(CmdRing *ring) {
+  // The strings of every slot live in the allocation of the first one
+  free(ring->slots[0].keys);
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->cond);
+  free(ring);
+}
+
+void *ring_parser(void *arg) {
+  CmdRing *ring = (CmdRing *)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  while (1) {
+    size_t tail = atomic_load(&ring->tail);
+    if (tail - atomic_load(&ring->head) == RING_SIZE) {
+      ring_wait(ring, &ring->producer_waiting, 1);
+    }
+
+    JobCmd *cmd = &ring->slots[tail & (RING_SIZE - 1)];
+    enum Command code = ring->next(ring->fd, cmd);
+    if (code == CMD_EMPTY) {
+      // Nothing for the executor to do
+      continue;
+    }
+
+    atomic_store(&ring->tail, tail + 1);
+    ring_wake(ring, &ring->consumer_waiting);
+
+    if (code == EOC) {
+      return NULL;
+    }
+  }
+}
+
+JobCmd *ring_peek(CmdRing *ring) {
+  size_t head = atomic_load(&ring->head);
+  if (atomic_load(&ring->tail) == head) {
+    ring_wait(ring, &ring->consumer_waiting, 0);
+  }
+
+  return &ring->slots[head & (RING_SIZE - 1)];
+}
+
+void ring_pop(CmdRing *ring) {
+  atomic_fetch_add(&ring->head, 1);
+  ring_wake(ring, &ring->producer_waiting);
+}
@@ -0,0 +1,52 @@
+#ifndef KVS_RING_H
+#define KVS_RING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "parser.h"
+
+#define RING_SIZE 16 // Commands decoded ahead of the executor, a power of two.
+
+/// Bounded single-producer single-consumer ring of decoded commands. A parser
+/// thread fills it from a job file while the job's thread executes the
+/// commands, so parsing overlaps with lock waits and output I/O.
+typedef struct CmdRing {
+  JobCmd slots[RING_SIZE];
+  int fd;                     // Job file being parsed
+  cmd_reader_t next;          // Decoder of the job file
+  atomic_size_t head;         // Next slot to execute
+  atomic_size_t tail;         // Next slot to fill
+  atomic_int producer_waiting; // 1 while the parser sleeps on a full ring
+  atomic_int consumer_waiting; // 1 while the executor sleeps on an empty ring
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} CmdRing;
+
+/// Creates a ring for a job file.
+/// @param fd File descriptor of the job file.
+/// @param next Decoder of the job file.
+/// @return Newly created ring, NULL on failure.
+CmdRing *ring_create(int fd, cmd_reader_t next);
+
+/// Frees a ring. The parser thread must have finished.
+/// @param ring The ring to free.
+void ring_destroy(CmdRing *ring);
+
+/// Parser thread: decodes the job file into the ring until the end of the
+/// file, which is published as an EOC command.
+/// @param arg The ring to fill.
+/// @return NULL
+void *ring_parser(void *arg);
+
+/// Waits for the next decoded command.
+/// @param ring The ring.
+/// @return The next command, valid until ring_pop is called.
+JobCmd *ring_peek(CmdRing *ring);
+
+/// Releases the command returned by ring_peek, so the parser can reuse it.
+/// @param ring The ring.
+void ring_pop(CmdRing *ring);
+
+#endif // KVS_RING_H
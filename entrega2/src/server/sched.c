@@ -0,0 +1,386 @@
+#include "sched.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+Scheduler *sched_create(size_t num_workers) {
+  Scheduler *sched = malloc(sizeof(Scheduler));
+  if (sched == NULL) {
+    return NULL;
+  }
+
+  sched->deques = calloc(num_workers, sizeof(SchedDeque));
+  if (sched->deques == NULL) {
+    free(sched);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < num_workers; i++) {
+    pthread_mutex_init(&sched->deques[i].lock, NULL);
+  }
+
+  sched->batch = NULL;
+  sched->num_batch = 0;
+  sched->batch_cap = 0;
+  sched->names = NULL;
+  sched->num_names = 0;
+  sched->names_cap = 0;
+  sched->num_workers = num_workers;
+  sched->queued = 0;
+  sched->parked = 0;
+  sched->closed = 0;
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->cond, NULL);
+  return sched;
+}
+
+/// Copies a job into a new allocation owned by the scheduler.
+/// @param job The job to copy.
+/// @return The copy, NULL on failure.
+static SchedJob *job_copy(const SchedJob *job) {
+  SchedJob *copy = malloc(sizeof(SchedJob));
+  if (copy != NULL) {
+    *copy = *job;
+  }
+  return copy;
+}
+
+/// Finds the slot of a name in the name table.
+/// @param names The table, with a free slot.
+/// @param cap Slots of the table, a power of two.
+/// @param name The name.
+/// @return The slot holding the name, or the free one it would go in.
+static char **name_slot(char **names, size_t cap, const char *name) {
+  // FNV-1a
+  size_t hash = 2166136261u;
+  for (const char *c = name; *c != '\0'; c++) {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+
+  size_t i = hash & (cap - 1);
+  while (names[i] != NULL && strcmp(names[i], name) != 0) {
+    i = (i + 1) & (cap - 1);
+  }
+  return &names[i];
+}
+
+/// Records the file of a job. Called with lock held once the workers run.
+/// @param sched The scheduler.
+/// @param name Name of the file.
+/// @return 0 if it was not recorded before, 1 if it was, -1 on failure.
+static int claim_name(Scheduler *sched, const char *name) {
+  // Kept at most half full
+  if (2 * (sched->num_names + 1) > sched->names_cap) {
+    size_t cap = sched->names_cap == 0 ? 64 : 2 * sched->names_cap;
+    char **names = calloc(cap, sizeof(char *));
+    if (names == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < sched->names_cap; i++) {
+      if (sched->names[i] != NULL) {
+        *name_slot(names, cap, sched->names[i]) = sched->names[i];
+      }
+    }
+    free(sched->names);
+    sched->names = names;
+    sched->names_cap = cap;
+  }
+
+  char **slot = name_slot(sched->names, sched->names_cap, name);
+  if (*slot != NULL) {
+    return 1;
+  }
+  *slot = strdup(name);
+  if (*slot == NULL) {
+    return -1;
+  }
+  sched->num_names++;
+  return 0;
+}
+
+int sched_add(Scheduler *sched, const SchedJob *job) {
+  int claimed = claim_name(sched, job->name);
+  if (claimed != 0) {
+    return claimed == -1;
+  }
+
+  if (sched->num_batch == sched->batch_cap) {
+    size_t cap = sched->batch_cap == 0 ? 16 : 2 * sched->batch_cap;
+    SchedJob **batch = realloc(sched->batch, cap * sizeof(SchedJob *));
+    if (batch == NULL) {
+      return 1;
+    }
+    sched->batch = batch;
+    sched->batch_cap = cap;
+  }
+
+  SchedJob *copy = job_copy(job);
+  if (copy == NULL) {
+    return 1;
+  }
+  sched->batch[sched->num_batch++] = copy;
+  return 0;
+}
+
+/// Appends a job to the back of a deque, which must be locked.
+/// @param deque The deque.
+/// @param job The job to append.
+/// @return 0 if successful, 1 otherwise.
+static int deque_append(SchedDeque *deque, SchedJob *job) {
+  if (deque->tail == deque->cap) {
+    // Reuse the slots already taken from the front before growing
+    size_t count = deque->tail - deque->head;
+    if (deque->head > 0) {
+      memmove(deque->jobs, deque->jobs + deque->head,
+              count * sizeof(SchedJob *));
+      deque->head = 0;
+      deque->tail = count;
+    }
+
+    if (deque->tail == deque->cap) {
+      size_t cap = deque->cap == 0 ? 16 : 2 * deque->cap;
+      SchedJob **jobs = realloc(deque->jobs, cap * sizeof(SchedJob *));
+      if (jobs == NULL) {
+        return 1;
+      }
+      deque->jobs = jobs;
+      deque->cap = cap;
+    }
+  }
+
+  deque->jobs[deque->tail++] = job;
+  deque->load += job->size;
+  return 0;
+}
+
+/// Finds the deque with the fewest bytes left to run.
+/// @param sched The scheduler.
+/// @return The least loaded deque.
+static SchedDeque *least_loaded(Scheduler *sched) {
+  SchedDeque *target = &sched->deques[0];
+  for (size_t w = 1; w < sched->num_workers; w++) {
+    if (sched->deques[w].load < target->load) {
+      target = &sched->deques[w];
+    }
+  }
+  return target;
+}
+
+static int compare_size(const void *a, const void *b) {
+  off_t size_a = (*(SchedJob *const *)a)->size;
+  off_t size_b = (*(SchedJob *const *)b)->size;
+  return (size_a < size_b) - (size_a > size_b);
+}
+
+int sched_distribute(Scheduler *sched) {
+  if (sched->num_batch > 0) {
+    qsort(sched->batch, sched->num_batch, sizeof(SchedJob *), compare_size);
+  }
+
+  // Largest job first to the least loaded worker, before any worker runs
+  for (size_t i = 0; i < sched->num_batch; i++) {
+    if (deque_append(least_loaded(sched), sched->batch[i])) {
+      // The jobs already in a deque are freed with it
+      for (size_t j = i; j < sched->num_batch; j++) {
+        free(sched->batch[j]);
+      }
+      sched->num_batch = 0;
+      return 1;
+    }
+    sched->queued++;
+  }
+
+  sched->num_batch = 0;
+  return 0;
+}
+
+/// Queues a job on the least loaded worker while the workers run.
+/// @param sched The scheduler.
+/// @param job The job to queue.
+/// @param resumed 1 if the job was parked.
+/// @return 0 if successful, 1 otherwise.
+static int sched_enqueue(Scheduler *sched, SchedJob *job, int resumed) {
+  // Loads change under the workers, an approximate choice is good enough
+  SchedDeque *target = NULL;
+  off_t min_load = -1;
+  for (size_t w = 0; w < sched->num_workers; w++) {
+    SchedDeque *deque = &sched->deques[w];
+    pthread_mutex_lock(&deque->lock);
+    if (target == NULL || deque->load < min_load) {
+      target = deque;
+      min_load = deque->load;
+    }
+    pthread_mutex_unlock(&deque->lock);
+  }
+
+  // Holding the scheduler lock, the job cannot be taken before it is counted
+  pthread_mutex_lock(&sched->lock);
+  pthread_mutex_lock(&target->lock);
+  int failed = deque_append(target, job);
+  pthread_mutex_unlock(&target->lock);
+  if (failed) {
+    pthread_mutex_unlock(&sched->lock);
+    return 1;
+  }
+
+  sched->queued++;
+  if (resumed) {
+    sched->parked--;
+  }
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+  return 0;
+}
+
+int sched_push(Scheduler *sched, const SchedJob *job) {
+  pthread_mutex_lock(&sched->lock);
+  int claimed = claim_name(sched, job->name);
+  pthread_mutex_unlock(&sched->lock);
+  if (claimed != 0) {
+    return claimed == -1;
+  }
+
+  SchedJob *copy = job_copy(job);
+  if (copy == NULL) {
+    return 1;
+  }
+
+  if (sched_enqueue(sched, copy, 0)) {
+    free(copy);
+    return 1;
+  }
+  return 0;
+}
+
+void sched_park(Scheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched->parked++;
+  pthread_mutex_unlock(&sched->lock);
+}
+
+int sched_resume(Scheduler *sched, SchedJob *job) {
+  return sched_enqueue(sched, job, 1);
+}
+
+void sched_unpark(Scheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched->parked--;
+  // The workers may be waiting for this job alone
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_close(Scheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched->closed = 1;
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+/// Takes the job at the front of a worker's own deque.
+/// @param deque The worker's deque.
+/// @return The job, NULL if the deque is empty.
+static SchedJob *deque_take(SchedDeque *deque) {
+  SchedJob *job = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail) {
+    job = deque->jobs[deque->head++];
+    deque->load -= job->size;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+/// Steals the smallest job of the most loaded worker.
+/// @param sched The scheduler.
+/// @param thief Index of the worker stealing.
+/// @return The stolen job, NULL if there are no jobs left.
+static SchedJob *sched_steal(Scheduler *sched, size_t thief) {
+  while (1) {
+    SchedDeque *victim = NULL;
+    off_t max_load = -1;
+
+    for (size_t w = 0; w < sched->num_workers; w++) {
+      SchedDeque *deque = &sched->deques[w];
+      if (w == thief) {
+        continue;
+      }
+
+      pthread_mutex_lock(&deque->lock);
+      if (deque->head < deque->tail && deque->load > max_load) {
+        max_load = deque->load;
+        victim = deque;
+      }
+      pthread_mutex_unlock(&deque->lock);
+    }
+
+    if (victim == NULL) {
+      return NULL;
+    }
+
+    // The victim may have been emptied since it was chosen
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      SchedJob *job = victim->jobs[--victim->tail];
+      victim->load -= job->size;
+      pthread_mutex_unlock(&victim->lock);
+      return job;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+}
+
+SchedJob *sched_next(Scheduler *sched, size_t worker) {
+  while (1) {
+    SchedJob *job = deque_take(&sched->deques[worker]);
+    if (job == NULL) {
+      job = sched_steal(sched, worker);
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    if (job != NULL) {
+      sched->queued--;
+      pthread_mutex_unlock(&sched->lock);
+      return job;
+    }
+
+    // A job pushed after the deques were checked is counted in queued
+    while (sched->queued == 0 && (!sched->closed || sched->parked > 0)) {
+      pthread_cond_wait(&sched->cond, &sched->lock);
+    }
+    int done = sched->queued == 0;
+    pthread_mutex_unlock(&sched->lock);
+
+    if (done) {
+      return NULL;
+    }
+  }
+}
+
+void sched_done(SchedJob *job) { free(job); }
+
+void sched_destroy(Scheduler *sched) {
+  for (size_t i = 0; i < sched->num_batch; i++) {
+    free(sched->batch[i]);
+  }
+
+  for (size_t i = 0; i < sched->num_workers; i++) {
+    SchedDeque *deque = &sched->deques[i];
+    for (size_t j = deque->head; j < deque->tail; j++) {
+      free(deque->jobs[j]);
+    }
+    free(deque->jobs);
+    pthread_mutex_destroy(&deque->lock);
+  }
+
+  for (size_t i = 0; i < sched->names_cap; i++) {
+    free(sched->names[i]);
+  }
+  free(sched->names);
+
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->cond);
+  free(sched->deques);
+  free(sched->batch);
+  free(sched);
+}
@@ -0,0 +1,117 @@
+#ifndef KVS_SCHED_H
+#define KVS_SCHED_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "constants.h"
+
+/// A job file waiting to be run.
+typedef struct SchedJob {
+  char in_path[MAX_JOB_FILE_NAME_SIZE];  // Path of the job file
+  char out_path[MAX_JOB_FILE_NAME_SIZE]; // Path of its output file
+  char name[MAX_JOB_FILE_NAME_SIZE];     // File name, used for its backups
+  int binary;                            // 1 for a .jobbin file
+  off_t size;                            // Size of the job file
+  int in_fd;                             // Job file once started, else -1
+  int out_fd;                            // Output file once started, else -1
+  size_t backups;                        // Backups done by the job so far
+  unsigned int wait_ms;                  // Delay of the WAIT it is parked on
+} SchedJob;
+
+/// Jobs of one worker, taken from the front by their owner and stolen from
+/// the back by the other workers.
+typedef struct SchedDeque {
+  SchedJob **jobs; // Assigned jobs, the initial batch largest first
+  size_t head;     // Next job of the owner
+  size_t tail;     // One past the last job
+  size_t cap;      // Allocated capacity of jobs
+  off_t load;      // Bytes of the jobs still in the deque
+  pthread_mutex_t lock;
+} SchedDeque;
+
+/// Size-aware job scheduler: the jobs are sorted largest first and spread
+/// over one deque per worker so the bytes to run are balanced, and a worker
+/// that runs out of jobs steals from the most loaded one. Jobs can also be
+/// pushed while the workers run, until the scheduler is closed.
+typedef struct Scheduler {
+  SchedJob **batch;    // Jobs added before sched_distribute
+  size_t num_batch;    // Number of jobs in batch
+  size_t batch_cap;    // Allocated capacity of batch
+  char **names;        // Files of the jobs ever added, an open addressing
+                       // table, protected by lock once the workers run
+  size_t num_names;    // Number of names
+  size_t names_cap;    // Slots of names, a power of two
+  SchedDeque *deques;  // One deque per worker
+  size_t num_workers;  // Number of workers
+  size_t queued;       // Jobs in the deques, protected by lock
+  size_t parked;       // Jobs waiting to be resumed, protected by lock
+  int closed;          // 1 once no more jobs will be pushed
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Signaled when a job is queued or on close
+} Scheduler;
+
+/// Creates an empty scheduler.
+/// @param num_workers Number of workers that will take jobs.
+/// @return Newly created scheduler, NULL on failure.
+Scheduler *sched_create(size_t num_workers);
+
+/// Adds a job to the initial batch. Must be called before sched_distribute.
+/// A job whose file was added or pushed before is skipped, each file runs
+/// once.
+/// @param sched The scheduler.
+/// @param job The job to add, copied into the scheduler.
+/// @return 0 if successful or skipped, 1 otherwise.
+int sched_add(Scheduler *sched, const SchedJob *job);
+
+/// Sorts the initial batch largest first and assigns every job to a worker.
+/// @param sched The scheduler.
+/// @return 0 if successful, 1 otherwise.
+int sched_distribute(Scheduler *sched);
+
+/// Queues a job on the least loaded worker while the workers run. A job
+/// whose file was added or pushed before is skipped, as in sched_add, even
+/// if it is still running.
+/// @param sched The scheduler.
+/// @param job The job to queue, copied into the scheduler.
+/// @return 0 if successful or skipped, 1 otherwise.
+int sched_push(Scheduler *sched, const SchedJob *job);
+
+/// Marks a job returned by sched_next as parked: it will be given back with
+/// sched_resume, so the workers do not stop before that.
+/// @param sched The scheduler.
+void sched_park(Scheduler *sched);
+
+/// Queues a parked job again, on the least loaded worker.
+/// @param sched The scheduler.
+/// @param job The job, as returned by sched_next.
+/// @return 0 if successful, 1 otherwise.
+int sched_resume(Scheduler *sched, SchedJob *job);
+
+/// Undoes sched_park for a job that will not be resumed.
+/// @param sched The scheduler.
+void sched_unpark(Scheduler *sched);
+
+/// Marks the end of the jobs: workers stop once the deques are empty and no
+/// job is parked.
+/// @param sched The scheduler.
+void sched_close(Scheduler *sched);
+
+/// Takes the next job of a worker, stealing one if its deque is empty and
+/// waiting for one if every deque is empty.
+/// @param sched The scheduler.
+/// @param worker Index of the worker.
+/// @return The job, to be released with sched_done, or NULL once the
+/// scheduler is closed and every job was run.
+SchedJob *sched_next(Scheduler *sched, size_t worker);
+
+/// Releases a job returned by sched_next.
+/// @param job The finished job.
+void sched_done(SchedJob *job);
+
+/// Frees a scheduler and its remaining jobs. The workers must have finished.
+/// @param sched The scheduler to free.
+void sched_destroy(Scheduler *sched);
+
+#endif // KVS_SCHED_H
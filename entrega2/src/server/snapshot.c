@@ -0,0 +1,1488 @@
+// MAP_ANONYMOUS is not part of strict POSIX
+#define _DEFAULT_SOURCE
+
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "io.h"
+#include "lz.h"
+#include "throttle.h"
+
+// Largest block: it ends with the pair reaching SNAPSHOT_BLOCK_SIZE bytes
+#define SNAPSHOT_BLOCK_MAX                                                     \
+  (SNAPSHOT_BLOCK_SIZE + 2 + MAX_STRING_SIZE + UINT8_MAX)
+
+/// A part of a backup and the pairs parsed from it.
+typedef struct SnapshotPart {
+  const char *begin;             // First line of a text part
+  const char *end;               // After the last line of a text part
+  const SnapshotFile *snap;      // Binary backup, NULL for a text one
+  size_t first_block;            // Blocks of a binary part
+  size_t num_blocks;
+  KeyNode *heads[TABLE_SIZE];    // Pairs of each bucket, in file order
+  KeyNode *tails[TABLE_SIZE];
+  uint64_t count;                // Number of pairs parsed
+  int failed;                    // 1 if the part was malformed
+} SnapshotPart;
+
+/// A block of a binary backup being written.
+typedef struct BlockInfo {
+  uint64_t offset;
+  uint32_t len;
+  uint32_t count;
+  uint32_t crc;
+  size_t first; // Index of the block's first pair in the sorted pairs
+} BlockInfo;
+
+/// Where each pair of a table goes in a binary backup.
+typedef struct SnapshotLayout {
+  void *mem;               // Mapping holding blocks and nodes
+  size_t mem_len;
+  const KeyNode **nodes;   // Pairs written, sorted by key
+  size_t count;
+  BlockInfo *blocks;
+  size_t num_blocks;
+  uint32_t buckets;        // Buckets written, 1 << bucket each
+  const char *parent;      // Parent of a delta, NULL for a full backup
+  size_t parent_len;
+  size_t header_len;       // Bytes of the header and delta fields
+  uint64_t index_offset;
+  int compress;            // 1 to compress blocks, see SNAPSHOT_FLAG_LZ
+  unsigned char *raw;      // Scratch block of snapshot_write, with
+  unsigned char *packed;   // compression
+} SnapshotLayout;
+
+/// A range of blocks or buckets written by a thread of a parallel writer.
+typedef struct WritePart {
+  int fd;
+  const SnapshotLayout *layout; // Binary backup, NULL for a text one
+  HashTable *ht;                // Table of a text backup
+  size_t first;                 // First block or bucket
+  size_t count;                 // Number of blocks or buckets
+  uint64_t offset;              // Where a text part starts in the file
+  unsigned char *out;           // Compressed blocks, written once their
+  size_t out_len;               // offsets are known
+  int failed;
+} WritePart;
+
+static void put_u16(unsigned char *p, uint16_t value) {
+  p[0] = (unsigned char)(value & 0xff);
+  p[1] = (unsigned char)(value >> 8);
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char)((value >> (8 * i)) & 0xff);
+  }
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char)((value >> (8 * i)) & 0xff);
+  }
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+  return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+/// Orders two pairs by key, bytewise.
+static int key_cmp(const KeyNode *a, const KeyNode *b) {
+  size_t len = a->key_len < b->key_len ? a->key_len : b->key_len;
+  int cmp = memcmp(a->key, b->key, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (a->key_len > b->key_len) - (a->key_len < b->key_len);
+}
+
+static void sift_down(const KeyNode **nodes, size_t i, size_t count) {
+  while (1) {
+    size_t max = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < count && key_cmp(nodes[left], nodes[max]) > 0) {
+      max = left;
+    }
+    if (right < count && key_cmp(nodes[right], nodes[max]) > 0) {
+      max = right;
+    }
+    if (max == i) {
+      return;
+    }
+    const KeyNode *tmp = nodes[i];
+    nodes[i] = nodes[max];
+    nodes[max] = tmp;
+    i = max;
+  }
+}
+
+/// Sorts pairs by key. A heapsort, since qsort may allocate memory.
+static void sort_nodes(const KeyNode **nodes, size_t count) {
+  for (size_t i = count / 2; i-- > 0;) {
+    sift_down(nodes, i, count);
+  }
+  for (size_t end = count; end > 1; end--) {
+    const KeyNode *tmp = nodes[0];
+    nodes[0] = nodes[end - 1];
+    nodes[end - 1] = tmp;
+    sift_down(nodes, 0, end - 1);
+  }
+}
+
+/// Runs a function on each part of a job, the first by the calling thread
+/// and the others by threads of their own, or by the calling thread if one
+/// cannot be started.
+/// @param fn Function to run, given a part.
+/// @param parts Array of parts.
+/// @param part_size Size of a part.
+/// @param num_parts Number of parts.
+static void run_parts(void *(*fn)(void *), void *parts, size_t part_size,
+                      size_t num_parts) {
+  char *part = (char *)parts;
+  pthread_t *threads =
+      num_parts > 1 ? malloc(num_parts * sizeof(pthread_t)) : NULL;
+  size_t started = 1;
+  for (; threads != NULL && started < num_parts; started++) {
+    if (pthread_create(&threads[started], NULL, fn,
+                       part + started * part_size) != 0) {
+      break;
+    }
+  }
+  for (size_t i = started; i < num_parts; i++) {
+    fn(part + i * part_size);
+  }
+  if (num_parts > 0) {
+    fn(part);
+  }
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+/// Writes bytes at an offset, at the rate throttle.h lets backups through.
+static int pwrite_all(int fd, const unsigned char *data, size_t len,
+                      uint64_t offset) {
+  while (len > 0) {
+    size_t chunk = len < THROTTLE_CHUNK ? len : THROTTLE_CHUNK;
+    throttle_take(chunk);
+    ssize_t written = pwrite(fd, data, chunk, (off_t)offset);
+    if (written <= 0) {
+      return 1;
+    }
+    data += written;
+    len -= (size_t)written;
+    offset += (uint64_t)written;
+  }
+  return 0;
+}
+
+/// Sorts the pairs of a table and cuts them into blocks. Memory comes from
+/// mmap, so it is async signal safe.
+/// @param layout Set to the layout, released with layout_free.
+/// @param ht The table.
+/// @param parent Parent of a delta of the buckets marked in ht->dirty, NULL
+/// for a full backup.
+/// @param compress 1 to compress blocks.
+/// @return 0 if successful, 1 otherwise.
+static int layout_prepare(SnapshotLayout *layout, HashTable *ht,
+                          const char *parent, int compress) {
+  layout->compress = compress;
+  layout->parent = parent;
+  layout->parent_len = parent != NULL ? strlen(parent) : 0;
+  if (layout->parent_len > SNAPSHOT_PATH_MAX) {
+    return 1;
+  }
+
+  // A delta holds the dirty buckets only
+  layout->buckets = 0;
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    if (parent == NULL || ht->dirty[i]) {
+      layout->buckets |= (uint32_t)1 << i;
+    }
+  }
+
+  size_t count = 0;
+  size_t bytes = 0;
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    if (!(layout->buckets & (uint32_t)1 << i)) {
+      continue;
+    }
+    for (KeyNode *node = ht->table[i]; node != NULL; node = node->next) {
+      if (node->key_len >= MAX_STRING_SIZE || node->value_len > UINT8_MAX) {
+        return 1;
+      }
+      count++;
+      bytes += 2 + node->key_len + node->value_len;
+    }
+  }
+
+  // Every block but the last holds SNAPSHOT_BLOCK_SIZE bytes or more
+  size_t max_blocks = bytes / SNAPSHOT_BLOCK_SIZE + 1;
+  layout->mem_len = max_blocks * sizeof(BlockInfo) +
+                    count * sizeof(KeyNode *) +
+                    (compress ? 2 * SNAPSHOT_BLOCK_MAX : 0);
+  layout->mem = mmap(NULL, layout->mem_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (layout->mem == MAP_FAILED) {
+    return 1;
+  }
+  layout->blocks = layout->mem;
+  layout->nodes = (const KeyNode **)(void *)(layout->blocks + max_blocks);
+  layout->count = count;
+  layout->raw = (unsigned char *)(layout->nodes + count);
+  layout->packed = layout->raw + SNAPSHOT_BLOCK_MAX;
+
+  size_t n = 0;
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    if (!(layout->buckets & (uint32_t)1 << i)) {
+      continue;
+    }
+    for (KeyNode *node = ht->table[i]; node != NULL; node = node->next) {
+      layout->nodes[n++] = node;
+    }
+  }
+  sort_nodes(layout->nodes, count);
+
+  layout->header_len = SNAPSHOT_HEADER_SIZE;
+  if (parent != NULL) {
+    layout->header_len += 6 + layout->parent_len;
+  }
+
+  uint64_t offset = layout->header_len;
+  layout->num_blocks = 0;
+  BlockInfo block = {offset, 0, 0, 0, 0};
+  for (size_t i = 0; i < count; i++) {
+    const KeyNode *node = layout->nodes[i];
+    size_t len = 2 + node->key_len + node->value_len;
+    block.len += (uint32_t)len;
+    block.count++;
+    offset += len;
+
+    if (block.len >= SNAPSHOT_BLOCK_SIZE || i + 1 == count) {
+      layout->blocks[layout->num_blocks++] = block;
+      block = (BlockInfo){offset, 0, 0, 0, i + 1};
+    }
+  }
+  layout->index_offset = offset;
+  return 0;
+}
+
+static void layout_free(SnapshotLayout *layout) {
+  munmap(layout->mem, layout->mem_len);
+}
+
+/// Encodes the header, and the fields of a delta.
+/// @param p Where to write layout->header_len bytes.
+static void encode_header(unsigned char *p, const SnapshotLayout *layout,
+                          uint64_t lsn) {
+  memcpy(p, SNAPSHOT_MAGIC, 4);
+  put_u16(p + 4, SNAPSHOT_VERSION);
+  put_u16(p + 6, (uint16_t)((layout->parent != NULL ? SNAPSHOT_FLAG_DELTA : 0) |
+                             (layout->compress ? SNAPSHOT_FLAG_LZ : 0)));
+  put_u64(p + 8, lsn);
+  put_u64(p + 16, layout->count);
+  if (layout->parent != NULL) {
+    put_u32(p + 24, layout->buckets);
+    put_u16(p + 28, (uint16_t)layout->parent_len);
+    memcpy(p + 30, layout->parent, layout->parent_len);
+  }
+}
+
+/// Encodes a pair.
+/// @param p Where to write the pair's 2 + key_len + value_len bytes.
+/// @return Number of bytes written.
+static size_t encode_pair(unsigned char *p, const KeyNode *node) {
+  p[0] = (unsigned char)node->key_len;
+  p[1] = (unsigned char)node->value_len;
+  memcpy(p + 2, node->key, node->key_len);
+  memcpy(p + 2 + node->key_len, node->value, node->value_len);
+  return 2 + node->key_len + node->value_len;
+}
+
+/// Encodes the index entry of a block, whose CRC is known.
+/// @param p Where to write SNAPSHOT_INDEX_ENTRY_SIZE bytes.
+static void encode_index_entry(unsigned char *p, const SnapshotLayout *layout,
+                               const BlockInfo *block) {
+  const KeyNode *first = layout->nodes[block->first];
+  memset(p, 0, SNAPSHOT_INDEX_ENTRY_SIZE);
+  put_u64(p, block->offset);
+  put_u32(p + 8, block->len);
+  put_u32(p + 12, block->count);
+  put_u32(p + 16, block->crc);
+  p[20] = (unsigned char)first->key_len;
+  memcpy(p + 21, first->key, first->key_len);
+}
+
+/// Encodes the footer.
+/// @param p Where to write SNAPSHOT_FOOTER_SIZE bytes.
+/// @param index_crc CRC of the encoded index.
+static void encode_footer(unsigned char *p, const SnapshotLayout *layout,
+                          uint32_t index_crc) {
+  put_u64(p, layout->index_offset);
+  put_u32(p + 8, (uint32_t)layout->num_blocks);
+  put_u32(p + 12, index_crc);
+  memcpy(p + 16, SNAPSHOT_MAGIC, 4);
+}
+
+/// Encodes the pairs of a block, compressed if the layout says so.
+/// @param layout The layout.
+/// @param block The block, whose len and crc are set.
+/// @param raw Scratch buffer of SNAPSHOT_BLOCK_MAX bytes.
+/// @param packed Where the block is encoded if it is compressed, of
+/// SNAPSHOT_BLOCK_MAX bytes.
+/// @return The encoded block, in raw or packed.
+static unsigned char *encode_block(const SnapshotLayout *layout,
+                                   BlockInfo *block, unsigned char *raw,
+                                   unsigned char *packed) {
+  unsigned char *pairs = layout->compress ? raw + 4 : raw;
+  size_t len = 0;
+  for (size_t i = block->first; i < block->first + block->count; i++) {
+    len += encode_pair(pairs + len, layout->nodes[i]);
+  }
+
+  unsigned char *data = raw;
+  if (layout->compress) {
+    // Kept as is unless it shrinks
+    size_t packed_len = lz_compress(pairs, len, packed + 4, len - 1);
+    put_u32(raw, (uint32_t)len);
+    put_u32(packed, (uint32_t)len);
+    data = packed_len > 0 ? packed : raw;
+    len = 4 + (packed_len > 0 ? packed_len : len);
+  }
+
+  block->len = (uint32_t)len;
+  block->crc = crc32c(0, data, len);
+  return data;
+}
+
+/// Gives each block its offset after the ones before it, once their sizes
+/// are known.
+static void layout_place(SnapshotLayout *layout) {
+  uint64_t offset = layout->header_len;
+  for (size_t b = 0; b < layout->num_blocks; b++) {
+    layout->blocks[b].offset = offset;
+    offset += layout->blocks[b].len;
+  }
+  layout->index_offset = offset;
+}
+
+int snapshot_write(UringWriter *writer, HashTable *ht, uint64_t lsn,
+                   const char *parent, int compress) {
+  SnapshotLayout layout;
+  if (layout_prepare(&layout, ht, parent, compress)) {
+    return 1;
+  }
+
+  unsigned char *p =
+      (unsigned char *)uring_writer_reserve(writer, layout.header_len);
+  encode_header(p, &layout, lsn);
+
+  for (size_t b = 0; b < layout.num_blocks; b++) {
+    BlockInfo *block = &layout.blocks[b];
+    if (compress) {
+      const unsigned char *data =
+          encode_block(&layout, block, layout.raw, layout.packed);
+      // A block may be larger than a reservation
+      for (size_t done = 0; done < block->len;) {
+        size_t len = block->len - done < 4096 ? block->len - done : 4096;
+        memcpy(uring_writer_reserve(writer, len), data + done, len);
+        done += len;
+      }
+      continue;
+    }
+
+    for (size_t i = block->first; i < block->first + block->count; i++) {
+      const KeyNode *node = layout.nodes[i];
+      p = (unsigned char *)uring_writer_reserve(
+          writer, 2 + node->key_len + node->value_len);
+      block->crc = crc32c(block->crc, p, encode_pair(p, node));
+    }
+  }
+  layout_place(&layout);
+
+  uint32_t index_crc = 0;
+  for (size_t b = 0; b < layout.num_blocks; b++) {
+    p = (unsigned char *)uring_writer_reserve(writer,
+                                              SNAPSHOT_INDEX_ENTRY_SIZE);
+    encode_index_entry(p, &layout, &layout.blocks[b]);
+    index_crc = crc32c(index_crc, p, SNAPSHOT_INDEX_ENTRY_SIZE);
+  }
+
+  p = (unsigned char *)uring_writer_reserve(writer, SNAPSHOT_FOOTER_SIZE);
+  encode_footer(p, &layout, index_crc);
+
+  layout_free(&layout);
+  return 0;
+}
+
+/// Writer thread of a binary backup: encodes a range of blocks and writes
+/// each at its offset. Compressed blocks are kept in the part, since their
+/// offsets depend on the size of the blocks before them.
+/// @param arg The WritePart.
+/// @return NULL
+static void *write_blocks(void *arg) {
+  WritePart *part = (WritePart *)arg;
+  const SnapshotLayout *layout = part->layout;
+  unsigned char *buf = malloc(2 * SNAPSHOT_BLOCK_MAX);
+  if (buf == NULL) {
+    part->failed = 1;
+    return NULL;
+  }
+
+  size_t out_cap = 0;
+  for (size_t b = part->first; b < part->first + part->count; b++) {
+    BlockInfo *block = &layout->blocks[b];
+    unsigned char *data =
+        encode_block(layout, block, buf, buf + SNAPSHOT_BLOCK_MAX);
+    if (!layout->compress) {
+      if (pwrite_all(part->fd, data, block->len, block->offset)) {
+        part->failed = 1;
+        break;
+      }
+      continue;
+    }
+
+    if (out_cap - part->out_len < block->len) {
+      out_cap = out_cap > 0 ? 2 * out_cap : 4 * SNAPSHOT_BLOCK_MAX;
+      unsigned char *out = realloc(part->out, out_cap);
+      if (out == NULL) {
+        part->failed = 1;
+        break;
+      }
+      part->out = out;
+    }
+    memcpy(part->out + part->out_len, data, block->len);
+    part->out_len += block->len;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+/// Writer thread of a binary backup: writes the compressed blocks of a part
+/// at the offset of its first block.
+/// @param arg The WritePart.
+/// @return NULL
+static void *write_packed(void *arg) {
+  WritePart *part = (WritePart *)arg;
+  if (part->count > 0 &&
+      pwrite_all(part->fd, part->out, part->out_len,
+                 part->layout->blocks[part->first].offset)) {
+    part->failed = 1;
+  }
+  return NULL;
+}
+
+int snapshot_write_parallel(int fd, HashTable *ht, uint64_t lsn,
+                            const char *parent, int compress,
+                            size_t num_threads) {
+  SnapshotLayout layout;
+  if (layout_prepare(&layout, ht, parent, compress)) {
+    return 1;
+  }
+
+  size_t num_parts = num_threads;
+  if (num_parts > layout.num_blocks) {
+    num_parts = layout.num_blocks;
+  }
+  WritePart *parts = malloc((num_parts + 1) * sizeof(WritePart));
+  size_t tail_len = layout.num_blocks * SNAPSHOT_INDEX_ENTRY_SIZE +
+                    SNAPSHOT_FOOTER_SIZE;
+  unsigned char *tail = malloc(tail_len > layout.header_len
+                                   ? tail_len
+                                   : layout.header_len);
+  if (parts == NULL || tail == NULL) {
+    free(parts);
+    free(tail);
+    layout_free(&layout);
+    return 1;
+  }
+
+  // Blocks are about the same size, each thread gets as many
+  size_t first = 0;
+  for (size_t i = 0; i < num_parts; i++) {
+    size_t stop = layout.num_blocks * (i + 1) / num_parts;
+    parts[i] = (WritePart){fd, &layout, NULL, first, stop - first, 0,
+                           NULL, 0, 0};
+    first = stop;
+  }
+  run_parts(write_blocks, parts, sizeof(WritePart), num_parts);
+
+  int failed = 0;
+  for (size_t i = 0; i < num_parts; i++) {
+    failed |= parts[i].failed;
+  }
+  if (compress) {
+    layout_place(&layout);
+    if (!failed) {
+      run_parts(write_packed, parts, sizeof(WritePart), num_parts);
+    }
+    for (size_t i = 0; i < num_parts; i++) {
+      failed |= parts[i].failed;
+      free(parts[i].out);
+    }
+  }
+
+  // The index needs the CRC of every block
+  encode_header(tail, &layout, lsn);
+  failed = failed || pwrite_all(fd, tail, layout.header_len, 0);
+  uint32_t index_crc = 0;
+  for (size_t b = 0; b < layout.num_blocks; b++) {
+    unsigned char *p = tail + b * SNAPSHOT_INDEX_ENTRY_SIZE;
+    encode_index_entry(p, &layout, &layout.blocks[b]);
+    index_crc = crc32c(index_crc, p, SNAPSHOT_INDEX_ENTRY_SIZE);
+  }
+  encode_footer(tail + tail_len - SNAPSHOT_FOOTER_SIZE, &layout, index_crc);
+  failed = failed || pwrite_all(fd, tail, tail_len, layout.index_offset);
+
+  free(parts);
+  free(tail);
+  layout_free(&layout);
+  return failed;
+}
+
+/// Writer thread of a text backup: formats a range of buckets and writes
+/// them from the part's offset.
+/// @param arg The WritePart.
+/// @return NULL
+static void *write_lines(void *arg) {
+  WritePart *part = (WritePart *)arg;
+  unsigned char *buf = malloc(SNAPSHOT_BLOCK_SIZE);
+  if (buf == NULL) {
+    part->failed = 1;
+    return NULL;
+  }
+
+  size_t len = 0;
+  uint64_t offset = part->offset;
+  for (size_t b = part->first; b < part->first + part->count; b++) {
+    for (KeyNode *node = part->ht->table[b]; node != NULL;
+         node = node->next) {
+      size_t line = pair_length(&PAIR_LINE, node->key_len, node->value_len);
+      if (SNAPSHOT_BLOCK_SIZE - len < line) {
+        part->failed |= pwrite_all(part->fd, buf, len, offset);
+        offset += len;
+        len = 0;
+      }
+      len += pair_format((char *)buf + len, &PAIR_LINE, node->key,
+                         node->key_len, node->value, node->value_len);
+    }
+  }
+  part->failed |= pwrite_all(part->fd, buf, len, offset);
+
+  free(buf);
+  return NULL;
+}
+
+int snapshot_write_text(int fd, HashTable *ht, size_t num_threads) {
+  uint64_t bytes[TABLE_SIZE];
+  uint64_t total = 0;
+  for (int b = 0; b < TABLE_SIZE; b++) {
+    bytes[b] = 0;
+    for (KeyNode *node = ht->table[b]; node != NULL; node = node->next) {
+      bytes[b] += pair_length(&PAIR_LINE, node->key_len, node->value_len);
+    }
+    total += bytes[b];
+  }
+
+  if (num_threads > TABLE_SIZE) {
+    num_threads = TABLE_SIZE;
+  }
+  WritePart parts[TABLE_SIZE];
+  size_t num_parts = 0;
+
+  // Consecutive buckets holding about total / num_threads bytes each, the
+  // file is laid out as a serial backup would be
+  uint64_t offset = 0;
+  size_t first = 0;
+  for (size_t b = 0; b < TABLE_SIZE; b++) {
+    uint64_t end = offset + bytes[b];
+    if (b + 1 == TABLE_SIZE || (num_parts + 1 < num_threads &&
+                                end >= total * (num_parts + 1) / num_threads)) {
+      parts[num_parts] =
+          (WritePart){fd, NULL, ht, first, b + 1 - first, 0, NULL, 0, 0};
+      num_parts++;
+      first = b + 1;
+    }
+    offset = end;
+  }
+  offset = 0;
+  for (size_t i = 0; i < num_parts; i++) {
+    parts[i].offset = offset;
+    for (size_t b = parts[i].first; b < parts[i].first + parts[i].count; b++) {
+      offset += bytes[b];
+    }
+  }
+  run_parts(write_lines, parts, sizeof(WritePart), num_parts);
+
+  int failed = 0;
+  for (size_t i = 0; i < num_parts; i++) {
+    failed |= parts[i].failed;
+  }
+  return failed;
+}
+
+/// Checks the header, footer and block index of a mapped binary backup.
+/// @param data Contents of the file.
+/// @param size Size of the file.
+/// @param snap Set to the backup.
+/// @return 0 if successful, 1 otherwise.
+static int snapshot_check(const unsigned char *data, size_t size,
+                          SnapshotFile *snap) {
+  if (size < SNAPSHOT_HEADER_SIZE + SNAPSHOT_FOOTER_SIZE ||
+      memcmp(data, SNAPSHOT_MAGIC, 4) != 0 ||
+      get_u16(data + 4) != SNAPSHOT_VERSION ||
+      (get_u16(data + 6) & ~(SNAPSHOT_FLAG_DELTA | SNAPSHOT_FLAG_LZ)) != 0 ||
+      memcmp(data + size - 4, SNAPSHOT_MAGIC, 4) != 0) {
+    return 1;
+  }
+
+  snap->flags = get_u16(data + 6);
+  snap->buckets = 0;
+  snap->parent = NULL;
+  snap->parent_len = 0;
+  size_t blocks_offset = SNAPSHOT_HEADER_SIZE;
+  if (snap->flags & SNAPSHOT_FLAG_DELTA) {
+    const unsigned char *delta = data + SNAPSHOT_HEADER_SIZE;
+    if (size - SNAPSHOT_HEADER_SIZE - SNAPSHOT_FOOTER_SIZE < 6) {
+      return 1;
+    }
+    snap->buckets = get_u32(delta);
+    snap->parent = (const char *)delta + 6;
+    snap->parent_len = get_u16(delta + 4);
+    blocks_offset += 6 + snap->parent_len;
+    if (snap->parent_len == 0 || snap->parent_len > SNAPSHOT_PATH_MAX ||
+        blocks_offset > size - SNAPSHOT_FOOTER_SIZE) {
+      return 1;
+    }
+  }
+
+  const unsigned char *footer = data + size - SNAPSHOT_FOOTER_SIZE;
+  uint64_t index_offset = get_u64(footer);
+  size_t num_blocks = get_u32(footer + 8);
+  size_t index_len = num_blocks * SNAPSHOT_INDEX_ENTRY_SIZE;
+  if (index_offset < blocks_offset ||
+      index_offset + index_len + SNAPSHOT_FOOTER_SIZE != size ||
+      crc32c(0, data + index_offset, index_len) != get_u32(footer + 12)) {
+    return 1;
+  }
+
+  snap->data = data;
+  snap->size = size;
+  snap->lsn = get_u64(data + 8);
+  snap->num_pairs = get_u64(data + 16);
+  snap->index = data + index_offset;
+  snap->num_blocks = num_blocks;
+  return 0;
+}
+
+int snapshot_open(const char *path, SnapshotFile *snap) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+
+  if (snapshot_check(data, size, snap)) {
+    munmap((void *)data, size);
+    return 1;
+  }
+  return 0;
+}
+
+/// Checks the CRC of a block and decompresses it if needed.
+/// @param snap The backup.
+/// @param block Index of the block.
+/// @param buf SNAPSHOT_BLOCK_MAX bytes to decompress the block to, only used
+/// with SNAPSHOT_FLAG_LZ.
+/// @param len Set to the length of the pairs.
+/// @param count Set to the number of pairs.
+/// @return The pairs of the block, in the mapping or in buf, NULL if the
+/// block is corrupted.
+static const unsigned char *decode_block(const SnapshotFile *snap,
+                                         size_t block, unsigned char *buf,
+                                         size_t *len, size_t *count) {
+  if (block >= snap->num_blocks) {
+    return NULL;
+  }
+
+  const unsigned char *entry = snap->index + block * SNAPSHOT_INDEX_ENTRY_SIZE;
+  uint64_t offset = get_u64(entry);
+  size_t block_len = get_u32(entry + 8);
+  size_t index_offset = (size_t)(snap->index - snap->data);
+  if (offset < SNAPSHOT_HEADER_SIZE || offset > index_offset ||
+      index_offset - offset < block_len ||
+      crc32c(0, snap->data + offset, block_len) != get_u32(entry + 16)) {
+    return NULL;
+  }
+
+  const unsigned char *p = snap->data + offset;
+  *count = get_u32(entry + 12);
+  *len = block_len;
+  if (snap->flags & SNAPSHOT_FLAG_LZ) {
+    size_t raw_len = block_len >= 4 ? get_u32(p) : 0;
+    if (block_len < 4 || raw_len < block_len - 4 ||
+        raw_len > SNAPSHOT_BLOCK_MAX) {
+      return NULL;
+    }
+    *len = raw_len;
+    if (raw_len == block_len - 4) {
+      // Stored as is
+      return p + 4;
+    }
+    if (lz_decompress(p + 4, block_len - 4, buf, raw_len)) {
+      return NULL;
+    }
+    return buf;
+  }
+  return p;
+}
+
+int snapshot_read_block(const SnapshotFile *snap, size_t block,
+                        snapshot_pair_t pair, void *arg) {
+  unsigned char *raw = NULL;
+  if (snap->flags & SNAPSHOT_FLAG_LZ) {
+    raw = malloc(SNAPSHOT_BLOCK_MAX);
+    if (raw == NULL) {
+      return 1;
+    }
+  }
+
+  size_t len;
+  size_t count;
+  const unsigned char *p = decode_block(snap, block, raw, &len, &count);
+  if (p == NULL) {
+    free(raw);
+    return 1;
+  }
+
+  const unsigned char *end = p + len;
+  int failed = 0;
+  for (size_t i = 0; i < count && !failed; i++) {
+    if (end - p < 2 || (size_t)(end - p - 2) < (size_t)p[0] + p[1]) {
+      failed = 1;
+      break;
+    }
+    size_t key_len = p[0];
+    size_t value_len = p[1];
+    const char *key = (const char *)p + 2;
+    failed = pair(arg, key, key_len, key + key_len, value_len) != 0;
+    p += 2 + key_len + value_len;
+  }
+
+  free(raw);
+  return failed || p != end;
+}
+
+void snapshot_close(SnapshotFile *snap) {
+  munmap((void *)snap->data, snap->size);
+  snap->data = NULL;
+}
+
+int snapshot_map(const char *path, SnapshotMap *map) {
+  if (snapshot_open(path, &map->snap)) {
+    return 1;
+  }
+  if (map->snap.flags != 0) {
+    // Deltas need their parents and compressed blocks a copy to decode
+    snapshot_close(&map->snap);
+    return 1;
+  }
+
+  // One more, calloc may fail for an empty backup
+  map->checked = calloc(map->snap.num_blocks + 1, sizeof(atomic_uchar));
+  if (map->checked == NULL) {
+    snapshot_close(&map->snap);
+    return 1;
+  }
+  // Lookups touch a block or two each, reading ahead only wastes the cache
+  posix_madvise((void *)map->snap.data, map->snap.size, POSIX_MADV_RANDOM);
+  return 0;
+}
+
+/// Compares a key with the first key of a block in the index.
+static int first_key_cmp(const unsigned char *entry, const char *key,
+                         size_t key_len) {
+  size_t first_len = entry[20];
+  size_t len = first_len < key_len ? first_len : key_len;
+  int cmp = memcmp(entry + 21, key, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (first_len > key_len) - (first_len < key_len);
+}
+
+/// Counts the blocks whose first key is not past a key, with a binary search
+/// of the block index.
+/// @param snap The backup.
+/// @param key The key, not '\0' terminated.
+/// @param key_len Length of the key.
+/// @return Number of blocks, the last of them the one that may hold the key.
+static size_t blocks_up_to(const SnapshotFile *snap, const char *key,
+                           size_t key_len) {
+  size_t low = 0;
+  size_t high = snap->num_blocks;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (first_key_cmp(snap->index + mid * SNAPSHOT_INDEX_ENTRY_SIZE, key,
+                      key_len) <= 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+size_t snapshot_seek(const SnapshotFile *snap, const char *key,
+                     size_t key_len) {
+  size_t count = blocks_up_to(snap, key, key_len);
+  return count > 0 ? count - 1 : 0;
+}
+
+int snapshot_find(SnapshotMap *map, const char *key, size_t key_len,
+                  const char **value, size_t *value_len) {
+  const SnapshotFile *snap = &map->snap;
+
+  // Last block whose first key is not past the key
+  size_t low = blocks_up_to(snap, key, key_len);
+  if (low == 0) {
+    return 1;
+  }
+  size_t block = low - 1;
+
+  const unsigned char *entry = snap->index + block * SNAPSHOT_INDEX_ENTRY_SIZE;
+  uint64_t offset = get_u64(entry);
+  size_t len = get_u32(entry + 8);
+  size_t count = get_u32(entry + 12);
+  unsigned char state = atomic_load(&map->checked[block]);
+  if (state == 0) {
+    size_t index_offset = (size_t)(snap->index - snap->data);
+    // Racing threads may both check the block, to the same result
+    state = offset >= SNAPSHOT_HEADER_SIZE && offset <= index_offset &&
+                    index_offset - offset >= len &&
+                    crc32c(0, snap->data + offset, len) == get_u32(entry + 16)
+                ? 1
+                : 2;
+    atomic_store(&map->checked[block], state);
+  }
+  if (state != 1) {
+    return -1;
+  }
+
+  const unsigned char *p = snap->data + offset;
+  const unsigned char *end = p + len;
+  for (size_t i = 0; i < count; i++) {
+    if (end - p < 2 || (size_t)(end - p - 2) < (size_t)p[0] + p[1]) {
+      return -1;
+    }
+    size_t pair_len = p[0];
+    const char *pair_key = (const char *)p + 2;
+    size_t min_len = pair_len < key_len ? pair_len : key_len;
+    int cmp = memcmp(pair_key, key, min_len);
+    if (cmp == 0) {
+      cmp = (pair_len > key_len) - (pair_len < key_len);
+    }
+    if (cmp == 0) {
+      *value = pair_key + pair_len;
+      *value_len = p[1];
+      return 0;
+    } else if (cmp > 0) {
+      // Pairs are sorted, the key would have come before
+      return 1;
+    }
+    p += 2 + pair_len + p[1];
+  }
+  return 1;
+}
+
+void snapshot_unmap(SnapshotMap *map) {
+  snapshot_close(&map->snap);
+  free(map->checked);
+  map->checked = NULL;
+}
+
+/// Copies a string that is not '\0' terminated.
+static char *copy_str(const char *str, size_t len) {
+  char *copy = malloc(len + 1);
+  if (copy != NULL) {
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+/// Creates a node and appends it to its bucket's chain of a part.
+/// @param arg The SnapshotPart.
+/// @return 0 if successful, 1 if the key has no bucket or memory ran out.
+static int part_add(void *arg, const char *key, size_t key_len,
+                    const char *value, size_t value_len) {
+  SnapshotPart *part = (SnapshotPart *)arg;
+  KeyNode *node = malloc(sizeof(KeyNode));
+  if (node == NULL) {
+    return 1;
+  }
+  node->key_len = key_len;
+  node->value_len = value_len;
+  node->key = copy_str(key, key_len);
+  node->value = copy_str(value, value_len);
+  node->next = NULL;
+
+  int index = key_len > 0 && node->key != NULL ? hash(node->key) : -1;
+  if (index >= 0 && part->snap != NULL &&
+      (part->snap->flags & SNAPSHOT_FLAG_DELTA) &&
+      !(part->snap->buckets & (uint32_t)1 << index)) {
+    // Outside of the buckets of the delta
+    index = -1;
+  }
+  if (node->value == NULL || index < 0) {
+    free(node->key);
+    free(node->value);
+    free(node);
+    return 1;
+  }
+
+  if (part->tails[index] == NULL) {
+    part->heads[index] = node;
+  } else {
+    part->tails[index]->next = node;
+  }
+  part->tails[index] = node;
+  part->count++;
+  return 0;
+}
+
+/// Parses a line "(key, value)".
+/// @param part Part the line belongs to.
+/// @param line Start of the line.
+/// @param end The line's '\n'.
+/// @return 0 if successful, 1 if the line is malformed.
+static int parse_line(SnapshotPart *part, const char *line, const char *end) {
+  if (end - line < 5 || line[0] != '(' || end[-1] != ')') {
+    return 1;
+  }
+
+  // Keys hold no ',', values may
+  const char *key = line + 1;
+  const char *sep = memchr(key, ',', (size_t)(end - key));
+  if (sep == NULL || sep == key || sep + 1 >= end || sep[1] != ' ') {
+    return 1;
+  }
+  const char *value = sep + 2;
+
+  return part_add(part, key, (size_t)(sep - key), value,
+                  (size_t)(end - 1 - value));
+}
+
+static void free_chain(KeyNode *node) {
+  while (node != NULL) {
+    KeyNode *next = node->next;
+    free(node->key);
+    free(node->value);
+    free(node);
+    node = next;
+  }
+}
+
+/// Parser thread: turns the lines or blocks of a part into per-bucket
+/// chains.
+/// @param arg The SnapshotPart.
+/// @return NULL
+static void *parse_part(void *arg) {
+  SnapshotPart *part = (SnapshotPart *)arg;
+
+  if (part->snap != NULL) {
+    for (size_t i = 0; i < part->num_blocks; i++) {
+      if (snapshot_read_block(part->snap, part->first_block + i, part_add,
+                              part)) {
+        part->failed = 1;
+        return NULL;
+      }
+    }
+    return NULL;
+  }
+
+  const char *line = part->begin;
+  while (line < part->end) {
+    const char *nl = memchr(line, '\n', (size_t)(part->end - line));
+    if (nl == NULL || parse_line(part, line, nl)) {
+      part->failed = 1;
+      return NULL;
+    }
+    line = nl + 1;
+  }
+
+  return NULL;
+}
+
+/// Splits a mapped text backup into parts that start at a line.
+/// @return Number of parts.
+static size_t split_lines(const char *data, size_t size, SnapshotPart *parts,
+                          size_t num_parts) {
+  size_t count = 0;
+  const char *begin = data;
+  const char *end = data + size;
+
+  for (size_t i = 0; i < num_parts && begin < end; i++) {
+    const char *stop = end;
+    if (i + 1 < num_parts) {
+      stop = data + size / num_parts * (i + 1);
+      if (stop <= begin) {
+        continue;
+      }
+      const char *nl = memchr(stop, '\n', (size_t)(end - stop));
+      stop = nl == NULL ? end : nl + 1;
+    }
+
+    memset(&parts[count], 0, sizeof(SnapshotPart));
+    parts[count].begin = begin;
+    parts[count].end = stop;
+    count++;
+    begin = stop;
+  }
+
+  return count;
+}
+
+/// Splits the blocks of a binary backup into parts of consecutive blocks.
+/// @return Number of parts.
+static size_t split_blocks(const SnapshotFile *snap, SnapshotPart *parts,
+                           size_t num_parts) {
+  if (num_parts > snap->num_blocks) {
+    num_parts = snap->num_blocks;
+  }
+
+  size_t first = 0;
+  for (size_t i = 0; i < num_parts; i++) {
+    size_t stop = snap->num_blocks * (i + 1) / num_parts;
+    memset(&parts[i], 0, sizeof(SnapshotPart));
+    parts[i].snap = snap;
+    parts[i].first_block = first;
+    parts[i].num_blocks = stop - first;
+    first = stop;
+  }
+
+  return num_parts;
+}
+
+/// Loads a backup into a table holding the state of its parent, if any.
+/// @param depth Number of backups of the chain already being loaded.
+/// @return 0 if successful, 1 otherwise, leaving the table partly loaded.
+static int load_chain(HashTable *ht, const char *path, size_t num_threads,
+                      int depth) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size == 0) {
+    // The text backup of an empty table
+    close(fd);
+    return 0;
+  }
+
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  posix_madvise((void *)data, size, POSIX_MADV_WILLNEED);
+
+  SnapshotFile snap;
+  int binary = size >= 4 && memcmp(data, SNAPSHOT_MAGIC, 4) == 0;
+  if (binary ? snapshot_check((const unsigned char *)data, size, &snap)
+             : data[size - 1] != '\n') {
+    munmap((void *)data, size);
+    return 1;
+  }
+
+  int delta = binary && (snap.flags & SNAPSHOT_FLAG_DELTA);
+  if (delta) {
+    char *parent = copy_str(snap.parent, snap.parent_len);
+    int failed = parent == NULL || depth + 1 >= SNAPSHOT_MAX_CHAIN ||
+                 load_chain(ht, parent, num_threads, depth + 1);
+    free(parent);
+    if (failed) {
+      munmap((void *)data, size);
+      return 1;
+    }
+  }
+
+  size_t num_parts = size / SNAPSHOT_MIN_PART + 1;
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  if (num_parts > num_threads) {
+    num_parts = num_threads;
+  }
+
+  SnapshotPart *parts = malloc(num_parts * sizeof(SnapshotPart));
+  if (parts == NULL) {
+    munmap((void *)data, size);
+    return 1;
+  }
+  num_parts = binary ? split_blocks(&snap, parts, num_parts)
+                     : split_lines(data, size, parts, num_parts);
+
+  run_parts(parse_part, parts, sizeof(SnapshotPart), num_parts);
+
+  int failed = 0;
+  uint64_t count = 0;
+  for (size_t i = 0; i < num_parts; i++) {
+    failed |= parts[i].failed;
+    count += parts[i].count;
+  }
+  if (binary && count != snap.num_pairs) {
+    failed = 1;
+  }
+
+  // Each bucket gets the chains of the parts in file order, a delta's
+  // replacing what its parents held
+  for (int b = 0; b < TABLE_SIZE; b++) {
+    if (!failed && delta && (snap.buckets & (uint32_t)1 << b)) {
+      free_chain(ht->table[b]);
+      ht->table[b] = NULL;
+    }
+    for (size_t i = num_parts; i-- > 0;) {
+      if (parts[i].heads[b] == NULL) {
+        continue;
+      }
+      if (failed) {
+        free_chain(parts[i].heads[b]);
+        continue;
+      }
+      parts[i].tails[b]->next = ht->table[b];
+      ht->table[b] = parts[i].heads[b];
+    }
+  }
+
+  free(parts);
+  munmap((void *)data, size);
+  return failed;
+}
+
+int snapshot_load(HashTable *ht, const char *path, size_t num_threads) {
+  if (load_chain(ht, path, num_threads, 0) == 0) {
+    return 0;
+  }
+
+  // A chain may have failed after its first backups were loaded
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    free_chain(ht->table[i]);
+    ht->table[i] = NULL;
+  }
+  return 1;
+}
+
+/// Reads the pairs a backup of a chain still holds, those of the buckets
+/// no newer delta replaced, in key order.
+typedef struct ChainCursor {
+  SnapshotFile snap;
+  uint32_t buckets;         // Buckets read from this backup
+  size_t block;             // Next block to decode
+  unsigned char *buf;       // Decompressed block, with SNAPSHOT_FLAG_LZ
+  const unsigned char *p;   // Current pair, NULL before the first and after
+  const unsigned char *end; // the last
+  size_t left;              // Pairs of the block from p on
+} ChainCursor;
+
+/// Moves a cursor past its current pair, to the next one of a bucket it
+/// reads.
+/// @return 0 if successful, 1 if a block is corrupted.
+static int cursor_next(ChainCursor *cursor) {
+  if (cursor->p != NULL && cursor->left > 0) {
+    // The current pair was checked when it was reached
+    cursor->p += 2 + cursor->p[0] + cursor->p[1];
+    cursor->left--;
+  }
+
+  while (1) {
+    if (cursor->left == 0) {
+      if (cursor->p != NULL && cursor->p != cursor->end) {
+        return 1;
+      }
+      if (cursor->block == cursor->snap.num_blocks) {
+        cursor->p = NULL;
+        return 0;
+      }
+      size_t len;
+      cursor->p = decode_block(&cursor->snap, cursor->block++, cursor->buf,
+                               &len, &cursor->left);
+      if (cursor->p == NULL) {
+        return 1;
+      }
+      cursor->end = cursor->p + len;
+      continue;
+    }
+
+    const unsigned char *p = cursor->p;
+    if (cursor->end - p < 2 || p[0] == 0 || p[0] >= MAX_STRING_SIZE ||
+        (size_t)(cursor->end - p - 2) < (size_t)p[0] + p[1]) {
+      return 1;
+    }
+    int bucket = hash((const char *)p + 2);
+    if (bucket >= 0 && cursor->buckets & (uint32_t)1 << bucket) {
+      return 0;
+    }
+    cursor->p += 2 + p[0] + p[1];
+    cursor->left--;
+  }
+}
+
+/// Orders the current pairs of two cursors by key, bytewise.
+static int cursor_cmp(const ChainCursor *a, const ChainCursor *b) {
+  size_t len = a->p[0] < b->p[0] ? a->p[0] : b->p[0];
+  int cmp = memcmp(a->p + 2, b->p + 2, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (a->p[0] > b->p[0]) - (a->p[0] < b->p[0]);
+}
+
+/// A full binary backup written pair by pair, in key order, so it needs no
+/// table.
+typedef struct SnapshotStream {
+  UringWriter *writer;
+  int compress;            // 1 to compress blocks, see SNAPSHOT_FLAG_LZ
+  unsigned char *raw;      // u32 len | pairs of the block being filled
+  unsigned char *packed;   // Compressed block
+  size_t len;              // Bytes of pairs in raw
+  size_t count;            // Pairs in raw
+  uint64_t offset;         // Where the block being filled goes
+  unsigned char *index;    // Entries of the blocks written
+  size_t num_blocks;
+  size_t cap;
+  uint64_t num_pairs;
+} SnapshotStream;
+
+/// Writes the block being filled and adds its index entry.
+/// @return 0 if successful, 1 otherwise.
+static int stream_flush(SnapshotStream *stream) {
+  if (stream->count == 0) {
+    return 0;
+  }
+
+  if (stream->num_blocks == stream->cap) {
+    size_t cap = stream->cap > 0 ? stream->cap * 2 : 64;
+    unsigned char *index = realloc(stream->index,
+                                   cap * SNAPSHOT_INDEX_ENTRY_SIZE);
+    if (index == NULL) {
+      return 1;
+    }
+    stream->index = index;
+    stream->cap = cap;
+  }
+
+  const unsigned char *data = stream->raw + 4;
+  size_t len = stream->len;
+  if (stream->compress) {
+    // Kept as is unless it shrinks
+    size_t packed_len =
+        lz_compress(stream->raw + 4, len, stream->packed + 4, len - 1);
+    put_u32(stream->raw, (uint32_t)len);
+    put_u32(stream->packed, (uint32_t)len);
+    data = packed_len > 0 ? stream->packed : stream->raw;
+    len = 4 + (packed_len > 0 ? packed_len : len);
+  }
+
+  // A block may be larger than a reservation
+  for (size_t done = 0; done < len;) {
+    size_t chunk = len - done < 4096 ? len - done : 4096;
+    memcpy(uring_writer_reserve(stream->writer, chunk), data + done, chunk);
+    done += chunk;
+  }
+
+  unsigned char *entry =
+      stream->index + stream->num_blocks++ * SNAPSHOT_INDEX_ENTRY_SIZE;
+  const unsigned char *first = stream->raw + 4;
+  memset(entry, 0, SNAPSHOT_INDEX_ENTRY_SIZE);
+  put_u64(entry, stream->offset);
+  put_u32(entry + 8, (uint32_t)len);
+  put_u32(entry + 12, (uint32_t)stream->count);
+  put_u32(entry + 16, crc32c(0, data, len));
+  entry[20] = first[0];
+  memcpy(entry + 21, first + 2, first[0]);
+
+  stream->offset += len;
+  stream->len = 0;
+  stream->count = 0;
+  return 0;
+}
+
+/// Adds a pair, cutting blocks as snapshot_write does.
+/// @param pair The encoded pair, checked already.
+/// @return 0 if successful, 1 otherwise.
+static int stream_add(SnapshotStream *stream, const unsigned char *pair) {
+  size_t len = 2 + (size_t)pair[0] + pair[1];
+  memcpy(stream->raw + 4 + stream->len, pair, len);
+  stream->len += len;
+  stream->count++;
+  stream->num_pairs++;
+  return stream->len >= SNAPSHOT_BLOCK_SIZE ? stream_flush(stream) : 0;
+}
+
+int snapshot_compact(const char *path, const char *out_path) {
+  ChainCursor *chain = calloc(SNAPSHOT_MAX_CHAIN, sizeof(ChainCursor));
+  if (chain == NULL) {
+    return 1;
+  }
+
+  // The chain from the newest backup back to its full root
+  size_t length = 0;
+  int failed = 0;
+  char *next = strdup(path);
+  while (next != NULL && !failed) {
+    ChainCursor *cursor = &chain[length];
+    failed = length == SNAPSHOT_MAX_CHAIN ||
+             snapshot_open(next, &cursor->snap) != 0;
+    free(next);
+    next = NULL;
+    if (failed) {
+      break;
+    }
+    length++;
+    if (cursor->snap.flags & SNAPSHOT_FLAG_LZ) {
+      cursor->buf = malloc(SNAPSHOT_BLOCK_MAX);
+      failed = cursor->buf == NULL;
+    }
+    if (cursor->snap.flags & SNAPSHOT_FLAG_DELTA) {
+      next = copy_str(cursor->snap.parent, cursor->snap.parent_len);
+      failed |= next == NULL;
+    }
+  }
+  free(next);
+
+  // Each bucket is read from the newest backup holding it
+  uint32_t taken = 0;
+  for (size_t i = 0; i < length; i++) {
+    uint32_t held = chain[i].snap.flags & SNAPSHOT_FLAG_DELTA
+                        ? chain[i].snap.buckets
+                        : ((uint32_t)1 << (TABLE_SIZE - 1) << 1) - 1;
+    chain[i].buckets = held & ~taken;
+    taken |= held;
+  }
+
+  SnapshotStream stream = {NULL, 0, NULL, NULL, 0, 0, SNAPSHOT_HEADER_SIZE,
+                           NULL, 0, 0, 0};
+  stream.compress = length > 0 && (chain[0].snap.flags & SNAPSHOT_FLAG_LZ);
+  stream.raw = malloc(4 + SNAPSHOT_BLOCK_MAX);
+  stream.packed = malloc(4 + SNAPSHOT_BLOCK_MAX);
+  failed |= stream.raw == NULL || stream.packed == NULL;
+
+  int fd = failed ? -1 : open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  failed |= fd == -1;
+  if (!failed) {
+    UringWriter *writer = malloc(sizeof(UringWriter));
+    failed = writer == NULL;
+    if (!failed) {
+      uring_writer_init(writer, fd, uring_active());
+      stream.writer = writer;
+
+      // The header is rewritten once the number of pairs is known
+      memset(uring_writer_reserve(writer, SNAPSHOT_HEADER_SIZE), 0,
+             SNAPSHOT_HEADER_SIZE);
+      for (size_t i = 0; i < length && !failed; i++) {
+        failed = cursor_next(&chain[i]);
+      }
+
+      // k-way merge of the backups' pairs, which share no key
+      while (!failed) {
+        ChainCursor *min = NULL;
+        for (size_t i = 0; i < length; i++) {
+          if (chain[i].p != NULL &&
+              (min == NULL || cursor_cmp(&chain[i], min) < 0)) {
+            min = &chain[i];
+          }
+        }
+        if (min == NULL) {
+          break;
+        }
+        failed = stream_add(&stream, min->p) || cursor_next(min);
+      }
+      failed = failed || stream_flush(&stream);
+
+      if (!failed) {
+        uint32_t index_crc = 0;
+        for (size_t b = 0; b < stream.num_blocks; b++) {
+          unsigned char *p = (unsigned char *)uring_writer_reserve(
+              writer, SNAPSHOT_INDEX_ENTRY_SIZE);
+          memcpy(p, stream.index + b * SNAPSHOT_INDEX_ENTRY_SIZE,
+                 SNAPSHOT_INDEX_ENTRY_SIZE);
+          index_crc = crc32c(index_crc, p, SNAPSHOT_INDEX_ENTRY_SIZE);
+        }
+        unsigned char *p = (unsigned char *)uring_writer_reserve(
+            writer, SNAPSHOT_FOOTER_SIZE);
+        put_u64(p, stream.offset);
+        put_u32(p + 8, (uint32_t)stream.num_blocks);
+        put_u32(p + 12, index_crc);
+        memcpy(p + 16, SNAPSHOT_MAGIC, 4);
+      }
+      failed |= uring_writer_finish(writer);
+      free(writer);
+    }
+  }
+
+  if (!failed) {
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    memcpy(header, SNAPSHOT_MAGIC, 4);
+    put_u16(header + 4, SNAPSHOT_VERSION);
+    put_u16(header + 6, (uint16_t)(stream.compress ? SNAPSHOT_FLAG_LZ : 0));
+    put_u64(header + 8, chain[0].snap.lsn);
+    put_u64(header + 16, stream.num_pairs);
+    failed = pwrite_all(fd, header, SNAPSHOT_HEADER_SIZE, 0) ||
+             fdatasync(fd) != 0;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (failed && fd != -1) {
+    unlink(out_path);
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    snapshot_close(&chain[i].snap);
+    free(chain[i].buf);
+  }
+  free(chain);
+  free(stream.raw);
+  free(stream.packed);
+  free(stream.index);
+  return failed;
+}
@@ -0,0 +1,191 @@
+#ifndef KVS_SNAPSHOT_H
+#define KVS_SNAPSHOT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "kvs.h"
+#include "uring.h"
+
+#define SNAPSHOT_MIN_PART 65536 // Smallest part of a backup given a thread
+
+/// Binary backups (-B) hold the pairs of the table sorted by key, in blocks
+/// that are checked and decoded independently, so they load in parallel
+/// straight from a mapping of the file. kvsdump prints them as text.
+///
+/// Layout, multi-byte fields in little-endian:
+///   header:  "KVSB" | u16 version | u16 flags | u64 lsn | u64 num_pairs
+///   delta:   u32 bucket mask | u16 parent_len | parent path, only with
+///            SNAPSHOT_FLAG_DELTA
+///   blocks:  num_pairs x (u8 klen | u8 vlen | key | value), cut into
+///            blocks of about SNAPSHOT_BLOCK_SIZE bytes; with
+///            SNAPSHOT_FLAG_LZ each block is u32 len of the pairs | the
+///            pairs compressed by lz_compress, or as is if that is no
+///            smaller
+///   index:   num_blocks x (u64 offset | u32 len | u32 count |
+///            u32 crc32c of the block as stored | u8 klen | first key,
+///            padded to MAX_STRING_SIZE - 1 bytes)
+///   footer:  u64 index offset | u32 num_blocks | u32 crc32c of the index |
+///            "KVSB"
+/// lsn is the last WAL record included, 0 without a WAL.
+///
+/// A delta backup only holds the buckets in its mask, those changed since
+/// its parent backup was taken, whole: a key of such a bucket missing from
+/// the delta was deleted. The table is rebuilt by loading the full backup at
+/// the root of the chain, then replacing the buckets of each delta in turn.
+#define SNAPSHOT_MAGIC "KVSB"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 24
+#define SNAPSHOT_FOOTER_SIZE 20
+#define SNAPSHOT_INDEX_ENTRY_SIZE (20 + MAX_STRING_SIZE)
+#define SNAPSHOT_BLOCK_SIZE 65536
+#define SNAPSHOT_FLAG_DELTA 1
+#define SNAPSHOT_FLAG_LZ 2
+#define SNAPSHOT_PATH_MAX 4096 // Longest parent path of a delta
+#define SNAPSHOT_MAX_CHAIN 64  // Most backups loaded to rebuild a table
+
+#if TABLE_SIZE > 32
+#error "The bucket mask of a delta backup holds 32 buckets"
+#endif
+
+/// A mapped binary backup.
+typedef struct SnapshotFile {
+  const unsigned char *data; // Contents of the file
+  size_t size;               // Size of the file
+  uint64_t lsn;              // Last WAL record included
+  uint64_t num_pairs;        // Number of pairs in the blocks
+  unsigned int flags;        // SNAPSHOT_FLAG_* of the header
+  uint32_t buckets;          // Buckets held by a delta, 1 << bucket each
+  const char *parent;        // Parent of a delta, not '\0' terminated
+  size_t parent_len;
+  const unsigned char *index; // First entry of the block index
+  size_t num_blocks;
+} SnapshotFile;
+
+/// A full, uncompressed binary backup whose pairs are looked up in place,
+/// straight from the mapping, instead of being loaded into a table.
+typedef struct SnapshotMap {
+  SnapshotFile snap;
+  atomic_uchar *checked; // Per block: 0 if not read yet, 1 valid, 2 corrupted
+} SnapshotMap;
+
+/// Callback for each pair of a block. The strings are not '\0' terminated.
+/// @param arg Argument given to snapshot_read_block.
+/// @return 0 to go on, 1 to stop.
+typedef int (*snapshot_pair_t)(void *arg, const char *key, size_t key_len,
+                               const char *value, size_t value_len);
+
+/// Writes a binary backup of a table. Memory comes from mmap, so it is async
+/// signal safe and may run in a backup child.
+/// @param writer Writer of the backup file.
+/// @param ht The table, not modified meanwhile.
+/// @param lsn Last WAL record included in the table, 0 without a WAL.
+/// @param parent NULL for a full backup, else the path of the previous
+/// backup, making this a delta of the buckets marked in ht->dirty.
+/// @param compress 1 to compress the blocks.
+/// @return 0 if successful, 1 otherwise.
+int snapshot_write(UringWriter *writer, HashTable *ht, uint64_t lsn,
+                   const char *parent, int compress);
+
+/// Writes a binary backup of a table with several threads, each encoding a
+/// range of blocks and writing it at its offset, so the file is the one
+/// snapshot_write would write. Compressed blocks are written once all are
+/// compressed, when their offsets are known.
+/// @param fd File to write, from offset 0.
+/// @param ht The table, not modified meanwhile.
+/// @param lsn Last WAL record included in the table, 0 without a WAL.
+/// @param parent NULL for a full backup, else the parent of a delta.
+/// @param compress 1 to compress the blocks.
+/// @param num_threads Number of writer threads.
+/// @return 0 if successful, 1 otherwise.
+int snapshot_write_parallel(int fd, HashTable *ht, uint64_t lsn,
+                            const char *parent, int compress,
+                            size_t num_threads);
+
+/// Writes a text backup of a table with several threads, each formatting a
+/// range of buckets and writing it at the offset the serial backup gives it.
+/// @param fd File to write, from offset 0.
+/// @param ht The table, not modified meanwhile.
+/// @param num_threads Number of writer threads.
+/// @return 0 if successful, 1 otherwise.
+int snapshot_write_text(int fd, HashTable *ht, size_t num_threads);
+
+/// Maps a binary backup and checks its header, footer and block index.
+/// @param path Path of the backup.
+/// @param snap Set to the mapped backup.
+/// @return 0 if successful, 1 otherwise.
+int snapshot_open(const char *path, SnapshotFile *snap);
+
+/// Checks the CRC of a block of a binary backup, decompresses it if needed
+/// and decodes its pairs.
+/// @param snap The backup.
+/// @param block Index of the block.
+/// @param pair Called for each pair, in key order.
+/// @param arg Passed to pair.
+/// @return 0 if successful, 1 if the block is corrupted or pair stopped.
+int snapshot_read_block(const SnapshotFile *snap, size_t block,
+                        snapshot_pair_t pair, void *arg);
+
+/// Finds the first block of a binary backup that may hold a key or the keys
+/// sorted after it, to read the pairs from a key on.
+/// @param snap The backup.
+/// @param key The key, not '\0' terminated.
+/// @param key_len Length of the key.
+/// @return Index of the block, 0 for a backup without blocks.
+size_t snapshot_seek(const SnapshotFile *snap, const char *key,
+                     size_t key_len);
+
+/// Unmaps a binary backup.
+/// @param snap The backup.
+void snapshot_close(SnapshotFile *snap);
+
+/// Writes the full backup a chain of deltas adds up to, so it loads without
+/// its parents. The backups of the chain are merged as they are read, block
+/// by block, which keeps memory bounded whatever their size: each bucket is
+/// read from the newest backup holding it, and their pairs, already sorted,
+/// are merged in key order. The blocks are compressed if the newest backup's
+/// are, and the file is the one snapshot_write would write of the table.
+/// @param path The newest backup of the chain, binary.
+/// @param out_path File to write, removed on failure.
+/// @return 0 if successful, 1 otherwise.
+int snapshot_compact(const char *path, const char *out_path);
+
+/// Maps a full, uncompressed binary backup to look its pairs up in place.
+/// Blocks are only read, and their CRC checked, when a lookup reaches them,
+/// so mapping is quick whatever the size of the backup.
+/// @param path Path of the backup.
+/// @param map Set to the mapped backup.
+/// @return 0 if successful, 1 otherwise.
+int snapshot_map(const char *path, SnapshotMap *map);
+
+/// Looks a key up in a mapped backup, with a binary search of the block
+/// index and a scan of the one block that may hold it. Thread safe.
+/// @param map The backup.
+/// @param key The key, not '\0' terminated.
+/// @param key_len Length of the key.
+/// @param value Set to the value, in the mapping and not '\0' terminated.
+/// @param value_len Set to the length of the value.
+/// @return 0 if the key was found, 1 if it is missing, -1 if the block that
+/// would hold it is corrupted.
+int snapshot_find(SnapshotMap *map, const char *key, size_t key_len,
+                  const char **value, size_t *value_len);
+
+/// Unmaps a backup mapped by snapshot_map.
+/// @param map The backup.
+void snapshot_unmap(SnapshotMap *map);
+
+/// Loads a backup, text or binary, into an empty table. The file is mapped
+/// and split into parts, lines or blocks, parsed by parallel threads, then
+/// each part's pairs are linked into the buckets in file order, so the table
+/// lists its pairs as the backup did. A delta backup first loads its chain
+/// of parents.
+/// @param ht The table, empty and not shared yet.
+/// @param path Path of the backup.
+/// @param num_threads Number of threads to parse with.
+/// @return 0 if successful, 1 if the file is missing or malformed, leaving
+/// the table empty.
+int snapshot_load(HashTable *ht, const char *path, size_t num_threads);
+
+#endif // KVS_SNAPSHOT_H
@@ -0,0 +1,120 @@
+// MAP_ANONYMOUS is not part of strict POSIX
+#define _DEFAULT_SOURCE
+
+#include "throttle.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define NS_PER_SEC 1000000000ULL
+
+/// State of the bucket, shared with the backup children. Every field is
+/// lock free, so the children may use it without a mutex.
+typedef struct ThrottleState {
+  atomic_ullong rate;     // Bytes per second let through now
+  atomic_ullong next;     // When the bytes taken so far are paid for
+  atomic_ullong latency;  // Moving average of job output writes, in ns
+  atomic_ullong adjusted; // When the rate last changed, or was checked
+} ThrottleState;
+
+static ThrottleState *state = NULL; // NULL without a limit
+static uint64_t max_rate = 0;
+
+/// Reads the monotonic clock. Async signal safe.
+/// @return The time in nanoseconds.
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+int throttle_init(size_t rate) {
+  if (rate == 0) {
+    return 0;
+  }
+
+  void *shared = mmap(NULL, sizeof(ThrottleState), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    return 1;
+  }
+  state = (ThrottleState *)shared;
+  max_rate = rate;
+  atomic_init(&state->rate, max_rate);
+  atomic_init(&state->next, 0);
+  atomic_init(&state->latency, 0);
+  atomic_init(&state->adjusted, now_ns());
+  return 0;
+}
+
+/// Changes the rate, at most once per THROTTLE_ADJUST_NS across threads and
+/// processes.
+/// @param now The current time.
+/// @param slow 1 if a job output write was slow, 0 if it was fast.
+static void adjust_rate(uint64_t now, int slow) {
+  uint64_t adjusted = atomic_load(&state->adjusted);
+  if (now - adjusted < THROTTLE_ADJUST_NS ||
+      !atomic_compare_exchange_strong(&state->adjusted, &adjusted, now)) {
+    return;
+  }
+
+  uint64_t step = max_rate / THROTTLE_STEPS > 0 ? max_rate / THROTTLE_STEPS : 1;
+  uint64_t rate = atomic_load(&state->rate);
+  if (now - adjusted >= THROTTLE_IDLE_NS) {
+    // Nothing to make room for
+    rate = max_rate;
+  } else if (slow) {
+    rate = rate / 2 > step ? rate / 2 : step;
+  } else {
+    rate = rate + step < max_rate ? rate + step : max_rate;
+  }
+  atomic_store(&state->rate, rate);
+}
+
+void throttle_take(size_t len) {
+  if (state == NULL || len == 0) {
+    return;
+  }
+
+  uint64_t now = now_ns();
+  if (now - atomic_load(&state->adjusted) >= THROTTLE_IDLE_NS) {
+    adjust_rate(now, 0);
+  }
+
+  // The bytes are paid for in time at the current rate, after those taken
+  // before, and may run ahead of the clock by up to THROTTLE_BURST_NS
+  uint64_t cost = (uint64_t)len * NS_PER_SEC / atomic_load(&state->rate);
+  uint64_t next = atomic_load(&state->next);
+  uint64_t paid;
+  do {
+    paid = (next > now ? next : now) + cost;
+  } while (!atomic_compare_exchange_weak(&state->next, &next, paid));
+
+  if (paid - now > THROTTLE_BURST_NS) {
+    uint64_t wait = paid - now - THROTTLE_BURST_NS;
+    struct timespec delay = {(time_t)(wait / NS_PER_SEC),
+                             (long)(wait % NS_PER_SEC)};
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+    }
+  }
+}
+
+uint64_t throttle_start(void) { return state != NULL ? now_ns() : 0; }
+
+void throttle_observe(uint64_t start) {
+  if (state == NULL || start == 0) {
+    return;
+  }
+
+  uint64_t now = now_ns();
+  uint64_t latency = now - start;
+  uint64_t average = atomic_load(&state->latency);
+  int slow = average > 0 && latency > THROTTLE_SLOW_NS &&
+             latency > THROTTLE_SLOW_FACTOR * average;
+  // Averaged over about the last 8 writes, racing updates lose a sample
+  atomic_store(&state->latency,
+               average > 0 ? average - average / 8 + latency / 8 : latency);
+  adjust_rate(now, slow);
+}
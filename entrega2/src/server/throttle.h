@@ -0,0 +1,44 @@
+#ifndef KVS_THROTTLE_H
+#define KVS_THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define THROTTLE_BURST_NS 50000000ULL    // Writes let through at once, in time
+#define THROTTLE_ADJUST_NS 50000000ULL   // Least time between rate changes
+#define THROTTLE_IDLE_NS 1000000000ULL   // Without job output, full rate
+#define THROTTLE_SLOW_NS 2000000ULL      // Output writes never seen as slow
+#define THROTTLE_SLOW_FACTOR 4 // An output write this many times the average
+                               // is slow
+#define THROTTLE_STEPS 16      // Rate added back per fast period, and the
+                               // least rate, as a fraction of the limit
+#define THROTTLE_CHUNK 65536   // Most bytes written per throttle_take
+
+/// Bounds the rate backups are written at with a token bucket shared by
+/// every backup writer, snapshot threads and backup children alike, so a
+/// large backup leaves the disk to the jobs writing their output. The rate
+/// follows the latency of job output writes: it is halved when one takes
+/// THROTTLE_SLOW_FACTOR times longer than usual, grows back by a step per
+/// THROTTLE_ADJUST_NS while they are fast and returns to the limit when no
+/// job writes output for THROTTLE_IDLE_NS.
+
+/// Sets up the bucket, in memory shared with the backup children. Called
+/// before any backup is written.
+/// @param rate Most bytes written per second, 0 for no limit.
+/// @return 0 if successful, 1 otherwise.
+int throttle_init(size_t rate);
+
+/// Waits until len bytes of a backup may be written. Async signal safe.
+/// @param len Number of bytes, at most THROTTLE_CHUNK for an even rate.
+void throttle_take(size_t len);
+
+/// Tells when a job output write starts.
+/// @return The time to give throttle_observe, 0 if backups are not
+/// throttled.
+uint64_t throttle_start(void);
+
+/// Records how long a job output write took, adjusting the rate.
+/// @param start What throttle_start returned before the write.
+void throttle_observe(uint64_t start);
+
+#endif // KVS_THROTTLE_H
@@ -0,0 +1,150 @@
+#include "timers.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Compares two deadlines.
+/// @return 1 if a is earlier than b, 0 otherwise.
+static int earlier(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void heap_swap(Timer *heap, size_t i, size_t j) {
+  Timer tmp = heap[i];
+  heap[i] = heap[j];
+  heap[j] = tmp;
+}
+
+/// Removes the earliest timer of the heap, which must not be empty.
+/// @param timers The queue, locked.
+/// @return The removed timer.
+static Timer heap_pop(TimerQueue *timers) {
+  Timer *heap = timers->heap;
+  Timer top = heap[0];
+  heap[0] = heap[--timers->count];
+
+  size_t i = 0;
+  while (1) {
+    size_t min = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < timers->count &&
+        earlier(&heap[left].deadline, &heap[min].deadline)) {
+      min = left;
+    }
+    if (right < timers->count &&
+        earlier(&heap[right].deadline, &heap[min].deadline)) {
+      min = right;
+    }
+    if (min == i) {
+      break;
+    }
+    heap_swap(heap, i, min);
+    i = min;
+  }
+
+  return top;
+}
+
+/// Timer thread: waits for the earliest deadline and fires the expired
+/// timers.
+/// @param arg The TimerQueue to serve.
+/// @return NULL
+static void *timers_thread(void *arg) {
+  TimerQueue *timers = (TimerQueue *)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  pthread_mutex_lock(&timers->lock);
+  while (1) {
+    if (timers->count == 0) {
+      pthread_cond_wait(&timers->cond, &timers->lock);
+      continue;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (earlier(&now, &timers->heap[0].deadline)) {
+      pthread_cond_timedwait(&timers->cond, &timers->lock,
+                             &timers->heap[0].deadline);
+      continue;
+    }
+
+    Timer timer = heap_pop(timers);
+    pthread_mutex_unlock(&timers->lock);
+    timers->fire(timer.item);
+    pthread_mutex_lock(&timers->lock);
+  }
+
+  return NULL;
+}
+
+int timers_init(TimerQueue *timers, void (*fire)(void *item)) {
+  timers->heap = NULL;
+  timers->count = 0;
+  timers->cap = 0;
+  timers->fire = fire;
+  pthread_mutex_init(&timers->lock, NULL);
+
+  // Deadlines are on the monotonic clock, immune to changes of the time
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timers->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&timers->thread, NULL, timers_thread, timers) != 0) {
+    pthread_mutex_destroy(&timers->lock);
+    pthread_cond_destroy(&timers->cond);
+    return 1;
+  }
+
+  pthread_detach(timers->thread);
+  return 0;
+}
+
+int timers_add(TimerQueue *timers, unsigned int delay_ms, void *item) {
+  Timer timer = {.item = item};
+  clock_gettime(CLOCK_MONOTONIC, &timer.deadline);
+  timer.deadline.tv_sec += delay_ms / 1000;
+  timer.deadline.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+  if (timer.deadline.tv_nsec >= 1000000000) {
+    timer.deadline.tv_sec++;
+    timer.deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&timers->lock);
+  if (timers->count == timers->cap) {
+    size_t cap = timers->cap == 0 ? 16 : 2 * timers->cap;
+    Timer *heap = realloc(timers->heap, cap * sizeof(Timer));
+    if (heap == NULL) {
+      pthread_mutex_unlock(&timers->lock);
+      return 1;
+    }
+    timers->heap = heap;
+    timers->cap = cap;
+  }
+
+  size_t i = timers->count++;
+  timers->heap[i] = timer;
+  while (i > 0 && earlier(&timers->heap[i].deadline,
+                          &timers->heap[(i - 1) / 2].deadline)) {
+    heap_swap(timers->heap, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+
+  // The thread may be sleeping until a later deadline
+  if (i == 0) {
+    pthread_cond_signal(&timers->cond);
+  }
+  pthread_mutex_unlock(&timers->lock);
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef KVS_TIMERS_H
+#define KVS_TIMERS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/// An item waiting for its deadline.
+typedef struct Timer {
+  struct timespec deadline; // When the timer fires, on CLOCK_MONOTONIC
+  void *item;               // Passed to the fire callback
+} Timer;
+
+/// Queue of timers served by one thread, which calls a callback with the item
+/// of each timer once its deadline has passed.
+typedef struct TimerQueue {
+  Timer *heap;             // Min-heap of timers ordered by deadline
+  size_t count;            // Number of timers in the heap
+  size_t cap;              // Allocated capacity of heap
+  void (*fire)(void *item); // Called, without the lock, for each timer
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;     // Signaled when an earlier timer is added
+} TimerQueue;
+
+/// Starts the thread of a timer queue.
+/// @param timers The queue to initialize.
+/// @param fire Function called with the item of each expired timer.
+/// @return 0 if successful, 1 otherwise.
+int timers_init(TimerQueue *timers, void (*fire)(void *item));
+
+/// Adds a timer.
+/// @param timers The queue.
+/// @param delay_ms Delay until the timer fires, in milliseconds.
+/// @param item Item passed to the fire callback.
+/// @return 0 if successful, 1 otherwise.
+int timers_add(TimerQueue *timers, unsigned int delay_ms, void *item);
+
+#endif // KVS_TIMERS_H
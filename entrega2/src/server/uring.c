@@ -0,0 +1,569 @@
+// syscall and pwrite are not part of strict POSIX
+#define _DEFAULT_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "throttle.h"
+
+/// A write of up to OUTBUF_IOV_MAX chunks of job output, in flight on the
+/// output ring.
+typedef struct UringReq {
+  int fd;
+  off_t offset;                   // Where the chunks go in the file
+  size_t len;                     // Bytes to write
+  OutChunk *chunks;               // Chunks owned by the request
+  int count;                      // Number of buffers in iov
+  uint64_t start;                 // When it was queued, see throttle_start
+  struct iovec iov[OUTBUF_IOV_MAX];
+} UringReq;
+
+/// Output state of a file descriptor written through the output ring.
+typedef struct UringFile {
+  off_t offset;      // End of the bytes queued so far
+  unsigned inflight; // Requests not completed yet
+  int closing;       // 1 if uring_close was called while writes were pending
+} UringFile;
+
+static int out_active = 0;
+static Uring out_ring;
+static pthread_t out_reaper;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_space = PTHREAD_COND_INITIALIZER; // Request done
+static unsigned out_inflight = 0; // Requests not completed yet, at most
+                                  // cq_entries so completions never overflow
+
+/// Output state indexed by file descriptor, like the readers of parser.c.
+static UringFile *out_files = NULL;
+static long max_out_files = 0;
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+int uring_setup(Uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = sys_uring_setup(entries, &params);
+  if (ring->fd < 0) {
+    ring->fd = -1;
+    return 1;
+  }
+
+  ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring->cq_map_len > ring->sq_map_len) {
+    ring->sq_map_len = ring->cq_map_len;
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    close(ring->fd);
+    ring->fd = -1;
+    return 1;
+  }
+
+  ring->cq_map = ring->sq_map;
+  if (!single) {
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      munmap(ring->sq_map, ring->sq_map_len);
+      close(ring->fd);
+      ring->fd = -1;
+      return 1;
+    }
+  }
+
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (!single) {
+      munmap(ring->cq_map, ring->cq_map_len);
+    }
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+    ring->fd = -1;
+    return 1;
+  }
+
+  char *sq = ring->sq_map;
+  char *cq = ring->cq_map;
+  ring->sq_head = (unsigned *)(void *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(void *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(void *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(void *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(void *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(void *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(void *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_entries = params.cq_entries;
+  return 0;
+}
+
+void uring_teardown(Uring *ring) {
+  if (ring->fd < 0) {
+    return;
+  }
+
+  munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_len);
+  }
+  munmap(ring->sq_map, ring->sq_map_len);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+/// Takes a free submission entry. Only one thread may fill a ring at a time.
+/// @param ring The ring.
+/// @return The cleared entry, NULL if the submission queue is full.
+static struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_queued;
+  if (tail - head >= ring->sq_entries) {
+    return NULL;
+  }
+
+  unsigned index = tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->sq_queued++;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/// Hands the filled entries to the kernel.
+/// @param ring The ring.
+/// @return 0 if successful, 1 otherwise.
+static int uring_submit(Uring *ring) {
+  if (ring->sq_queued == 0) {
+    return 0;
+  }
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_queued,
+                   __ATOMIC_RELEASE);
+  unsigned to_submit = ring->sq_queued;
+  ring->sq_queued = 0;
+
+  while (to_submit > 0) {
+    int submitted = sys_uring_enter(ring->fd, to_submit, 0, 0);
+    if (submitted < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      return 1;
+    }
+    to_submit -= (unsigned)submitted;
+  }
+  return 0;
+}
+
+/// Blocks until at least one completion is available.
+/// @param ring The ring.
+/// @return 0 if successful, 1 otherwise.
+static int uring_wait(Uring *ring) {
+  while (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) == *ring->cq_head) {
+    if (sys_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Takes the next completion. Only one thread may reap a ring.
+/// @param ring The ring.
+/// @param cqe Set to the completion.
+/// @return 1 if there was one, 0 otherwise.
+static int uring_reap(Uring *ring, struct io_uring_cqe *cqe) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+
+  *cqe = ring->cqes[head & *ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/// Writes bytes at an offset, retrying on partial writes. Async signal safe.
+/// @return 0 if successful, 1 otherwise.
+static int pwrite_all(int fd, const char *data, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t written = pwrite(fd, data, len, offset);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    data += written;
+    len -= (size_t)written;
+    offset += written;
+  }
+  return 0;
+}
+
+/// Writes the part of a request the kernel did not, with blocking writes.
+/// @param req The request.
+/// @param done Bytes already written.
+/// @return 0 if successful, 1 otherwise.
+static int req_write_rest(UringReq *req, size_t done) {
+  off_t offset = req->offset;
+  for (int i = 0; i < req->count; i++) {
+    size_t len = req->iov[i].iov_len;
+    if (done >= len) {
+      done -= len;
+      offset += (off_t)len;
+      continue;
+    }
+
+    if (pwrite_all(req->fd, (char *)req->iov[i].iov_base + done, len - done,
+                   offset + (off_t)done)) {
+      return 1;
+    }
+    offset += (off_t)len;
+    done = 0;
+  }
+  return 0;
+}
+
+static void req_free(UringReq *req) {
+  OutChunk *chunk = req->chunks;
+  while (chunk != NULL) {
+    OutChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(req);
+}
+
+/// Marks a request of a file as done, closing the file if it was waiting
+/// for it.
+/// @param fd The file descriptor of the request.
+static void out_done(int fd) {
+  pthread_mutex_lock(&out_lock);
+  UringFile *file = &out_files[fd];
+  out_inflight--;
+  if (--file->inflight == 0 && file->closing) {
+    file->offset = 0;
+    file->closing = 0;
+    close(fd);
+  }
+  pthread_cond_broadcast(&out_space);
+  pthread_mutex_unlock(&out_lock);
+}
+
+/// Reaper thread: collects the completions of the output ring in batches.
+/// Short writes are finished with blocking writes.
+/// @param arg Unused.
+/// @return NULL
+static void *out_reaper_thread(void *arg) {
+  (void)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  struct io_uring_cqe cqe;
+  while (1) {
+    if (uring_wait(&out_ring)) {
+      fprintf(stderr, "Failed to wait for the output ring\n");
+      return NULL;
+    }
+
+    while (uring_reap(&out_ring, &cqe)) {
+      UringReq *req = (UringReq *)(uintptr_t)cqe.user_data;
+      size_t done = cqe.res > 0 ? (size_t)cqe.res : 0;
+      if ((cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR) ||
+          (done < req->len && req_write_rest(req, done))) {
+        write_str(STDERR_FILENO, "Failed to write job output\n");
+      }
+
+      throttle_observe(req->start);
+      int fd = req->fd;
+      req_free(req);
+      out_done(fd);
+    }
+  }
+}
+
+int uring_start(void) {
+  long open_max = sysconf(_SC_OPEN_MAX);
+  if (open_max <= 0) {
+    open_max = 1024;
+  }
+
+  out_files = calloc((size_t)open_max, sizeof(UringFile));
+  if (out_files == NULL) {
+    return 1;
+  }
+  max_out_files = open_max;
+
+  if (uring_setup(&out_ring, URING_ENTRIES)) {
+    free(out_files);
+    out_files = NULL;
+    return 1;
+  }
+
+  if (pthread_create(&out_reaper, NULL, out_reaper_thread, NULL) != 0) {
+    uring_teardown(&out_ring);
+    free(out_files);
+    out_files = NULL;
+    return 1;
+  }
+
+  out_active = 1;
+  return 0;
+}
+
+int uring_active(void) { return out_active; }
+
+/// Queues the write of a request, waiting for room on the ring if needed.
+/// Called with out_lock held.
+/// @param req The request.
+/// @param file Output state of the request's file.
+/// @return 0 if successful, 1 otherwise.
+static int out_queue(UringReq *req, UringFile *file) {
+  struct io_uring_sqe *sqe = NULL;
+  while (out_inflight >= out_ring.cq_entries ||
+         (sqe = uring_get_sqe(&out_ring)) == NULL) {
+    // What was queued so far is submitted first, which may make room
+    if (out_ring.sq_queued > 0) {
+      if (uring_submit(&out_ring)) {
+        return 1;
+      }
+      continue;
+    }
+    pthread_cond_wait(&out_space, &out_lock);
+  }
+
+  req->offset = file->offset;
+  file->offset += (off_t)req->len;
+  file->inflight++;
+  out_inflight++;
+
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = req->fd;
+  sqe->addr = (unsigned long)req->iov;
+  sqe->len = (unsigned)req->count;
+  sqe->off = (unsigned long long)req->offset;
+  sqe->user_data = (unsigned long long)(uintptr_t)req;
+  return 0;
+}
+
+int uring_flush(OutBuffer *buf, int fd) {
+  if (!out_active || fd < 0 || fd >= max_out_files) {
+    return -1;
+  }
+  if (buf->len == 0) {
+    return 0;
+  }
+
+  // The chunks in use go to the ring, the spare ones stay with the buffer
+  OutChunk *chunk = buf->head;
+  OutChunk *spare = buf->tail->next;
+  buf->tail->next = NULL;
+  outbuf_init(buf);
+  buf->head = spare;
+
+  int result = 0;
+  pthread_mutex_lock(&out_lock);
+  UringFile *file = &out_files[fd];
+  while (chunk != NULL) {
+    UringReq *req = malloc(sizeof(UringReq));
+    if (req == NULL) {
+      // Written here instead, at the offset the request would have had
+      while (chunk != NULL) {
+        OutChunk *next = chunk->next;
+        result |= pwrite_all(fd, chunk->data, chunk->len, file->offset);
+        file->offset += (off_t)chunk->len;
+        free(chunk);
+        chunk = next;
+      }
+      break;
+    }
+
+    req->fd = fd;
+    req->len = 0;
+    req->count = 0;
+    req->start = throttle_start();
+    req->chunks = chunk;
+    OutChunk *last = chunk;
+    for (; chunk != NULL && req->count < OUTBUF_IOV_MAX; chunk = chunk->next) {
+      last = chunk;
+      if (chunk->len > 0) {
+        req->iov[req->count].iov_base = chunk->data;
+        req->iov[req->count].iov_len = chunk->len;
+        req->len += chunk->len;
+        req->count++;
+      }
+    }
+    last->next = NULL;
+
+    if (out_queue(req, file)) {
+      req_free(req);
+      // The chunks not queued yet are dropped along with it
+      while (chunk != NULL) {
+        OutChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+      }
+      result = 1;
+      break;
+    }
+  }
+
+  result |= uring_submit(&out_ring);
+  pthread_mutex_unlock(&out_lock);
+  return result;
+}
+
+void uring_close(int fd) {
+  if (!out_active || fd < 0 || fd >= max_out_files) {
+    close(fd);
+    return;
+  }
+
+  pthread_mutex_lock(&out_lock);
+  UringFile *file = &out_files[fd];
+  if (file->inflight > 0) {
+    // The reaper closes it after the last write
+    file->closing = 1;
+    pthread_mutex_unlock(&out_lock);
+    return;
+  }
+  file->offset = 0;
+  pthread_mutex_unlock(&out_lock);
+  close(fd);
+}
+
+void uring_writer_init(UringWriter *writer, int fd, int async) {
+  writer->async = async && uring_setup(&writer->ring, URING_WRITER_BUFS) == 0;
+  writer->fd = fd;
+  writer->failed = 0;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  writer->offset = offset > 0 ? offset : 0;
+  writer->cur = 0;
+  writer->len = 0;
+  for (unsigned i = 0; i < URING_WRITER_BUFS; i++) {
+    writer->sizes[i] = 0;
+  }
+}
+
+/// Waits for at least one write of a writer and collects every completed
+/// one.
+/// @param writer The writer, with writes in flight.
+static void writer_reap(UringWriter *writer) {
+  if (uring_wait(&writer->ring)) {
+    writer->failed = 1;
+    return;
+  }
+
+  struct io_uring_cqe cqe;
+  while (uring_reap(&writer->ring, &cqe)) {
+    unsigned i = (unsigned)cqe.user_data;
+    size_t done = cqe.res > 0 ? (size_t)cqe.res : 0;
+    if (done < writer->sizes[i] &&
+        pwrite_all(writer->fd, writer->bufs[i] + done,
+                   writer->sizes[i] - done, writer->offsets[i] + (off_t)done)) {
+      writer->failed = 1;
+    }
+    writer->sizes[i] = 0;
+  }
+}
+
+/// Writes the buffer being filled and moves on to the next one, waiting for
+/// it to be free.
+/// @param writer The writer.
+static void writer_submit(UringWriter *writer) {
+  unsigned cur = writer->cur;
+  if (writer->len == 0) {
+    return;
+  }
+
+  // Backups are written at the rate the jobs' output leaves them
+  throttle_take(writer->len);
+  struct io_uring_sqe *sqe =
+      writer->async ? uring_get_sqe(&writer->ring) : NULL;
+  if (sqe == NULL) {
+    writer->failed |= pwrite_all(writer->fd, writer->bufs[cur], writer->len,
+                                 writer->offset);
+  } else {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = writer->fd;
+    sqe->addr = (unsigned long)writer->bufs[cur];
+    sqe->len = (unsigned)writer->len;
+    sqe->off = (unsigned long long)writer->offset;
+    sqe->user_data = cur;
+    writer->sizes[cur] = writer->len;
+    writer->offsets[cur] = writer->offset;
+    if (uring_submit(&writer->ring)) {
+      writer->failed = 1;
+      writer->async = 0;
+      writer->sizes[cur] = 0;
+    }
+  }
+
+  writer->offset += (off_t)writer->len;
+  writer->len = 0;
+  writer->cur = (cur + 1) % URING_WRITER_BUFS;
+  while (writer->sizes[writer->cur] > 0 && !writer->failed) {
+    writer_reap(writer);
+  }
+}
+
+char *uring_writer_reserve(UringWriter *writer, size_t len) {
+  if (len > URING_WRITER_BUF_SIZE) {
+    return NULL;
+  }
+  if (URING_WRITER_BUF_SIZE - writer->len < len) {
+    writer_submit(writer);
+  }
+
+  char *dest = writer->bufs[writer->cur] + writer->len;
+  writer->len += len;
+  return dest;
+}
+
+int uring_writer_finish(UringWriter *writer) {
+  writer_submit(writer);
+  if (writer->async) {
+    for (unsigned i = 0; i < URING_WRITER_BUFS; i++) {
+      while (writer->sizes[i] > 0 && !writer->failed) {
+        writer_reap(writer);
+      }
+    }
+    uring_teardown(&writer->ring);
+  }
+  return writer->failed;
+}
@@ -0,0 +1,110 @@
+#ifndef KVS_URING_H
+#define KVS_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "io.h"
+
+#define URING_ENTRIES 32          // Submission queue entries of the output ring
+#define URING_WRITER_BUFS 4       // Buffers a UringWriter keeps in flight
+#define URING_WRITER_BUF_SIZE 16384 // Bytes per buffer of a UringWriter
+
+/// An io_uring set up with raw system calls. Only the submission and
+/// completion queues mapped from the kernel are kept, so it needs no heap and
+/// may be used by a backup child.
+typedef struct Uring {
+  int fd;                    // File descriptor of the ring, -1 if not set up
+  unsigned *sq_head;         // Advanced by the kernel as it consumes entries
+  unsigned *sq_tail;         // Advanced when entries are submitted
+  unsigned *sq_mask;
+  unsigned *sq_array;        // Indexes of the submitted entries
+  struct io_uring_sqe *sqes; // Submission entries
+  unsigned *cq_head;         // Advanced as completions are reaped
+  unsigned *cq_tail;         // Advanced by the kernel
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes; // Completion entries
+  unsigned sq_entries;
+  unsigned cq_entries;
+  unsigned sq_queued;        // Entries filled but not yet submitted
+  void *sq_map;              // Mapping of the submission queue
+  size_t sq_map_len;
+  void *cq_map;              // Mapping of the completion queue, may be sq_map
+  size_t cq_map_len;
+  size_t sqes_len;           // Length of the mapping of sqes
+} Uring;
+
+/// Writes a file through a private ring, keeping URING_WRITER_BUFS buffers
+/// in flight while the next one is filled. Used for backups, where the child
+/// cannot allocate memory. Without a ring the buffers are written with
+/// blocking writes.
+typedef struct UringWriter {
+  Uring ring;
+  int async;                        // 1 if the ring could be set up
+  int fd;                           // File being written
+  int failed;                       // 1 once a write failed
+  off_t offset;                     // File offset of the buffer being filled
+  unsigned cur;                     // Buffer being filled
+  size_t len;                       // Bytes in the buffer being filled
+  size_t sizes[URING_WRITER_BUFS];  // Bytes in flight per buffer, 0 if free
+  off_t offsets[URING_WRITER_BUFS]; // File offset of each buffer in flight
+  char bufs[URING_WRITER_BUFS][URING_WRITER_BUF_SIZE];
+} UringWriter;
+
+/// Sets up a ring. Async signal safe.
+/// @param ring The ring to set up.
+/// @param entries Number of submission queue entries.
+/// @return 0 if successful, 1 if io_uring is not available.
+int uring_setup(Uring *ring, unsigned entries);
+
+/// Unmaps the queues of a ring and closes it. Async signal safe.
+/// @param ring The ring to tear down.
+void uring_teardown(Uring *ring);
+
+/// Starts the asynchronous output backend: job output flushed with
+/// outbuf_flush is handed to a ring and written while the job goes on, and
+/// a reaper thread collects the completions in batches.
+/// @return 0 if successful, 1 if io_uring is not available.
+int uring_start(void);
+
+/// Tells whether the asynchronous output backend was started.
+/// @return 1 if it was, 0 otherwise.
+int uring_active(void);
+
+/// Queues the buffered bytes of an output buffer for writing. The chunks are
+/// taken from the buffer, which is left empty, and freed once written. The
+/// bytes are written at the end of what was queued before for the same file,
+/// which must not be written to by other means.
+/// @param buf The buffer to flush.
+/// @param fd The file descriptor to write to.
+/// @return 0 if the bytes were queued, 1 on failure, -1 if the backend is not
+/// in use and the caller has to write them.
+int uring_flush(OutBuffer *buf, int fd);
+
+/// Closes a file descriptor once the writes queued for it are done, without
+/// waiting for them.
+/// @param fd The file descriptor to close.
+void uring_close(int fd);
+
+/// Prepares a writer. Async signal safe.
+/// @param writer The writer to prepare.
+/// @param fd The file to write, from its current offset.
+/// @param async 1 to write through a ring if possible, 0 for blocking writes.
+void uring_writer_init(UringWriter *writer, int fd, int async);
+
+/// Reserves room for bytes at the end of what was written so far. Async
+/// signal safe.
+/// @param writer The writer.
+/// @param len Number of bytes the caller writes at the returned address, at
+/// most URING_WRITER_BUF_SIZE.
+/// @return Where to write the bytes, NULL if len is too large.
+char *uring_writer_reserve(UringWriter *writer, size_t len);
+
+/// Writes what is left, waits for every write and releases the ring. Async
+/// signal safe.
+/// @param writer The writer.
+/// @return 0 if successful, 1 if a write failed.
+int uring_writer_finish(UringWriter *writer);
+
+#endif // KVS_URING_H
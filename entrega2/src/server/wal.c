@@ -0,0 +1,655 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "crc.h"
+#include "lz.h"
+
+#define WAL_PAYLOAD_FIXED 11 // u64 lsn | u8 op | u16 count or path_len
+
+static int wal_fd = -1;
+static enum WalSync wal_sync = WAL_SYNC_ALWAYS;
+static unsigned int wal_interval_ms = 0;
+static pthread_t wal_thread;
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_flushed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_wake = PTHREAD_COND_INITIALIZER; // For wal_close
+
+static char *wal_buf = NULL;   // Records appended but not written yet
+static size_t wal_len = 0;
+static size_t wal_cap = 0;
+static char *wal_spare = NULL; // Written buffer, reused by the next flush
+static size_t wal_spare_cap = 0;
+
+static uint64_t wal_next_lsn = 1;    // Sequence number of the next record
+static uint64_t wal_written_lsn = 0; // Last record written to the file
+static uint64_t wal_synced_lsn = 0;  // Last record made durable
+static int wal_flushing = 0;         // 1 while a thread writes the buffer
+static int wal_failed = 0;           // 1 once a write or sync failed
+static int wal_stopping = 0;         // 1 once wal_close was called
+
+static int wal_compress = 0;      // 1 to write groups as WAL_FRAME_LZ frames
+static char *wal_packed = NULL;   // Frame of the group being written, only
+static size_t wal_packed_cap = 0; // used by the flushing thread
+
+static void put_u16(char *p, uint16_t value) {
+  p[0] = (char)(value & 0xff);
+  p[1] = (char)(value >> 8);
+}
+
+static void put_u32(char *p, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (char)((value >> (8 * i)) & 0xff);
+  }
+}
+
+static void put_u64(char *p, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    p[i] = (char)((value >> (8 * i)) & 0xff);
+  }
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+  return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+/// Compresses a group of records into a frame, if it shrinks.
+/// @param buf The records.
+/// @param len Length of the records.
+/// @return Length of the frame in wal_packed, 0 to write the records as
+/// they are.
+static size_t wal_pack(const char *buf, size_t len) {
+  if (len < WAL_COMPRESS_MIN || len >= WAL_FRAME_LZ) {
+    return 0;
+  }
+  if (wal_packed_cap < len) {
+    char *packed = realloc(wal_packed, len);
+    if (packed == NULL) {
+      return 0;
+    }
+    wal_packed = packed;
+    wal_packed_cap = len;
+  }
+
+  char *payload = wal_packed + WAL_RECORD_HEADER_SIZE;
+  size_t packed_len =
+      lz_compress(buf, len, payload + 4, len - WAL_RECORD_HEADER_SIZE - 5);
+  if (packed_len == 0) {
+    return 0;
+  }
+  put_u32(payload, (uint32_t)len);
+  put_u32(wal_packed, (uint32_t)(4 + packed_len) | WAL_FRAME_LZ);
+  put_u32(wal_packed + 4, crc32c(0, payload, 4 + packed_len));
+  return WAL_RECORD_HEADER_SIZE + 4 + packed_len;
+}
+
+/// Writes the buffered records, and syncs them if asked. Called with
+/// wal_lock held and no flush in progress, which is released meanwhile so
+/// other threads keep appending to the other buffer. A failure is sticky:
+/// the file may end in a torn record, which recovery stops at, so no record
+/// is reported written from then on and no more are appended.
+/// @param sync 1 to fdatasync the log after writing.
+static void wal_flush(int sync) {
+  char *buf = wal_buf;
+  size_t len = wal_len;
+  size_t cap = wal_cap;
+  uint64_t upto = wal_next_lsn - 1;
+
+  wal_buf = wal_spare;
+  wal_cap = wal_spare_cap;
+  wal_len = 0;
+  wal_spare = NULL;
+  wal_spare_cap = 0;
+  wal_flushing = 1;
+  pthread_mutex_unlock(&wal_lock);
+
+  int failed = 0;
+  size_t packed_len = wal_compress ? wal_pack(buf, len) : 0;
+  if (packed_len > 0 && write_all(wal_fd, wal_packed, packed_len) != 1) {
+    write_str(STDERR_FILENO, "Failed to write the WAL\n");
+    failed = 1;
+  } else if (packed_len == 0 && len > 0 && write_all(wal_fd, buf, len) != 1) {
+    write_str(STDERR_FILENO, "Failed to write the WAL\n");
+    failed = 1;
+  }
+  if (!failed && sync && fdatasync(wal_fd) == -1) {
+    write_str(STDERR_FILENO, "Failed to sync the WAL\n");
+    failed = 1;
+  }
+
+  pthread_mutex_lock(&wal_lock);
+  // The buffer just written is reused by the next flush
+  wal_spare = buf;
+  wal_spare_cap = cap;
+  if (failed) {
+    wal_failed = 1;
+  } else {
+    wal_written_lsn = upto;
+    if (sync) {
+      wal_synced_lsn = upto;
+    }
+  }
+  wal_flushing = 0;
+  pthread_cond_broadcast(&wal_flushed);
+}
+
+/// Syncs the log once per commit window, for WAL_SYNC_INTERVAL.
+/// @param arg Unused.
+/// @return NULL
+static void *wal_sync_thread(void *arg) {
+  (void)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  pthread_mutex_lock(&wal_lock);
+  while (!wal_stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wal_interval_ms / 1000;
+    deadline.tv_nsec += (long)(wal_interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!wal_stopping &&
+           pthread_cond_timedwait(&wal_wake, &wal_lock, &deadline) == 0) {
+    }
+
+    if (!wal_stopping && !wal_flushing && !wal_failed &&
+        (wal_len > 0 || wal_synced_lsn < wal_written_lsn)) {
+      wal_flush(1);
+    }
+  }
+  pthread_mutex_unlock(&wal_lock);
+
+  return NULL;
+}
+
+/// Decodes the keys (and values) of a WRITE or DELETE.
+/// @return 0 if successful, 1 if they are malformed.
+static int decode_pairs(const unsigned char *p, size_t len, WalRecord *rec) {
+  rec->num_pairs = get_u16(p + 9);
+  if (rec->num_pairs > MAX_WRITE_SIZE) {
+    return 1;
+  }
+
+  size_t pos = WAL_PAYLOAD_FIXED;
+  for (size_t i = 0; i < rec->num_pairs; i++) {
+    for (int field = 0; field < (rec->op == WAL_OP_WRITE ? 2 : 1); field++) {
+      char *dest = field == 0 ? rec->keys[i] : rec->values[i];
+      if (pos >= len || p[pos] >= MAX_STRING_SIZE ||
+          len - pos - 1 < p[pos]) {
+        return 1;
+      }
+      size_t n = p[pos++];
+      memcpy(dest, p + pos, n);
+      dest[n] = '\0';
+      pos += n;
+    }
+  }
+
+  return pos != len;
+}
+
+/// Decodes the payload of a record.
+/// @param p The payload.
+/// @param len Length of the payload.
+/// @param rec Record to fill, with its keys, values and path buffers set.
+/// @return 0 if successful, 1 if it is malformed.
+static int decode_record(const unsigned char *p, size_t len, WalRecord *rec,
+                         char *path) {
+  if (len < WAL_PAYLOAD_FIXED) {
+    return 1;
+  }
+
+  rec->lsn = get_u64(p);
+  rec->op = (enum WalOp)(p[8] & ~WAL_OP_MORE);
+  rec->more = (p[8] & WAL_OP_MORE) != 0;
+  rec->num_pairs = 0;
+  rec->path = NULL;
+  rec->snapshot_lsn = 0;
+
+  switch (rec->op) {
+  case WAL_OP_WRITE:
+  case WAL_OP_DELETE:
+    return decode_pairs(p, len, rec);
+  case WAL_OP_ABORT:
+    return rec->more || len != WAL_PAYLOAD_FIXED || get_u16(p + 9) != 0;
+  case WAL_OP_CHECKPOINT: {
+    size_t path_len = get_u16(p + 9);
+    if (path_len == 0 || path_len >= WAL_PATH_MAX ||
+        len != WAL_PAYLOAD_FIXED + path_len + 8) {
+      return 1;
+    }
+    memcpy(path, p + WAL_PAYLOAD_FIXED, path_len);
+    path[path_len] = '\0';
+    rec->path = path;
+    rec->snapshot_lsn = get_u64(p + WAL_PAYLOAD_FIXED + path_len);
+    return rec->more || rec->snapshot_lsn >= rec->lsn;
+  }
+  }
+  return 1;
+}
+
+/// Decodes the records of a buffer, up to the first one cut short, with a
+/// wrong CRC or out of order.
+/// @param data The records.
+/// @param size Length of data.
+/// @param in_frame 1 if data is the content of a frame, which holds records
+/// only.
+/// @param rec Record to fill, with its keys and values buffers set.
+/// @param path Buffer for the path of a CHECKPOINT.
+/// @param record Called for each valid record, may be NULL.
+/// @param arg Passed to record.
+/// @param last_lsn Sequence number of the record before data, set to that of
+/// the last valid record.
+/// @param end Set to the offset after the last valid record.
+/// @return 1 if record stopped the scan, 0 otherwise.
+static int scan_records(const unsigned char *data, size_t size, int in_frame,
+                        WalRecord *rec, char *path, wal_record_t record,
+                        void *arg, uint64_t *last_lsn, size_t *end) {
+  size_t pos = 0;
+  int result = 0;
+  while (size - pos >= WAL_RECORD_HEADER_SIZE) {
+    uint32_t len = get_u32(data + pos);
+    int frame = (len & WAL_FRAME_LZ) != 0;
+    len &= ~WAL_FRAME_LZ;
+    const unsigned char *payload = data + pos + WAL_RECORD_HEADER_SIZE;
+    if (size - pos - WAL_RECORD_HEADER_SIZE < len ||
+        crc32c(0, payload, len) != get_u32(data + pos + 4) ||
+        (frame && (in_frame || len < 4))) {
+      break;
+    }
+
+    if (frame) {
+      // A frame is applied whole, so its records are checked first
+      size_t raw_len = get_u32(payload);
+      unsigned char *raw = malloc(raw_len > 0 ? raw_len : 1);
+      uint64_t lsn = *last_lsn;
+      size_t raw_end = 0;
+      if (raw == NULL || lz_decompress(payload + 4, len - 4, raw, raw_len) ||
+          scan_records(raw, raw_len, 1, rec, path, NULL, NULL, &lsn,
+                       &raw_end) ||
+          raw_end != raw_len) {
+        free(raw);
+        break;
+      }
+      result = scan_records(raw, raw_len, 1, rec, path, record, arg,
+                            last_lsn, &raw_end);
+      free(raw);
+      if (result) {
+        break;
+      }
+    } else {
+      if (decode_record(payload, len, rec, path) || rec->lsn <= *last_lsn) {
+        break;
+      }
+      if (record != NULL && record(arg, rec) != 0) {
+        result = 1;
+        break;
+      }
+      *last_lsn = rec->lsn;
+    }
+    pos += WAL_RECORD_HEADER_SIZE + len;
+  }
+
+  *end = pos;
+  return result;
+}
+
+int wal_scan(int fd, wal_record_t record, void *arg, off_t *end,
+             uint64_t *last_lsn) {
+  *end = 0;
+  *last_lsn = 0;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < WAL_HEADER_SIZE) {
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  if (memcmp(data, WAL_MAGIC, 4) != 0 || get_u16(data + 4) != WAL_VERSION) {
+    munmap((void *)data, size);
+    return 1;
+  }
+  posix_madvise((void *)data, size, POSIX_MADV_SEQUENTIAL);
+
+  WalRecord rec;
+  rec.keys = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  rec.values = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+  char *path = malloc(WAL_PATH_MAX);
+  if (rec.keys == NULL || rec.values == NULL || path == NULL) {
+    free(rec.keys);
+    free(rec.values);
+    free(path);
+    munmap((void *)data, size);
+    return 1;
+  }
+
+  size_t scanned;
+  int result =
+      scan_records(data + WAL_HEADER_SIZE, size - WAL_HEADER_SIZE, 0, &rec,
+                   path, record, arg, last_lsn, &scanned);
+
+  *end = (off_t)(WAL_HEADER_SIZE + scanned);
+  free(rec.keys);
+  free(rec.values);
+  free(path);
+  munmap((void *)data, size);
+  return result;
+}
+
+/// Tells whether the batch of a record goes on, to find a log ending in the
+/// middle of one.
+/// @param arg Set to the more flag of the record.
+/// @param record The record.
+/// @return 0
+static int note_batch(void *arg, const WalRecord *record) {
+  *(int *)arg = record->more;
+  return 0;
+}
+
+int wal_open(const char *path, enum WalSync sync, unsigned int interval_ms) {
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open WAL: %s\n", path);
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 1;
+  }
+
+  off_t end = WAL_HEADER_SIZE;
+  uint64_t last_lsn = 0;
+  int open_batch = 0;
+  if (st.st_size == 0) {
+    char header[WAL_HEADER_SIZE];
+    memcpy(header, WAL_MAGIC, 4);
+    put_u16(header + 4, WAL_VERSION);
+    put_u16(header + 6, 0);
+    if (write_all(fd, header, sizeof(header)) != 1 || fdatasync(fd) == -1) {
+      fprintf(stderr, "Failed to write WAL header: %s\n", path);
+      close(fd);
+      return 1;
+    }
+  } else if (wal_scan(fd, note_batch, &open_batch, &end, &last_lsn)) {
+    fprintf(stderr, "Not a WAL file: %s\n", path);
+    close(fd);
+    return 1;
+  } else if (end < st.st_size) {
+    // A crash stopped the last append, what follows it is garbage
+    fprintf(stderr, "Truncating WAL after record %lu\n",
+            (unsigned long)last_lsn);
+    if (ftruncate(fd, end) == -1) {
+      close(fd);
+      return 1;
+    }
+  }
+
+  if (lseek(fd, end, SEEK_SET) == -1) {
+    close(fd);
+    return 1;
+  }
+
+  wal_fd = fd;
+  wal_sync = sync;
+  wal_interval_ms = interval_ms > 0 ? interval_ms : 1;
+  wal_next_lsn = last_lsn + 1;
+  wal_written_lsn = last_lsn;
+  wal_synced_lsn = last_lsn;
+  if (open_batch) {
+    // A crash cut the batch short, the records appended next are not part
+    // of it
+    wal_append_abort();
+    if (wal_failed) {
+      wal_fd = -1;
+      close(fd);
+      return 1;
+    }
+  }
+
+  if (sync == WAL_SYNC_INTERVAL &&
+      pthread_create(&wal_thread, NULL, wal_sync_thread, NULL) != 0) {
+    fprintf(stderr, "Failed to start the WAL sync thread\n");
+    wal_fd = -1;
+    close(fd);
+    return 1;
+  }
+  return 0;
+}
+
+int wal_enabled(void) { return wal_fd != -1; }
+
+void wal_set_compression(int compress) { wal_compress = compress; }
+
+/// Makes room at the end of the log buffer. Called with wal_lock held.
+/// @param max_len Largest size of the record about to be appended.
+/// @return Where to encode the record, NULL on failure or once the log
+/// failed to be written.
+static char *wal_reserve(size_t max_len) {
+  if (wal_failed || wal_stopping) {
+    return NULL;
+  }
+  if (wal_cap - wal_len < max_len) {
+    size_t cap = wal_cap > 0 ? wal_cap : 4096;
+    while (cap - wal_len < max_len) {
+      cap *= 2;
+    }
+    char *buf = realloc(wal_buf, cap);
+    if (buf == NULL) {
+      fprintf(stderr, "Failed to append to the WAL\n");
+      return NULL;
+    }
+    wal_buf = buf;
+    wal_cap = cap;
+  }
+  return wal_buf + wal_len;
+}
+
+/// Writes the header of a record encoded at the end of the log buffer and
+/// appends it. Called with wal_lock held.
+/// @param record Start of the record.
+/// @param end End of its payload.
+static void wal_seal(char *record, const char *end) {
+  char *payload = record + WAL_RECORD_HEADER_SIZE;
+  size_t len = (size_t)(end - payload);
+  put_u32(record, (uint32_t)len);
+  put_u32(record + 4, crc32c(0, payload, len));
+  wal_len += WAL_RECORD_HEADER_SIZE + len;
+}
+
+uint64_t wal_append(enum WalOp op, int more, size_t num_pairs,
+                    char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE]) {
+  size_t per_pair = op == WAL_OP_WRITE ? 2 * MAX_STRING_SIZE : MAX_STRING_SIZE;
+  size_t max_len =
+      WAL_RECORD_HEADER_SIZE + WAL_PAYLOAD_FIXED + num_pairs * per_pair;
+
+  pthread_mutex_lock(&wal_lock);
+  char *record = wal_reserve(max_len);
+  if (record == NULL) {
+    pthread_mutex_unlock(&wal_lock);
+    return 0;
+  }
+
+  char *p = record + WAL_RECORD_HEADER_SIZE;
+  uint64_t lsn = wal_next_lsn++;
+  put_u64(p, lsn);
+  p[8] = (char)(op | (more ? WAL_OP_MORE : 0));
+  put_u16(p + 9, (uint16_t)num_pairs);
+  p += WAL_PAYLOAD_FIXED;
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    size_t key_len = strnlen(keys[i], MAX_STRING_SIZE - 1);
+    *p++ = (char)key_len;
+    memcpy(p, keys[i], key_len);
+    p += key_len;
+
+    if (op == WAL_OP_WRITE) {
+      size_t value_len = strnlen(values[i], MAX_STRING_SIZE - 1);
+      *p++ = (char)value_len;
+      memcpy(p, values[i], value_len);
+      p += value_len;
+    }
+  }
+
+  wal_seal(record, p);
+  pthread_mutex_unlock(&wal_lock);
+  return lsn;
+}
+
+void wal_append_abort(void) {
+  pthread_mutex_lock(&wal_lock);
+  char *record = wal_reserve(WAL_RECORD_HEADER_SIZE + WAL_PAYLOAD_FIXED);
+  if (record == NULL) {
+    // A later record would be taken for the rest of the batch
+    wal_failed = 1;
+    pthread_mutex_unlock(&wal_lock);
+    return;
+  }
+
+  char *p = record + WAL_RECORD_HEADER_SIZE;
+  put_u64(p, wal_next_lsn++);
+  p[8] = (char)WAL_OP_ABORT;
+  put_u16(p + 9, 0);
+  wal_seal(record, p + WAL_PAYLOAD_FIXED);
+  pthread_mutex_unlock(&wal_lock);
+}
+
+uint64_t wal_append_checkpoint(uint64_t snapshot_lsn, const char *path) {
+  size_t path_len = strlen(path);
+  if (path_len >= WAL_PATH_MAX) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&wal_lock);
+  char *record =
+      wal_reserve(WAL_RECORD_HEADER_SIZE + WAL_PAYLOAD_FIXED + path_len + 8);
+  if (record == NULL) {
+    pthread_mutex_unlock(&wal_lock);
+    return 0;
+  }
+
+  char *p = record + WAL_RECORD_HEADER_SIZE;
+  uint64_t lsn = wal_next_lsn++;
+  put_u64(p, lsn);
+  p[8] = (char)WAL_OP_CHECKPOINT;
+  put_u16(p + 9, (uint16_t)path_len);
+  p += WAL_PAYLOAD_FIXED;
+  memcpy(p, path, path_len);
+  p += path_len;
+  put_u64(p, snapshot_lsn);
+  p += 8;
+
+  wal_seal(record, p);
+  pthread_mutex_unlock(&wal_lock);
+  return lsn;
+}
+
+uint64_t wal_last_lsn(void) {
+  pthread_mutex_lock(&wal_lock);
+  uint64_t lsn = wal_next_lsn - 1;
+  pthread_mutex_unlock(&wal_lock);
+  return lsn;
+}
+
+int wal_commit(uint64_t lsn) {
+  if (wal_fd == -1 || lsn == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&wal_lock);
+  if (wal_sync == WAL_SYNC_INTERVAL) {
+    // The sync thread makes it durable, only a large buffer is written now
+    if (wal_len >= WAL_FLUSH_SIZE && !wal_flushing && !wal_failed) {
+      wal_flush(0);
+    }
+    int result = wal_failed && wal_written_lsn < lsn;
+    pthread_mutex_unlock(&wal_lock);
+    return result;
+  }
+
+  // The first thread to find no flush in progress writes the records of
+  // every thread waiting, the others wait for it
+  int sync = wal_sync == WAL_SYNC_ALWAYS;
+  int result = 0;
+  while ((sync ? wal_synced_lsn : wal_written_lsn) < lsn) {
+    if (wal_failed) {
+      result = 1;
+      break;
+    } else if (wal_flushing) {
+      pthread_cond_wait(&wal_flushed, &wal_lock);
+    } else {
+      wal_flush(sync);
+    }
+  }
+  pthread_mutex_unlock(&wal_lock);
+  return result;
+}
+
+int wal_close(void) {
+  if (wal_fd == -1) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&wal_lock);
+  wal_stopping = 1;
+  pthread_cond_signal(&wal_wake);
+  pthread_mutex_unlock(&wal_lock);
+  if (wal_sync == WAL_SYNC_INTERVAL) {
+    pthread_join(wal_thread, NULL);
+  }
+
+  // Nothing is appended any more, the records of the last window are left
+  pthread_mutex_lock(&wal_lock);
+  while (wal_flushing) {
+    pthread_cond_wait(&wal_flushed, &wal_lock);
+  }
+  if (!wal_failed && (wal_len > 0 || wal_synced_lsn < wal_written_lsn)) {
+    wal_flush(1);
+  }
+  int result = wal_failed;
+  pthread_mutex_unlock(&wal_lock);
+
+  close(wal_fd);
+  wal_fd = -1;
+  free(wal_buf);
+  free(wal_spare);
+  free(wal_packed);
+  wal_buf = wal_spare = wal_packed = NULL;
+  wal_len = wal_cap = wal_spare_cap = wal_packed_cap = 0;
+  return result;
+}
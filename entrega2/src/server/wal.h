@@ -0,0 +1,151 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "constants.h"
+
+/// The write-ahead log holds every WRITE and DELETE applied to the KVS, so
+/// the state can be rebuilt after a crash.
+///
+/// Layout, multi-byte fields in little-endian:
+///   header:  "KVSW" | u16 version | u16 reserved (0)
+///   record:  u32 len | u32 crc32c of the payload | payload (len bytes)
+///   payload: u64 lsn | u8 op | u16 count | count x (u8 klen | key
+///            [| u8 vlen | value, for a WRITE])
+///            or, for a CHECKPOINT: u64 lsn | u8 op | u16 path_len | path |
+///            u64 snapshot_lsn
+///            or, for an ABORT: u64 lsn | u8 op | u16 0
+///   frame:   u32 len | WAL_FRAME_LZ | u32 crc32c of the payload | payload:
+///            u32 raw_len | records compressed by lz_compress
+/// Records have increasing log sequence numbers (LSN), starting at 1. A
+/// record cut short by a crash, or with a wrong CRC, ends the log. With
+/// compression, each group of records written at once becomes a frame if
+/// that is smaller, and a frame is kept or cut off whole.
+///
+/// A WRITE or DELETE longer than MAX_WRITE_SIZE pairs is logged as several
+/// records, all but the last with WAL_OP_MORE set in the op byte. They are
+/// only replayed once that last record is found: an ABORT, or the end of
+/// the log, discards them.
+///
+/// A CHECKPOINT names a backup holding the state after record snapshot_lsn.
+/// The backup only appears under that name once it is complete, so the
+/// state is rebuilt by loading it and replaying the records after
+/// snapshot_lsn.
+#define WAL_MAGIC "KVSW"
+#define WAL_VERSION 1
+#define WAL_HEADER_SIZE 8
+#define WAL_RECORD_HEADER_SIZE 8
+#define WAL_FLUSH_SIZE (1 << 20) // Buffered bytes written out without waiting
+                                 // for the commit window
+#define WAL_PATH_MAX 4096        // Longest path of a CHECKPOINT
+#define WAL_FRAME_LZ 0x80000000u // Bit of the length of a frame
+#define WAL_COMPRESS_MIN 256     // Smallest group worth compressing
+#define WAL_OP_MORE 0x80         // Flag of a record continued by the next one
+
+enum WalOp {
+  WAL_OP_WRITE = 1,
+  WAL_OP_DELETE,
+  WAL_OP_CHECKPOINT,
+  WAL_OP_ABORT, // Ends a batch without applying it
+};
+
+/// When appended records are made durable.
+enum WalSync {
+  WAL_SYNC_ALWAYS,   // Before wal_commit returns, one fdatasync per group
+  WAL_SYNC_INTERVAL, // Every interval, by a background thread
+  WAL_SYNC_NEVER,    // Written by wal_commit, synced by the OS whenever
+};
+
+/// A decoded record, valid only during the wal_scan callback.
+typedef struct WalRecord {
+  uint64_t lsn;
+  enum WalOp op;
+  int more;                        // 1 if the batch goes on in the next one
+  size_t num_pairs;                // Keys of a WRITE or DELETE
+  char (*keys)[MAX_STRING_SIZE];
+  char (*values)[MAX_STRING_SIZE]; // Values of a WRITE
+  const char *path;                // Backup of a CHECKPOINT
+  uint64_t snapshot_lsn;           // Last record included in the backup
+} WalRecord;
+
+/// Callback for each record of a log.
+/// @param arg Argument given to wal_scan.
+/// @param record The record.
+/// @return 0 to go on, 1 to stop the scan.
+typedef int (*wal_record_t)(void *arg, const WalRecord *record);
+
+/// Opens the log, creating it if needed, and appends to it from now on.
+/// Records left incomplete by a crash are cut off.
+/// @param path Path of the log file.
+/// @param sync When records are made durable.
+/// @param interval_ms Commit window of WAL_SYNC_INTERVAL, in milliseconds.
+/// @return 0 if successful, 1 otherwise.
+int wal_open(const char *path, enum WalSync sync, unsigned int interval_ms);
+
+/// Tells whether a log was opened with wal_open.
+/// @return 1 if it was, 0 otherwise.
+int wal_enabled(void);
+
+/// Makes groups of records be written compressed, see WAL_FRAME_LZ. Logs
+/// are read back either way.
+/// @param compress 1 to compress, 0 not to.
+void wal_set_compression(int compress);
+
+/// Appends a record to the log buffer. Records must be appended in the order
+/// they are applied, so this is called with the table locked for writing.
+/// @param op Operation of the record.
+/// @param more 1 if the next record continues the same batch.
+/// @param num_pairs Number of keys (and values), at most MAX_WRITE_SIZE.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings, only used by a WRITE.
+/// @return Sequence number of the record, 0 on failure or once writing the
+/// log failed.
+uint64_t wal_append(enum WalOp op, int more, size_t num_pairs,
+                    char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE]);
+
+/// Appends an ABORT record, which discards the batch being logged. If it
+/// cannot be appended the log stops taking records, like after a failed
+/// write, so the batch is left unfinished at its end.
+void wal_append_abort(void);
+
+/// Appends a CHECKPOINT record to the log buffer.
+/// @param snapshot_lsn Last record included in the backup.
+/// @param path Path of the backup.
+/// @return Sequence number of the record, 0 on failure.
+uint64_t wal_append_checkpoint(uint64_t snapshot_lsn, const char *path);
+
+/// Returns the sequence number of the last record appended. Called with the
+/// table locked, so no WRITE or DELETE is being appended.
+/// @return The sequence number, 0 if the log is empty.
+uint64_t wal_last_lsn(void);
+
+/// Waits until a record is as durable as the sync policy requires. Threads
+/// committing at the same time share one write and fdatasync. Once writing
+/// the log failed, records not yet written are lost and nothing more is
+/// appended.
+/// @param lsn Sequence number returned by wal_append.
+/// @return 0 if successful, 1 if the record could not be written.
+int wal_commit(uint64_t lsn);
+
+/// Writes and syncs the records left in the log buffer, stops the sync
+/// thread and closes the log. Called once no more records are appended.
+/// @return 0 if successful, 1 if records were lost.
+int wal_close(void);
+
+/// Reads the records of a log, in order.
+/// @param fd File descriptor of the log.
+/// @param record Called for each valid record, may be NULL.
+/// @param arg Passed to record.
+/// @param end Set to the offset after the last valid record.
+/// @param last_lsn Set to the sequence number of the last valid record, 0 if
+/// there is none.
+/// @return 0 if successful, 1 if the file is not a log or record stopped the
+/// scan.
+int wal_scan(int fd, wal_record_t record, void *arg, off_t *end,
+             uint64_t *last_lsn);
+
+#endif // KVS_WAL_H
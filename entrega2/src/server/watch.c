@@ -0,0 +1,86 @@
+#include "watch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/// Arguments of the watch thread.
+typedef struct Watch {
+  int fd;                    // inotify instance
+  watch_callback_t callback; // Function called for each file
+} Watch;
+
+/// Watch thread: reads inotify events until the instance fails.
+/// @param arg The Watch to serve.
+/// @return NULL
+static void *watch_thread(void *arg) {
+  Watch *watch = (Watch *)arg;
+
+  // SIGUSR1 is handled by the main thread
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+  }
+
+  _Alignas(struct inotify_event) char buffer[4096];
+
+  while (1) {
+    ssize_t len = read(watch->fd, buffer, sizeof(buffer));
+    if (len == -1 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      fprintf(stderr, "Failed to read directory events\n");
+      break;
+    }
+
+    for (char *ptr = buffer; ptr < buffer + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+        watch->callback(event->name);
+      }
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  close(watch->fd);
+  free(watch);
+  return NULL;
+}
+
+int watch_start(const char *dir, watch_callback_t callback) {
+  Watch *watch = malloc(sizeof(Watch));
+  if (watch == NULL) {
+    return 1;
+  }
+
+  watch->callback = callback;
+  watch->fd = inotify_init1(IN_CLOEXEC);
+  if (watch->fd == -1) {
+    free(watch);
+    return 1;
+  }
+
+  // Files are reported once complete: closed by their writer or renamed in
+  if (inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    close(watch->fd);
+    free(watch);
+    return 1;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, watch_thread, watch) != 0) {
+    close(watch->fd);
+    free(watch);
+    return 1;
+  }
+
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef KVS_WATCH_H
+#define KVS_WATCH_H
+
+/// Called with the name of each file written to, or moved into, a watched
+/// directory.
+typedef void (*watch_callback_t)(const char *name);
+
+/// Starts a thread that watches a directory with inotify and reports every
+/// file that is closed after being written or moved into it.
+/// @param dir The directory to watch.
+/// @param callback Function called, on the watch thread, for each file.
+/// @return 0 if successful, 1 otherwise.
+int watch_start(const char *dir, watch_callback_t callback);
+
+#endif // KVS_WATCH_H
@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "../server/constants.h"
+#include "../server/io.h"
+#include "../server/jobbin.h"
+#include "../server/parser.h"
+
+#define KVSC_FLUSH_SIZE 65536 // Encoded bytes buffered before each write
+
+/// Prints the usage of the job compiler.
+/// @param name Name of the executable.
+static void print_usage(const char *name) {
+  write_str(STDERR_FILENO, "Usage: ");
+  write_str(STDERR_FILENO, name);
+  write_str(STDERR_FILENO, " <input.job> [output.jobbin]\n");
+}
+
+/// Compiles a job file into a binary job file (see jobbin.h).
+/// @param in_fd File descriptor of the .job file.
+/// @param out_fd File descriptor of the .jobbin file.
+/// @return 0 if successful, 1 otherwise.
+static int compile(int in_fd, int out_fd) {
+  static char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  static char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  JobCmd cmd = {.keys = keys, .values = values};
+  OutBuffer out;
+  outbuf_init(&out);
+
+  if (jobbin_write_header(&out)) {
+    outbuf_free(&out);
+    return 1;
+  }
+
+  while (parse_command(in_fd, &cmd) != EOC) {
+    if (jobbin_encode(&cmd, &out)) {
+      outbuf_free(&out);
+      return 1;
+    }
+
+    if (out.len >= KVSC_FLUSH_SIZE && outbuf_flush(&out, out_fd)) {
+      outbuf_free(&out);
+      return 1;
+    }
+  }
+
+  int result = outbuf_flush(&out, out_fd);
+  outbuf_free(&out);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  char out_path[MAX_JOB_FILE_NAME_SIZE];
+  if (argc == 3) {
+    if (strlen(argv[2]) >= MAX_JOB_FILE_NAME_SIZE) {
+      fprintf(stderr, "Output path too long: %s\n", argv[2]);
+      return 1;
+    }
+    strcpy(out_path, argv[2]);
+  } else {
+    const char *dot = strrchr(argv[1], '.');
+    if (dot == NULL || strcmp(dot, ".job") != 0) {
+      fprintf(stderr, "Input must be a .job file: %s\n", argv[1]);
+      return 1;
+    }
+    if (strlen(argv[1]) + 3 >= MAX_JOB_FILE_NAME_SIZE) {
+      fprintf(stderr, "Input path too long: %s\n", argv[1]);
+      return 1;
+    }
+    strcpy(out_path, argv[1]);
+    strcat(out_path, "bin");
+  }
+
+  int in_fd = open(argv[1], O_RDONLY);
+  if (in_fd == -1) {
+    fprintf(stderr, "Failed to open input file: %s\n", argv[1]);
+    return 1;
+  }
+
+  int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out_fd == -1) {
+    fprintf(stderr, "Failed to open output file: %s\n", out_path);
+    close(in_fd);
+    return 1;
+  }
+
+  int result = parser_open(in_fd) || compile(in_fd, out_fd);
+  if (result) {
+    fprintf(stderr, "Failed to compile %s\n", argv[1]);
+  }
+
+  parser_close(in_fd);
+  close(in_fd);
+  close(out_fd);
+  return result;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "../server/io.h"
+#include "../server/kvs.h"
+#include "../server/snapshot.h"
+
+/// Prints the usage of the backup dumper.
+/// @param name Name of the executable.
+static void print_usage(const char *name) {
+  write_str(STDERR_FILENO, "Usage: ");
+  write_str(STDERR_FILENO, name);
+  write_str(STDERR_FILENO, " <backup.bck>\n");
+}
+
+/// Appends a pair of a block as a backup line, flushing to stdout when the
+/// buffer is full.
+/// @param arg The OutBuffer.
+/// @return 0 if successful, 1 otherwise.
+static int dump_pair(void *arg, const char *key, size_t key_len,
+                     const char *value, size_t value_len) {
+  OutBuffer *out = (OutBuffer *)arg;
+  if (outbuf_pair(out, &PAIR_LINE, key, key_len, value, value_len)) {
+    return 1;
+  }
+  return outbuf_flush_full(out, STDOUT_FILENO);
+}
+
+/// Prints the table rebuilt from a delta backup and its parents.
+/// @param path Path of the delta.
+/// @param out Buffer to print with.
+/// @return 0 if successful, 1 otherwise.
+static int dump_chain(const char *path, OutBuffer *out) {
+  HashTable *ht = create_hash_table();
+  if (ht == NULL || snapshot_load(ht, path, 1)) {
+    if (ht != NULL) {
+      free_table(ht);
+    }
+    return 1;
+  }
+
+  int result = 0;
+  for (int i = 0; i < TABLE_SIZE && result == 0; i++) {
+    for (KeyNode *node = ht->table[i]; node != NULL && result == 0;
+         node = node->next) {
+      result = dump_pair(out, node->key, node->key_len, node->value,
+                         node->value_len);
+    }
+  }
+
+  free_table(ht);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  SnapshotFile snap;
+  if (snapshot_open(argv[1], &snap)) {
+    fprintf(stderr, "Not a valid binary backup: %s\n", argv[1]);
+    return 1;
+  }
+
+  OutBuffer out;
+  outbuf_init(&out);
+  int result = 0;
+  if (snap.flags & SNAPSHOT_FLAG_DELTA) {
+    // Pairs of a delta are printed with those its parents left unchanged,
+    // bucket by bucket
+    if (dump_chain(argv[1], &out)) {
+      fprintf(stderr, "Failed to rebuild %s from its parents\n", argv[1]);
+      result = 1;
+    }
+  } else {
+    for (size_t i = 0; i < snap.num_blocks; i++) {
+      if (snapshot_read_block(&snap, i, dump_pair, &out)) {
+        fprintf(stderr, "Corrupted block %zu of %s\n", i, argv[1]);
+        result = 1;
+        break;
+      }
+    }
+  }
+
+  if (outbuf_flush(&out, STDOUT_FILENO)) {
+    result = 1;
+  }
+  outbuf_free(&out);
+  snapshot_close(&snap);
+  return result;
+}